@@ -6,6 +6,7 @@
  */ 
 
 #include <asf.h>
+#include <string.h>
 
 #include "adc_measure.h"
 #include "sys_timer.h"
@@ -13,42 +14,271 @@
 #include "uart.h"
 #include "env.h"
 #include "smbus.h"
+#include "watchdog.h"
+#include "profile.h"
 
 
 #ifndef BOOTLOADER
 
+/*
+ * Index of every channel within a background round, order given by CFG_ADC_CHANNELS
+ */
+#define CFG_ADC_CHANNEL(_name, _channel, _accumulate, _divide) \
+	ADC_IDX_##_name,
+enum adc_round_index {
+	CFG_ADC_CHANNELS
+	ADC_IDX_COUNT
+};
+#undef CFG_ADC_CHANNEL
+
+/*
+ * Per channel ADC setup: input, hardware averaging and the shift to 16 bit full scale
+ */
+#define CFG_ADC_CHANNEL(_name, _channel, _accumulate, _divide) \
+	{ _channel, ADC_AVGCTRL_SAMPLENUM(_accumulate) | ADC_AVGCTRL_ADJRES(_divide), \
+	  (_accumulate) ? ADC_CTRLB_RESSEL_16BIT : ADC_CTRLB_RESSEL_12BIT, 4 - (_accumulate) + (_divide) },
+static const struct {
+	uint8_t channel;
+	uint8_t avgctrl;
+	uint8_t ressel;
+	uint8_t shift;
+} adc_round_channels[ADC_IDX_COUNT] = { CFG_ADC_CHANNELS };
+#undef CFG_ADC_CHANNEL
+
+#define ADC_FULL_SCALE				65536		//all ADC values are scaled to 16 bit
+#define ADC_TEMP_SENSOR_MISSING		(3800UL<<4)	//NTC not connected (3800 at 12 bit)
+
+/*
+ * NTC temperature in 0.1 degC at every 1024th ADC value (16 bit full scale, 65 points).
+ * Generated from the polynomial of determine_temperature() at volts = 2.5 * i * 1024 / 65536,
+ * ntc_temperature() interpolates linearly between the points
+ */
+#define NTC_LUT_SHIFT				10
+static const int16_t ntc_lut[(ADC_FULL_SCALE >> NTC_LUT_SHIFT) + 1] = {
+	1544, 1437, 1341, 1255, 1179, 1110, 1049, 994,
+	945, 901, 861, 825, 792, 762, 734, 709,
+	685, 663, 642, 622, 603, 584, 566, 549,
+	532, 516, 499, 483, 467, 452, 436, 421,
+	406, 391, 376, 361, 346, 332, 317, 303,
+	288, 274, 259, 244, 229, 213, 198, 182,
+	165, 147, 129, 110, 91, 70, 48, 24,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0,
+};
+
+/*
+ * PXIe rails, order given by CFG_ADC_RAILS
+ */
+#define CFG_ADC_RAIL(_name, _divider, _offset, _gain_env, _offset_env) \
+	ADC_RAIL_##_name,
+enum adc_rail_index {
+	CFG_ADC_RAILS
+	ADC_RAIL_COUNT
+};
+#undef CFG_ADC_RAIL
+
+#define CFG_ADC_RAIL(_name, _divider, _offset, _gain_env, _offset_env) \
+	{ ADC_IDX_##_name, _divider, _offset, ENV_##_gain_env, ENV_##_offset_env },
+static const struct {
+	uint8_t index;
+	uint8_t divider;
+	int16_t offset;
+	uint8_t gain_env;
+	uint8_t offset_env;
+} adc_rails[ADC_RAIL_COUNT] = { CFG_ADC_RAILS };
+#undef CFG_ADC_RAIL
+
+/* Calibration variables of all rails, see env_subscribe() */
+#define CFG_ADC_RAIL(_name, _divider, _offset, _gain_env, _offset_env) \
+	ENV_BIT(_gain_env) | ENV_BIT(_offset_env) |
+static const uint64_t adc_rails_cal_env = CFG_ADC_RAILS 0;
+#undef CFG_ADC_RAIL
+
+/*
+ * Rails checked against their limits, also by the ADC window monitor
+ */
+#define CFG_ADC_GUARD(_name, _min, _max) \
+	ADC_GUARD_##_name,
+enum adc_guard_index {
+	CFG_ADC_GUARDS
+	ADC_GUARD_COUNT
+};
+#undef CFG_ADC_GUARD
+
+#define CFG_ADC_GUARD(_name, _min, _max) \
+	{ ADC_RAIL_##_name, _min, _max },
+static const struct {
+	uint8_t rail;
+	uint16_t min;
+	uint16_t max;
+} adc_guards[ADC_GUARD_COUNT] = { CFG_ADC_GUARDS };
+#undef CFG_ADC_GUARD
+
+#define ADC_REFERENCE_MV			2500
+
 static struct adc_module adc_instance;
-uint16_t adc_result_buffer[CFG_ADC_SAMPLES];
-volatile bool adc_read_done = false;
+static uint16_t adc_result;
+static uint8_t adc_round_channel;					//index of the channel currently converted (ISR only)
+static uint16_t adc_round_result[ADC_IDX_COUNT];	//results of the running round (ISR only)
+static uint16_t adc_snapshot[ADC_IDX_COUNT];		//results of the last complete round
+static volatile bool adc_round_busy = false;
+static volatile bool adc_snapshot_ready = false;
+static volatile bool adc_guard_armed = false;
+static volatile bool adc_guard_busy = false;			//a single guard conversion is running
+static uint8_t adc_guard_next;							//guard converted at the next tick (ISR only)
+static uint8_t adc_window_index = ADC_IDX_COUNT;		//channel of the last conversion with armed window (ISR only)
+static volatile uint8_t adc_guard_fault;				//bit per guard that left its window
+static uint16_t adc_guard_low[ADC_GUARD_COUNT];			//limits as ADC values (16 bit full scale), calibration applied
+static uint16_t adc_guard_high[ADC_GUARD_COUNT];
+static int32_t rail_gain[ADC_RAIL_COUNT];
+static int32_t rail_offset[ADC_RAIL_COUNT];
 static uint32_t temperature_1sec_timer;
 static uint8_t temperature[4];
 static uint16_t temperature_adc_value[4];
-static float voltage[5];
-static uint16_t voltage_adc_value[5];
+static uint16_t voltage[ADC_RAIL_COUNT];				//mV
+static uint16_t voltage_adc_value[ADC_RAIL_COUNT];
 static uint16_t learned_temps_available;
 static uint8_t pwr_ok=0;
 
+static void adc_round_convert(struct adc_module *const module, uint8_t index);
+static void adc_guard_window(struct adc_module *const module, uint8_t index);
+static void adc_guard_trip(uint8_t guard);
 static void adc_complete_callback(struct adc_module *const module);
-static uint16_t start_adc(char channel);
+static void adc_window_callback(struct adc_module *const module);
+static void adc_round_start(void);
+static bool adc_round_fetch(void);
+static void adc_round_blocking(void);
 static float determine_temperature(float adc_value);
+static void temperature_calculate(void);
+static void voltages_calculate(void);
+static uint16_t rail_millivolt(uint8_t rail, uint16_t adc_value);
+static uint16_t rail_adc_value(uint8_t rail, int32_t millivolt);
+static void voltages_load_calibration(void);
+static void voltages_calibration_changed(uint64_t changed);
 static void temperture_get_values(void);
 static void check_temp_fail(void);
 static void measure_sync_to_smbus(void);
 
 
 /*
- * If all ADC conversions are complete (CFG_ADC_SAMPLES), the Routine is called
+ * Select the input and the hardware averaging of a channel and start its conversion.
+ * The ADC accumulates all samples of the channel itself and raises one interrupt
+ */
+static void adc_round_convert(struct adc_module *const module, uint8_t index)
+{
+	Adc *const adc_hw = module->hw;
+	
+	adc_set_positive_input(module, adc_round_channels[index].channel);
+	adc_hw->AVGCTRL.reg = adc_round_channels[index].avgctrl;
+	while (adc_is_syncing(module))
+	{
+	}
+	adc_hw->CTRLB.reg = (adc_hw->CTRLB.reg & ~ADC_CTRLB_RESSEL_Msk) | adc_round_channels[index].ressel;
+	adc_guard_window(module, index);
+	adc_read_buffer_job(module, &adc_result, 1);
+}
+
+/*
+ * Arm the window monitor for the next conversion, if the channel is a guarded rail.
+ * The limits are converted to the resolution of the channel
+ */
+static void adc_guard_window(struct adc_module *const module, uint8_t index)
+{
+	uint8_t shift = adc_round_channels[index].shift;
+	
+	if(adc_guard_armed)
+	{
+		for(uint8_t guard=0; guard<ADC_GUARD_COUNT; guard++)
+		{
+			if(adc_rails[adc_guards[guard].rail].index == index)
+			{
+				adc_set_window_mode(module, ADC_WINDOW_MODE_BETWEEN_INVERTED, adc_guard_low[guard] >> shift, adc_guard_high[guard] >> shift);
+				return;
+			}
+		}
+	}
+	adc_set_window_mode(module, ADC_WINDOW_MODE_DISABLE, 0, 0);
+}
+
+/*
+ * Check a conversion result (16 bit full scale) of a guarded rail against its limits
+ * return true if the rail is outside its window
+ */
+bool adc_guard_check(uint8_t guard, uint16_t adc_value)
+{
+	return (adc_value <= adc_guard_low[guard]) || (adc_value >= adc_guard_high[guard]);
+}
+
+/*
+ * A guarded rail left its window: clear Power OK to the Embedded Controller at once,
+ * do_power_management() turns the voltages off
+ */
+static void adc_guard_trip(uint8_t guard)
+{
+	adc_guard_armed = false;
+	adc_guard_fault |= (1<<guard);
+	ioport_set_pin_level(CFG_PWR_OK_UC_N, 1);
+}
+
+/*
+ * Called in interrupt context when the window monitor detected a result outside the limits.
+ * The RESRDY part of the same interrupt already started the next conversion, so the
+ * channel is taken from adc_window_index
+ */
+static void adc_window_callback(struct adc_module *const module)
+{
+	PROFILE_ISR(PROFILE_ISR_ADC);
+	uint8_t index = adc_window_index;
+	
+	for(uint8_t guard=0; guard<ADC_GUARD_COUNT; guard++)
+	{
+		if((adc_rails[adc_guards[guard].rail].index == index) && adc_guard_armed && adc_guard_check(guard, adc_result << adc_round_channels[index].shift))
+		{
+			adc_guard_trip(guard);
+		}
+	}
+}
+
+/*
+ * Called in interrupt context when the (hardware averaged) conversion of one channel is done.
+ * Stores the result and starts the next channel of the round. After the last channel
+ * the complete round is published as snapshot for do_measure()
  */
 static void adc_complete_callback(struct adc_module *const module)
 {
-	adc_read_done = true; //All conversions are done
+	PROFILE_ISR(PROFILE_ISR_ADC);
+	if(adc_guard_busy)
+	{
+		adc_window_index = adc_rails[adc_guards[adc_guard_next].rail].index;
+		adc_guard_next = (adc_guard_next + 1) % ADC_GUARD_COUNT;
+		adc_guard_busy = false;
+		if(adc_round_busy) //round was requested during the guard conversion
+		{
+			adc_round_convert(module, adc_round_channel);
+		}
+		return;
+	}
+	
+	adc_window_index = adc_round_channel;
+	adc_round_result[adc_round_channel] = adc_result << adc_round_channels[adc_round_channel].shift;
+	
+	if(++adc_round_channel < ADC_IDX_COUNT)
+	{
+		adc_round_convert(module, adc_round_channel);
+		return;
+	}
+	
+	memcpy(adc_snapshot, adc_round_result, sizeof(adc_snapshot));
+	adc_snapshot_ready = true;
+	adc_round_busy = false;
 }
 
 /*
  * Configure the ADC Module
  * ADC_CLK = 8MHz/8
  * ADC Reference 2,5V
- * The ACD Channel Pin is choosed at the function start_adc
+ * The ACD Channel Pin, resolution and hardware averaging are choosed per channel
+ * by the background round (CFG_ADC_CHANNELS)
  */
 void adc_measure_init(void)
 {
@@ -63,37 +293,143 @@ void adc_measure_init(void)
 	adc_init(&adc_instance, ADC, &config_adc);
 	adc_enable(&adc_instance);
 	
+	voltages_load_calibration();
+	env_subscribe(adc_rails_cal_env, voltages_calibration_changed);
+	
 	adc_register_callback(&adc_instance, adc_complete_callback, ADC_CALLBACK_READ_BUFFER);
 	adc_enable_callback(&adc_instance, ADC_CALLBACK_READ_BUFFER);
+	adc_register_callback(&adc_instance, adc_window_callback, ADC_CALLBACK_WINDOW);
+	adc_enable_callback(&adc_instance, ADC_CALLBACK_WINDOW);
+}
+
+/*
+ * Called from the system timer every millisecond: convert the next guarded rail,
+ * if the guard is armed and no measurement round is running
+ */
+void adc_guard_tick(void)
+{
+	system_interrupt_enter_critical_section();
+	if(adc_guard_armed && !adc_round_busy && !adc_guard_busy)
+	{
+		adc_guard_busy = true;
+		adc_round_convert(&adc_instance, adc_rails[adc_guards[adc_guard_next].rail].index);
+	}
+	system_interrupt_leave_critical_section();
+}
+
+/*
+ * Arm/disarm the window monitor guard, e.g. while the PXIe voltages are on
+ */
+void adc_guard_arm(bool arm)
+{
+#if CFG_ADC_GUARD_ENABLE
+	if(arm)
+	{
+		adc_guard_fault = 0;
+	}
+	adc_guard_armed = arm;
+#endif
 }
 
+/*
+ * return and clear the guards which left their window since the last call
+ */
+uint8_t adc_guard_fault_get(void)
+{
+	uint8_t fault;
+	
+	system_interrupt_enter_critical_section();
+	fault = adc_guard_fault;
+	adc_guard_fault = 0;
+	system_interrupt_leave_critical_section();
+	
+	return fault;
+}
 
 /*
- * function parameter: channel = ADC channel(Pin)
- * set ADC channel
- * Start conversion and wait until all conversions are done(CFG_ADC_SAMPLES)
- * return the average of all CFG_ADC_SAMPLES
+ * Feed a rail voltage (mV at the rail) through the guard, as if it was converted by the ADC
+ * return true if the guard tripped
  */
-static uint16_t start_adc(char channel)
+bool adc_guard_inject(uint8_t guard, uint32_t millivolt)
 {
-	static uint32_t adc_result_average=0;
-	adc_set_positive_input(&adc_instance, channel);
-	adc_read_done = false;
-	adc_read_buffer_job(&adc_instance, adc_result_buffer, CFG_ADC_SAMPLES);
-	while (adc_read_done == false) //wait until all conversions are done
+	if((guard >= ADC_GUARD_COUNT) || !adc_guard_armed)
+	{
+		return false;
+	}
+	if(!adc_guard_check(guard, rail_adc_value(adc_guards[guard].rail, millivolt)))
 	{
+		return false;
 	}
-	adc_result_average = 0;
-	for(int i=0; i<CFG_ADC_SAMPLES; i++)
+	system_interrupt_enter_critical_section();
+	adc_guard_trip(guard);
+	system_interrupt_leave_critical_section();
+	
+	return true;
+}
+
+
+/*
+ * Start a new round over all channels in the background, if none is running
+ */
+static void adc_round_start(void)
+{
+	system_interrupt_enter_critical_section();
+	if(!adc_round_busy)
 	{
-		adc_result_average += adc_result_buffer[i];
+		adc_round_busy = true;
+		adc_round_channel = 0;
+		if(!adc_guard_busy) //otherwise started when the guard conversion is done
+		{
+			adc_round_convert(&adc_instance, 0);
+		}
 	}
-	adc_result_average = adc_result_average/CFG_ADC_SAMPLES; //determine the average of all conversions
-	return (uint16_t) adc_result_average;
+	system_interrupt_leave_critical_section();
 }
 
 /*
- * Determine the temperature with a polynomial
+ * Take over the last complete round, if a new one is available
+ * return true if the measured values were updated
+ */
+static bool adc_round_fetch(void)
+{
+	if(!adc_snapshot_ready)
+	{
+		return false;
+	}
+	
+	system_interrupt_enter_critical_section();
+	for(int i=0; i<4; i++)
+	{
+		temperature_adc_value[i] = adc_snapshot[ADC_IDX_TEMP_IN+i];
+	}
+	for(int i=0; i<ADC_RAIL_COUNT; i++)
+	{
+		voltage_adc_value[i] = adc_snapshot[adc_rails[i].index];
+	}
+	adc_snapshot_ready = false;
+	system_interrupt_leave_critical_section();
+	
+	return true;
+}
+
+/*
+ * Run a fresh round and wait for it. Only used by the learn mode at startup,
+ * the main loop never waits for the ADC
+ */
+static void adc_round_blocking(void)
+{
+	while(adc_round_busy) //a round started before may contain old values
+	{
+	}
+	adc_snapshot_ready = false;
+	adc_round_start();
+	while(!adc_round_fetch())
+	{
+	}
+}
+
+/*
+ * Determine the temperature with a polynomial (float reference for ntc_temperature())
  */
 static float determine_temperature(float adc_value)
 {
@@ -112,35 +448,80 @@ static float determine_temperature(float adc_value)
 }
 
 /*
- * Check whether the PXIe voltages are between the ATX specification
+ * Determine the NTC temperature in 0.1 degC from the ADC value (16 bit full scale)
+ * with the lookup table, integer math only
  */
-void check_voltage_ok(void)
+int16_t ntc_temperature(uint16_t adc_value)
 {
-	if((CFG_REFERENCE_3V3_MIN < voltage[0]) && (voltage[0] < CFG_REFERENCE_3V3_MAX))
-	{
-		pwr_ok |= (1<<0);
-	}
-	else
-	{
-		pwr_ok &= ~(1<<0);
-	}
+	uint16_t i = adc_value >> NTC_LUT_SHIFT;
+	int32_t frac = adc_value & ((1 << NTC_LUT_SHIFT) - 1);
+	
+	return ntc_lut[i] + (int16_t) (((ntc_lut[i+1] - ntc_lut[i]) * frac) >> NTC_LUT_SHIFT);
+}
+
+/*
+ * Compare the lookup table against the polynomial over the whole ADC range and
+ * measure the runtime of both conversions
+ */
+void ntc_selftest(void)
+{
+	int32_t error, max_error=0;
+	uint16_t max_error_adc=0;
+	uint32_t start, lut_time, float_time;
+	volatile int32_t sink;
 	
-	if((CFG_REFERENCE_5V_MIN < voltage[1]) && (voltage[1] < CFG_REFERENCE_5V_MAX))
+	for(uint32_t adc_value=0; adc_value<ADC_FULL_SCALE; adc_value+=16)
 	{
-		pwr_ok |= (1<<1);
+		error = ntc_temperature(adc_value) - (int32_t) (10 * determine_temperature(((float)2.5*adc_value)/ADC_FULL_SCALE));
+		if(error < 0)
+		{
+			error = -error;
+		}
+		WDT_RESET;
+		if(error > max_error)
+		{
+			max_error = error;
+			max_error_adc = adc_value;
+		}
 	}
-	else
+	printf("Max. error: %ld.%ld degC at ADC value %u\r\n", max_error/10, max_error%10, max_error_adc);
+	
+	start = get_jiffies();
+	for(uint32_t adc_value=0; adc_value<ADC_FULL_SCALE; adc_value+=16)
 	{
-		pwr_ok &= ~(1<<1);
+		sink = ntc_temperature(adc_value);
+		WDT_RESET;
 	}
+	lut_time = get_jiffies() - start;
 	
-	if((CFG_REFERENCE_12V_MIN < voltage[3]) && (voltage[3] < CFG_REFERENCE_12V_MAX))
+	start = get_jiffies();
+	for(uint32_t adc_value=0; adc_value<ADC_FULL_SCALE; adc_value+=16)
 	{
-		pwr_ok |= (1<<2);
+		sink = (int32_t) determine_temperature(((float)2.5*adc_value)/ADC_FULL_SCALE);
+		WDT_RESET;
 	}
-	else
+	float_time = get_jiffies() - start;
+	(void)sink;
+	
+	printf("%d conversions: lookup table %lu ms, polynomial %lu ms\r\n", ADC_FULL_SCALE/16, lut_time, float_time);
+}
+
+/*
+ * Check whether the PXIe voltages are between the ATX specification.
+ * The limits are compared as ADC values, bit n of pwr_ok belongs to guard n (3V3, 5V, 12V)
+ */
+void check_voltage_ok(void)
+{
+	for(uint8_t guard=0; guard<ADC_GUARD_COUNT; guard++)
 	{
-		pwr_ok &= ~(1<<2);
+		if(!adc_guard_check(guard, voltage_adc_value[adc_guards[guard].rail]))
+		{
+			pwr_ok |= (1<<guard);
+		}
+		else
+		{
+			pwr_ok &= ~(1<<guard);
+		}
 	}
 }
 
@@ -153,42 +534,101 @@ uint8_t read_pwr_ok (void)
 }
 
 /*
- * Measure the temperatures
+ * Convert the temperature ADC values
  */
-static void temperture_get_values(void)
-{	
-	temperature_adc_value[0] = start_adc(CFG_ADC_CHANNEL_TEMP_IN);
-	temperature[0] = (uint8_t) determine_temperature(((float)2.5*temperature_adc_value[0])/4096);
-	
-	temperature_adc_value[1] = start_adc(CFG_ADC_CHANNEL_TEMP_OUT1);
-	temperature[1] = (uint8_t) determine_temperature(((float)2.5*temperature_adc_value[1])/4096);
+static void temperature_calculate(void)
+{
+	for(int i=0; i<4; i++)
+	{
+		temperature[i] = (uint8_t) (ntc_temperature(temperature_adc_value[i]) / 10);
+	}
+}
+
+/*
+ * Convert the ADC value (16 bit full scale) of a rail to mV at the rail, calibration applied
+ */
+static uint16_t rail_millivolt(uint8_t rail, uint16_t adc_value)
+{
+	int32_t millivolt;
 	
-	temperature_adc_value[2] = start_adc(CFG_ADC_CHANNEL_TEMP_OUT2);
-	temperature[2] = (uint8_t) determine_temperature(((float)2.5*temperature_adc_value[2])/4096);
+	millivolt = ((uint32_t)adc_value * ADC_REFERENCE_MV * adc_rails[rail].divider) >> 16;
+	millivolt = millivolt * rail_gain[rail] / CFG_ADC_CAL_GAIN_UNITY + rail_offset[rail];
 	
-	temperature_adc_value[3] = start_adc(CFG_ADC_CHANNEL_TEMP_OUT3);
-	temperature[3] = (uint8_t) determine_temperature(((float)2.5*temperature_adc_value[3])/4096);
+	return (uint16_t) max(0, min(millivolt, 0xFFFF));
 }
 
 /*
- * Measure the PXIe voltages
+ * Convert mV at the rail back to the ADC value (16 bit full scale), calibration applied
  */
-void voltages_get_values(void)
-{	
-	voltage_adc_value[0] = start_adc(CFG_ADC_CHANNEL_3V3);
-	voltage[0] = 2 * 2.5 * (((float)voltage_adc_value[0])/4096);
-	
-	voltage_adc_value[1] = start_adc(CFG_ADC_CHANNEL_5V);
-	voltage[1] = 3 * 2.5 * (((float)voltage_adc_value[1])/4096);
+static uint16_t rail_adc_value(uint8_t rail, int32_t millivolt)
+{
+	uint32_t adc_millivolt;
 	
-	voltage_adc_value[2] = start_adc(CFG_ADC_CHANNEL_5VAUX);
-	voltage[2] = 3 * 2.5 * (((float)voltage_adc_value[2])/4096);
+	millivolt = (millivolt - rail_offset[rail]) * CFG_ADC_CAL_GAIN_UNITY / rail_gain[rail];
+	adc_millivolt = max(0, min(millivolt, ADC_REFERENCE_MV * adc_rails[rail].divider));
 	
-	voltage_adc_value[3] = start_adc(CFG_ADC_CHANNEL_12V);
-	voltage[3] = 6 * 2.5 * (((float)voltage_adc_value[3])/4096);
+	return (uint16_t) min((adc_millivolt << 16) / (ADC_REFERENCE_MV * adc_rails[rail].divider), ADC_FULL_SCALE - 1);
+}
+
+/*
+ * Load the calibration of the rails from the environment and
+ * precompute the limits of the guarded rails as ADC values
+ */
+static void voltages_load_calibration(void)
+{
+	for(uint8_t rail=0; rail<ADC_RAIL_COUNT; rail++)
+	{
+		rail_gain[rail] = (int32_t) env_get((enum env_index)adc_rails[rail].gain_env);
+		if(rail_gain[rail] <= 0)
+		{
+			rail_gain[rail] = CFG_ADC_CAL_GAIN_UNITY;
+		}
+		rail_offset[rail] = adc_rails[rail].offset + (int32_t) env_get((enum env_index)adc_rails[rail].offset_env);
+	}
 	
-	voltage_adc_value[4] = start_adc(CFG_ADC_CHANNEL_M12V);
-	voltage[4] = 6 * 2.5 * (((float)voltage_adc_value[4])/4096)+0.29; //Add +0,29 because of the offset of the OP-Amplifier 
+	for(uint8_t guard=0; guard<ADC_GUARD_COUNT; guard++)
+	{
+		adc_guard_low[guard] = rail_adc_value(adc_guards[guard].rail, adc_guards[guard].min);
+		adc_guard_high[guard] = rail_adc_value(adc_guards[guard].rail, adc_guards[guard].max);
+	}
+}
+
+/*
+ * Reload the calibration after a cal_* variable was changed (called from do_env)
+ */
+static void voltages_calibration_changed(uint64_t changed)
+{
+	(void)changed;
+	voltages_load_calibration();
+}
+
+/*
+ * Convert the PXIe voltage ADC values to mV
+ */
+static void voltages_calculate(void)
+{
+	for(uint8_t rail=0; rail<ADC_RAIL_COUNT; rail++)
+	{
+		voltage[rail] = rail_millivolt(rail, voltage_adc_value[rail]);
+	}
+}
+
+/*
+ * Measure the temperatures (blocking)
+ */
+static void temperture_get_values(void)
+{	
+	adc_round_blocking();
+	temperature_calculate();
+}
+
+/*
+ * Measure the PXIe voltages (blocking)
+ */
+void voltages_get_values(void)
+{	
+	adc_round_blocking();
+	voltages_calculate();
 }
 
 /*
@@ -217,7 +657,7 @@ static void check_temp_fail(void)
 		{
 			if(i==0)
 			{
-				if((temperature_adc_value[i] > 3800) || (smbus_get_input_reg(SMBUS_REG__TEMP_AIR_INLET)>55))
+				if((temperature_adc_value[i] > ADC_TEMP_SENSOR_MISSING) || (smbus_get_input_reg(SMBUS_REG__TEMP_AIR_INLET)>55))
 				{
 					temperature_fail |= (1<<i);
 				}
@@ -228,7 +668,7 @@ static void check_temp_fail(void)
 			}
 			else
 			{
-				if((temperature_adc_value[i] > 3800) || ((smbus_get_input_reg(SMBUS_REG__TEMP_AIR_INLET+i) > alarm_threshold_out) && (smbus_get_input_reg(SMBUS_REG__REMOTE)==0)))
+				if((temperature_adc_value[i] > ADC_TEMP_SENSOR_MISSING) || ((smbus_get_input_reg(SMBUS_REG__TEMP_AIR_INLET+i) > alarm_threshold_out) && (smbus_get_input_reg(SMBUS_REG__REMOTE)==0)))
 				{
 					temperature_fail |= (1<<i);
 				}
@@ -248,7 +688,7 @@ static void check_temp_fail(void)
  */
 void load_learned_temp_values(void)
 {
-	learned_temps_available = env_get("learned_temperature_sensors");
+	learned_temps_available = env_get(ENV_learned_temperature_sensors);
 }
 
 /*
@@ -263,7 +703,7 @@ void learn_temp(void)
 	
 	for(uint8_t i=0; i<4; i++)
 	{
-		if(temperature_adc_value[i] < 3800)
+		if(temperature_adc_value[i] < ADC_TEMP_SENSOR_MISSING)
 		{
 			temp_available |= (1<<i);
 			temp_count++;
@@ -283,11 +723,11 @@ void learn_temp(void)
 		}
 	}
 	
-	env_set("learned_temperature_sensors", (uint32_t)temp_available);
-	env_set("temperature_learned_sensor1", (uint32_t)temperature[0]);
-	env_set("temperature_learned_sensor2", (uint32_t)temperature[1]);
-	env_set("temperature_learned_sensor3", (uint32_t)temperature[2]);
-	env_set("temperature_learned_sensor4", (uint32_t)temperature[3]);
+	env_set(ENV_learned_temperature_sensors, (uint32_t)temp_available);
+	env_set(ENV_temperature_learned_sensor1, (uint32_t)temperature[0]);
+	env_set(ENV_temperature_learned_sensor2, (uint32_t)temperature[1]);
+	env_set(ENV_temperature_learned_sensor3, (uint32_t)temperature[2]);
+	env_set(ENV_temperature_learned_sensor4, (uint32_t)temperature[3]);
 }
 
 /*
@@ -295,33 +735,35 @@ void learn_temp(void)
  */
 static void measure_sync_to_smbus(void)
 {
-	smbus_set_input_reg(SMBUS_REG__TEMP_AIR_INLET, temperature[0]);
-	smbus_set_input_reg(SMBUS_REG__TEMP_AIR_OUTLET1, temperature[1]);
-	smbus_set_input_reg(SMBUS_REG__TEMP_AIR_OUTLET2, temperature[2]);
-	smbus_set_input_reg(SMBUS_REG__TEMP_AIR_OUTLET3, temperature[3]);
+	smbus_frame_set_byte(SMBUS_REG__TEMP_AIR_INLET, temperature[0]);
+	smbus_frame_set_byte(SMBUS_REG__TEMP_AIR_OUTLET1, temperature[1]);
+	smbus_frame_set_byte(SMBUS_REG__TEMP_AIR_OUTLET2, temperature[2]);
+	smbus_frame_set_byte(SMBUS_REG__TEMP_AIR_OUTLET3, temperature[3]);
 	
-	smbus_set_input_reg(SMBUS_REG__3V3_LOW_BYTE, ((uint32_t)(1000*voltage[0])) & 0xFF);
-	smbus_set_input_reg(SMBUS_REG__3V3_HIGH_BYTE, (((uint32_t)(1000*voltage[0]))>>8) & 0xFF);
-	smbus_set_input_reg(SMBUS_REG__5V_LOW_BYTE, ((uint32_t)(1000*voltage[1])) & 0xFF);
-	smbus_set_input_reg(SMBUS_REG__5V_HIGH_BYTE, (((uint32_t)(1000*voltage[1]))>>8) & 0xFF);
-	smbus_set_input_reg(SMBUS_REG__5VAUX_LOW_BYTE, ((uint32_t)(1000*voltage[2])) & 0xFF);
-	smbus_set_input_reg(SMBUS_REG__5VAUX_HIGH_BYTE, (((uint32_t)(1000*voltage[2]))>>8) & 0xFF);
-	smbus_set_input_reg(SMBUS_REG__12V_LOW_BYTE, ((uint32_t)(1000*voltage[3])) & 0xFF);
-	smbus_set_input_reg(SMBUS_REG__12V_HIGH_BYTE, (((uint32_t)(1000*voltage[3]))>>8) & 0xFF);
-	smbus_set_input_reg(SMBUS_REG__M12V_LOW_BYTE, ((uint32_t)(1000*voltage[4])) & 0xFF);
-	smbus_set_input_reg(SMBUS_REG__M12V_HIGH_BYTE, (((uint32_t)(1000*voltage[4]))>>8) & 0xFF);
+	smbus_frame_set_word(SMBUS_REG__3V3_LOW_BYTE, voltage[ADC_RAIL_3V3]);
+	smbus_frame_set_word(SMBUS_REG__5V_LOW_BYTE, voltage[ADC_RAIL_5V]);
+	smbus_frame_set_word(SMBUS_REG__5VAUX_LOW_BYTE, voltage[ADC_RAIL_5VAUX]);
+	smbus_frame_set_word(SMBUS_REG__12V_LOW_BYTE, voltage[ADC_RAIL_12V]);
+	smbus_frame_set_word(SMBUS_REG__M12V_LOW_BYTE, voltage[ADC_RAIL_M12V]);
+	smbus_telemetry_commit();
 }
 
 /*
- * Measure, check, sync the temperature and voltage every second
+ * Start a new ADC round every second and evaluate a round as soon as it is complete.
+ * Never waits for the ADC
  */
 void do_measure(void)
 {
 	if (get_jiffies() - temperature_1sec_timer >= 1000) 
 	{
 		temperature_1sec_timer = get_jiffies();
-		temperture_get_values();
-		voltages_get_values();
+		adc_round_start();
+	}
+	
+	if(adc_round_fetch())
+	{
+		temperature_calculate();
+		voltages_calculate();
 		check_temp_fail();
 		check_voltage_ok();
 		measure_sync_to_smbus();
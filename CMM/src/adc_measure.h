@@ -9,6 +9,13 @@
 #define TEMPERATURE_H_
 
 void adc_measure_init(void);
+void adc_guard_tick(void);
+void adc_guard_arm(bool arm);
+uint8_t adc_guard_fault_get(void);
+bool adc_guard_check(uint8_t guard, uint16_t adc_value);
+bool adc_guard_inject(uint8_t guard, uint32_t millivolt);
+int16_t ntc_temperature(uint16_t adc_value);
+void ntc_selftest(void);
 void check_voltage_ok(void);
 uint8_t read_pwr_ok (void);
 void voltages_get_values(void);
@@ -17,6 +17,12 @@
 #include "sys_timer.h"
 #include "watchdog.h"
 #include "env.h"
+#include "adc_measure.h"
+#include "i2c_master.h"
+#include "crc.h"
+#include "log.h"
+#include "sched.h"
+#include "profile.h"
 
 #ifndef BOOTLOADER
 
@@ -45,6 +51,8 @@ struct cli_cmd_entry {
 
 static int cli_cmd_reset(int argc, char **argv)
 {
+	env_flush();
+	log_flush();
 	SYSTEM_RESET;
 	/* NOTREACHED */
 	
@@ -55,6 +63,7 @@ static int cli_cmd_printenv(int argc, char **argv)
 {
 	char *var;
 	uint32_t val;
+	int idx;
 	
 	if (argc > 1) {
 		printf("Invalid arguments\r\n");
@@ -64,16 +73,75 @@ static int cli_cmd_printenv(int argc, char **argv)
 		env_print_all();
 		} else {
 		var = argv[0];
-		if (env_find(var) < 0) {
+		idx = env_find(var);
+		if (idx < 0) {
 			printf("Variable %s not found\r\n", var);
 			return -1;
 		}
-		val = env_get(var);
+		val = env_get((enum env_index)idx);
 		printf("%s = %lu\r\n", var, val);
 	}
 	return 0;
 }
 
+static int cli_cmd_setenv(int argc, char **argv)
+{
+	char *end;
+	int idx;
+	
+	if (argc != 2) {
+		printf("Invalid arguments\r\n");
+		return -1;
+	}
+	idx = env_find(argv[0]);
+	if (idx < 0) {
+		printf("Variable %s not found\r\n", argv[0]);
+		return -1;
+	}
+	env_set((enum env_index)idx, strtoul(argv[1], &end, 0));
+	
+	return 0;
+}
+
+static int cli_cmd_env_bench(int argc, char **argv)
+{
+	env_benchmark();
+	
+	return 0;
+}
+
+static int cli_cmd_tasks(int argc, char **argv)
+{
+	if (argc == 1 && !strcmp(argv[0], "clear")) {
+		sched_clear_stats();
+		return 0;
+	}
+	if (argc) {
+		printf("Invalid arguments\r\n");
+		return -1;
+	}
+	sched_print_stats();
+	
+	return 0;
+}
+
+#ifdef CFG_PROFILE
+static int cli_cmd_profile(int argc, char **argv)
+{
+	if (argc == 1 && !strcmp(argv[0], "clear")) {
+		profile_clear();
+		return 0;
+	}
+	if (argc) {
+		printf("Invalid arguments\r\n");
+		return -1;
+	}
+	profile_print();
+	
+	return 0;
+}
+#endif
+
 static int cli_cmd_flash_read(int argc, char **argv)
 {
 	uint32_t addr, len;
@@ -252,6 +320,47 @@ static int cli_cmd_hang(int argc, char **argv)
 	return 0;
 }
 
+static int cli_cmd_adc_inject(int argc, char **argv)
+{
+	uint32_t guard, millivolt;
+	char *end;
+	
+	if (argc != 2) {
+		printf("Invalid arguments\r\n");
+		return -1;
+	}
+	guard = strtoul(argv[0], &end, 0);
+	millivolt = strtoul(argv[1], &end, 0);
+	if (adc_guard_inject(guard, millivolt)) {
+		printf("Guard %lu tripped\r\n", guard);
+	} else {
+		printf("Guard %lu not tripped (within limits or not armed)\r\n", guard);
+	}
+	
+	return 0;
+}
+
+static int cli_cmd_ntc_test(int argc, char **argv)
+{
+	ntc_selftest();
+	
+	return 0;
+}
+
+static int cli_cmd_crc_bench(int argc, char **argv)
+{
+	crc_benchmark();
+	
+	return 0;
+}
+
+static int cli_cmd_i2c_stats(int argc, char **argv)
+{
+	i2c_shadow_stats();
+	
+	return 0;
+}
+
 static int cli_cmd_systick(int argc, char **argv)
 {
 	printf("%ld\r\n", get_jiffies());
@@ -280,6 +389,18 @@ static struct cli_cmd_entry cli_cmd_switch[] = {
 		"Print an environment variable (or all variables, if var is omitted)",
 		cli_cmd_printenv
 	},
+	{
+		"setenv",
+		"var, value",
+		"Set an environment variable (saved to EEPROM, applied by the subscribed modules)",
+		cli_cmd_setenv
+	},
+	{
+		"env_bench",
+		"",
+		"Show the environment journal state and measure the recovery time",
+		cli_cmd_env_bench
+	},
 	{
 		"reset",
 		"",
@@ -292,6 +413,44 @@ static struct cli_cmd_entry cli_cmd_switch[] = {
 		"Get current system timer counter",
 		cli_cmd_systick
 	},
+	{
+		"tasks",
+		"[clear]",
+		"Print the main loop task statistics (runs, deadline misses, max. lateness and run time in ms)",
+		cli_cmd_tasks
+	},
+#ifdef CFG_PROFILE
+	{
+		"profile",
+		"[clear]",
+		"Print the execution times of the tasks and interrupt handlers and the loop period histogram",
+		cli_cmd_profile
+	},
+#endif
+	{
+		"adc_inject",
+		"guard, mV",
+		"Inject a rail voltage into the ADC window monitor guard (0: 3V3, 1: 5V, 2: 12V)",
+		cli_cmd_adc_inject
+	},
+	{
+		"ntc_test",
+		"",
+		"Compare the NTC lookup table against the polynomial (accuracy and runtime)",
+		cli_cmd_ntc_test
+	},
+	{
+		"crc_bench",
+		"",
+		"Compare the CRC8/CRC16 implementation against the bitwise loop (results and runtime)",
+		cli_cmd_crc_bench
+	},
+	{
+		"i2c_stats",
+		"",
+		"Show the I2C shadow register hits, misses and read back failures",
+		cli_cmd_i2c_stats
+	},
 	{
 		"flash_read",
 		"addr, len",
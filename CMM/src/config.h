@@ -33,6 +33,9 @@
 
 #define CFG_WDT_TIMEOUT				3 /* seconds */
 
+/* CRC8 (PEC) and CRC16 implementation: CRC_TABLE_NONE, CRC_TABLE_NIBBLE or CRC_TABLE_BYTE (see crc.h) */
+#define CFG_CRC_TABLE				CRC_TABLE_BYTE
+
 /* debugging */
 #define CFG_TEST_SIGNAL				PIN_PA17
 
@@ -67,6 +70,7 @@
 
 #define	CFG_EXT_PS_ON_IN_INT	  PIN_PA11A_EIC_EXTINT11
 #define	CFG_EXT_PS_ON_IN_MUX	  MUX_PA11A_EIC_EXTINT11
+#define CFG_PS_ON_DEBOUNCE		  5		//msec the PS_ON inputs must be stable before they are evaluated
 
 /* Fan configuration */
 #define CFG_PWM_MODULE					TC1
@@ -74,7 +78,10 @@
 #define CFG_PWM1_PIN					PIN_PA10E_TC1_WO0
 #define CFG_PWM1_MUX					MUX_PA10E_TC1_WO0
 #define CFG_MAX_FAN_COUNT				6
-#define CFG_TACHO_MODULE				TC4
+#define CFG_TACHO_UPDATE				100		//msec between two RPM updates
+#define CFG_TACHO_STALL_TIMEOUT			300		//msec without tacho pulse until a fan is reported with 0 rpm
+#define CFG_TACHO_MAX_RPM				30000	//shorter pulse periods are rejected as glitches
+#define CFG_TACHO_FILTER				2		//RPM filter: new = old + (measured - old) / 2^n
 #define	CFG_INT0_PIN_FAN1				PIN_PB16A_EIC_EXTINT0
 #define	CFG_INT0_MUX_FAN1				MUX_PB16A_EIC_EXTINT0
 #define	CFG_INT1_PIN_FAN2				PIN_PB17A_EIC_EXTINT1
@@ -96,9 +103,13 @@
 #define CFG_PWM_CHANGE_DELAY			2	//100msec+(value x 100msec). Delay for change the PWM in % steps.
 #define CFG_MAX_PWM						100
 #define CFG_MIN_PWM 					20
+#define CFG_FAN_CONTROL					0	//0 = PWM from the fan curve, 1 = closed loop RPM control
+#define CFG_FAN_PID_SCALE				256	//PID gains are given in 1/CFG_FAN_PID_SCALE % PWM per 0.1% speed error
+#define CFG_FAN_PID_KP					16
+#define CFG_FAN_PID_KI					2
+#define CFG_FAN_PID_KD					0
 
 /* adc_measure configuration */
-#define CFG_ADC_SAMPLES					20 //number of ADC Conversions used for averaging the adc value result
 #define CFG_ADC_CHANNEL_TEMP_IN			2
 #define CFG_ADC_CHANNEL_TEMP_OUT1		15
 #define CFG_ADC_CHANNEL_TEMP_OUT2		14
@@ -108,12 +119,59 @@
 #define CFG_ADC_CHANNEL_12V				10
 #define CFG_ADC_CHANNEL_M12V			11
 #define CFG_ADC_CHANNEL_3V3				3
-#define CFG_REFERENCE_3V3_MIN			2.97f
-#define CFG_REFERENCE_3V3_MAX			3.63f
-#define CFG_REFERENCE_5V_MIN			4.5f
-#define CFG_REFERENCE_5V_MAX			5.5f
-#define CFG_REFERENCE_12V_MIN			10.8f
-#define CFG_REFERENCE_12V_MAX			13.2f
+
+/*
+ * ADC channels measured in one background round (temperatures first, then the rails):
+ *
+ * CFG_ADC_CHANNEL(name, channel, accumulate, divide)
+ * accumulate: 2^n conversions are summed up by the ADC hardware (0..4)
+ * divide: the sum is divided by 2^n by the ADC hardware (0..7)
+ * effective resolution = 12 + accumulate - divide bits, all results are scaled to 16 bit full scale
+ */
+#define CFG_ADC_CHANNELS				CFG_ADC_CHANNEL(TEMP_IN, CFG_ADC_CHANNEL_TEMP_IN, 4, 2) \
+										CFG_ADC_CHANNEL(TEMP_OUT1, CFG_ADC_CHANNEL_TEMP_OUT1, 4, 2) \
+										CFG_ADC_CHANNEL(TEMP_OUT2, CFG_ADC_CHANNEL_TEMP_OUT2, 4, 2) \
+										CFG_ADC_CHANNEL(TEMP_OUT3, CFG_ADC_CHANNEL_TEMP_OUT3, 4, 2) \
+										CFG_ADC_CHANNEL(3V3, CFG_ADC_CHANNEL_3V3, 2, 1) \
+										CFG_ADC_CHANNEL(5V, CFG_ADC_CHANNEL_5V, 2, 1) \
+										CFG_ADC_CHANNEL(5VAUX, CFG_ADC_CHANNEL_5VAUX, 2, 1) \
+										CFG_ADC_CHANNEL(12V, CFG_ADC_CHANNEL_12V, 2, 1) \
+										CFG_ADC_CHANNEL(M12V, CFG_ADC_CHANNEL_M12V, 2, 1)
+
+#define CFG_REFERENCE_3V3_MIN			2970	/* mV */
+#define CFG_REFERENCE_3V3_MAX			3630	/* mV */
+#define CFG_REFERENCE_5V_MIN			4500	/* mV */
+#define CFG_REFERENCE_5V_MAX			5500	/* mV */
+#define CFG_REFERENCE_12V_MIN			10800	/* mV */
+#define CFG_REFERENCE_12V_MAX			13200	/* mV */
+
+/*
+ * PXIe rails, converted to millivolts with integer math:
+ *
+ * CFG_ADC_RAIL(name, divider, offset, gain_env, offset_env)
+ * name: channel name of CFG_ADC_CHANNELS, divider: voltage divider in front of the ADC pin
+ * offset: fixed offset in mV added to the rail voltage (e.g. offset of the OP-Amplifier)
+ * gain_env/offset_env: calibration environment variables (CFG_ENV_DESC names), gain in 1/CFG_ADC_CAL_GAIN_UNITY, offset in mV
+ */
+#define CFG_ADC_CAL_GAIN_UNITY			10000
+#define CFG_ADC_RAILS					CFG_ADC_RAIL(3V3, 2, 0, cal_gain_3v3, cal_offset_3v3) \
+										CFG_ADC_RAIL(5V, 3, 0, cal_gain_5v, cal_offset_5v) \
+										CFG_ADC_RAIL(5VAUX, 3, 0, cal_gain_5vaux, cal_offset_5vaux) \
+										CFG_ADC_RAIL(12V, 6, 0, cal_gain_12v, cal_offset_12v) \
+										CFG_ADC_RAIL(M12V, 6, 290, cal_gain_m12v, cal_offset_m12v)
+
+/*
+ * Rails checked against their limits (bit 0, 1, 2... of pwr_ok in this order). While the voltages are on,
+ * one of them is converted every millisecond with the ADC window monitor between the measurement rounds
+ * and a rail outside its limits turns the voltages off.
+ *
+ * CFG_ADC_GUARD(name, min, max)
+ * name: rail name of CFG_ADC_RAILS, min/max: limits in mV
+ */
+#define CFG_ADC_GUARD_ENABLE			1
+#define CFG_ADC_GUARDS					CFG_ADC_GUARD(3V3, CFG_REFERENCE_3V3_MIN, CFG_REFERENCE_3V3_MAX) \
+										CFG_ADC_GUARD(5V, CFG_REFERENCE_5V_MIN, CFG_REFERENCE_5V_MAX) \
+										CFG_ADC_GUARD(12V, CFG_REFERENCE_12V_MIN, CFG_REFERENCE_12V_MAX)
 
 /* EEPROM emulation */
 #define CFG_EEPROM_ENABLE
@@ -128,9 +186,55 @@
  * CFG_UART_CHANNEL(channel, SERCOMx, baud_rate, parity, mux_setting, pinmux_pad0, pinmux_pad1, pinmux_pad2, pinmux_pad3)
  */
 #define CFG_UART_RING_SIZE			1024
+#define CFG_UART_TX_RING_SIZE		1024
+#define CFG_UART_TX_FULL			UART_TX_BLOCK	/* UART_TX_DROP, UART_TX_BLOCK or UART_TX_OVERWRITE (see uart.h) */
 #define CFG_UART_CHANNELS			CFG_UART_CHANNEL(0, SERCOM1, CFG_CONSOLE_BAUD_RATE, USART_PARITY_NONE, USART_RX_3_TX_2_XCK_3, PINMUX_UNUSED, PINMUX_UNUSED, PINMUX_PA18D_SERCOM3_PAD2, PINMUX_PA19D_SERCOM3_PAD3)
 
 #define CFG_CONSOLE_CHANNEL			0
+
+/*
+ * Main loop tasks (see sched.c), periodic tasks in priority order:
+ *
+ * CFG_TASK(name, function, period, deadline)
+ * period: ms between two runs, 0: background task, run round robin while no periodic task is due
+ * deadline: ms a due task may wait for its start before a miss is counted, 0: no deadline
+ */
+#define CFG_TASKS					CFG_TASK(smbus, do_smbus, 1, 2) \
+									CFG_TASK(soft_timer, do_soft_timer, 1, 2) \
+									CFG_TASK(power_management, do_power_management, 1, 5) \
+									CFG_TASK(led, do_led, 1000, 100) \
+									CFG_TASK(heartbeat, heartbeat_toggle, 500, 0) \
+									CFG_TASK(env, do_env, 0, 0) \
+									CFG_TASK(cli, do_cli, 0, 0) \
+									CFG_TASK(log, do_log, 0, 0) \
+									CFG_TASK(i2c_master, do_i2c_master, 0, 0) \
+									CFG_TASK(fan, do_fan, 0, 0) \
+									CFG_TASK(measure, do_measure, 0, 0)
+
+/*
+ * Main loop tasks in learn mode (learn.c): the learn sequence drives the fans, rails and LEDs
+ * itself, so their tasks do not run; the system is restarted afterwards
+ */
+#define CFG_LEARN_TASKS				CFG_TASK(soft_timer, do_soft_timer, 1, 2) \
+									CFG_TASK(heartbeat, heartbeat_toggle, 500, 0) \
+									CFG_TASK(env, do_env, 0, 0) \
+									CFG_TASK(cli, do_cli, 0, 0) \
+									CFG_TASK(log, do_log, 0, 0)
+
+/* Software timers (soft_timer.c), wheel slots: power of 2 */
+#define CFG_SOFT_TIMER_SLOTS		16
+
+/* Execution time profiler (CLI "profile", SMBus profile block), compiled out if not defined */
+#ifdef DEBUG
+#define CFG_PROFILE
+#endif
+#define CFG_PROFILE_TASKS			16		/* Profiled main loop tasks (CFG_TASKS) */
+
+/* Deferred console output (log_printf) */
+#define CFG_LOG_RING_SIZE			1024	/* Buffered characters */
+#define CFG_LOG_LINE_SIZE			128		/* Max. length of one message */
+#define CFG_LOG_DRAIN_SIZE			16		/* Characters written per main loop pass */
+#define CFG_LOG_TIMESTAMP						/* Prefix every line with the time since start [s.us] */
 #define CFG_CONSOLE_BAUD_RATE		115200
 
 
@@ -152,12 +256,16 @@
 /* Additional SMBus configuration */
 #define CFG_SMBUS_TIMEOUT_ENABLE	1
 #define CFG_SMBUS_TIMEOUT_CLOCK_GEN	GCLK_GENERATOR_7	/* Clock generator to be used for the SERCOMx_SLOW clock */
+#define CFG_SMBUS_CMD_QUEUE_SIZE	4					/* Pending write commands, power of 2 (256 bytes each) */
 
 /* I2C Master configuration */
 #define CFG_I2C_MASTER_MODULE		SERCOM4
 #define CFG_I2C_MASTER_PINMUX_PAD0	PINMUX_PB12C_SERCOM4_PAD0
 #define CFG_I2C_MASTER_PINMUX_PAD1	PINMUX_PB13C_SERCOM4_PAD1
-#define CFG_I2C_MASTER_TIMEOUT		50
+#define CFG_I2C_MASTER_TIMEOUT		50					/* msec per transfer phase */
+#define CFG_I2C_MASTER_QUEUE_SIZE	24					/* queued transfers */
+#define CFG_I2C_MASTER_JOB_DATA		16					/* max. bytes written/read per transfer */
+#define CFG_I2C_MASTER_VERIFY		10000				/* msec between read backs of the written device registers */
 #define CFG_I2C_MASTER_TB1_ADDRESS	0x20
 #define CFG_I2C_MASTER_TB2_ADDRESS	0x21
 #define CFG_I2C_MASTER_TB3_ADDRESS	0x22
@@ -180,31 +288,58 @@
  * Non-volatile (persistent) configuration parameters:
  *
  * CFG_ENV_DESC(name, default_value)
+ * name: identifier, used for the ENV_<name> index and as the variable name in the CLI
+ * The saved values are restored by position: add new variables at the end only
  */
-#define CFG_ENV_DESCRIPTORS			CFG_ENV_DESC("pulses_per_rotation", CFG_PULSES_PER_ROTATION) \
-									CFG_ENV_DESC("pwm_frequency", CFG_PWM_FREQUENCY) \
-									CFG_ENV_DESC("max_speed_learned_fan1", 0) \
-									CFG_ENV_DESC("max_speed_learned_fan2", 0) \
-									CFG_ENV_DESC("max_speed_learned_fan3", 0) \
-									CFG_ENV_DESC("max_speed_learned_fan4", 0) \
-									CFG_ENV_DESC("max_speed_learned_fan5", 0) \
-									CFG_ENV_DESC("max_speed_learned_fan6", 0) \
-									CFG_ENV_DESC("learned_fans", 0) \
-									CFG_ENV_DESC("temperature_learned_sensor1", 0) \
-									CFG_ENV_DESC("temperature_learned_sensor2", 0) \
-									CFG_ENV_DESC("temperature_learned_sensor3", 0) \
-									CFG_ENV_DESC("temperature_learned_sensor4", 0) \
-									CFG_ENV_DESC("learned_temperature_sensors", 0) \
-									CFG_ENV_DESC("fan_curve", 5) \
-									CFG_ENV_DESC("tb1en", 0) \
-									CFG_ENV_DESC("tb1dir", 0) \
-									CFG_ENV_DESC("tb2en", 0) \
-									CFG_ENV_DESC("tb2dir", 0) \
-									CFG_ENV_DESC("tb3en", 0) \
-									CFG_ENV_DESC("tb3dir", 0) \
-									CFG_ENV_DESC("tb4en", 0) \
-									CFG_ENV_DESC("tb4dir", 0) \
-									CFG_ENV_DESC("learned", 0)
+#define CFG_ENV_DESCRIPTORS			CFG_ENV_DESC(pulses_per_rotation, CFG_PULSES_PER_ROTATION) \
+									CFG_ENV_DESC(pwm_frequency, CFG_PWM_FREQUENCY) \
+									CFG_ENV_DESC(max_speed_learned_fan1, 0) \
+									CFG_ENV_DESC(max_speed_learned_fan2, 0) \
+									CFG_ENV_DESC(max_speed_learned_fan3, 0) \
+									CFG_ENV_DESC(max_speed_learned_fan4, 0) \
+									CFG_ENV_DESC(max_speed_learned_fan5, 0) \
+									CFG_ENV_DESC(max_speed_learned_fan6, 0) \
+									CFG_ENV_DESC(learned_fans, 0) \
+									CFG_ENV_DESC(temperature_learned_sensor1, 0) \
+									CFG_ENV_DESC(temperature_learned_sensor2, 0) \
+									CFG_ENV_DESC(temperature_learned_sensor3, 0) \
+									CFG_ENV_DESC(temperature_learned_sensor4, 0) \
+									CFG_ENV_DESC(learned_temperature_sensors, 0) \
+									CFG_ENV_DESC(fan_curve, 5) \
+									CFG_ENV_DESC(tb1en, 0) \
+									CFG_ENV_DESC(tb1dir, 0) \
+									CFG_ENV_DESC(tb2en, 0) \
+									CFG_ENV_DESC(tb2dir, 0) \
+									CFG_ENV_DESC(tb3en, 0) \
+									CFG_ENV_DESC(tb3dir, 0) \
+									CFG_ENV_DESC(tb4en, 0) \
+									CFG_ENV_DESC(tb4dir, 0) \
+									CFG_ENV_DESC(learned, 0) \
+									CFG_ENV_DESC(cal_gain_3v3, CFG_ADC_CAL_GAIN_UNITY) \
+									CFG_ENV_DESC(cal_offset_3v3, 0) \
+									CFG_ENV_DESC(cal_gain_5v, CFG_ADC_CAL_GAIN_UNITY) \
+									CFG_ENV_DESC(cal_offset_5v, 0) \
+									CFG_ENV_DESC(cal_gain_5vaux, CFG_ADC_CAL_GAIN_UNITY) \
+									CFG_ENV_DESC(cal_offset_5vaux, 0) \
+									CFG_ENV_DESC(cal_gain_12v, CFG_ADC_CAL_GAIN_UNITY) \
+									CFG_ENV_DESC(cal_offset_12v, 0) \
+									CFG_ENV_DESC(cal_gain_m12v, CFG_ADC_CAL_GAIN_UNITY) \
+									CFG_ENV_DESC(cal_offset_m12v, 0) \
+									CFG_ENV_DESC(fan_control, CFG_FAN_CONTROL) \
+									CFG_ENV_DESC(fan_pid_kp, CFG_FAN_PID_KP) \
+									CFG_ENV_DESC(fan_pid_ki, CFG_FAN_PID_KI) \
+									CFG_ENV_DESC(fan_pid_kd, CFG_FAN_PID_KD)
+
+/* Change notification callbacks (env_subscribe) */
+#define CFG_ENV_SUBSCRIBERS			4
+
+/* Write-behind: save after this many ms without changes, but at the latest after CFG_ENV_SAVE_MAX_DELAY */
+#define CFG_ENV_SAVE_DELAY			500
+#define CFG_ENV_SAVE_MAX_DELAY		5000
+
+/* EEPROM pages of each snapshot slot (A/B) and of the change journal (7 records per page) */
+#define CFG_ENV_SLOT_PAGES			4
+#define CFG_ENV_JOURNAL_PAGES		8
 
 
 
@@ -9,8 +9,13 @@
 #ifndef CRC_H_
 #define CRC_H_
 
+#define CRC_TABLE_NONE		0	/* bitwise, 8 iterations per byte */
+#define CRC_TABLE_NIBBLE	1	/* 16-entry tables, 2 lookups per byte */
+#define CRC_TABLE_BYTE		2	/* 256-entry tables, 1 lookup per byte */
+
 uint16_t crc16(uint16_t crc, const uint8_t *buf, int len, uint16_t polynomial, int pad);
 uint16_t crc16_env(uint16_t crc, const uint8_t *buf, uint32_t len, uint16_t polynomial);
 uint8_t crc8(uint8_t crc, const uint8_t *buf, int len, uint8_t polynomial, int pad);
+void crc_benchmark(void);
 
 #endif /* CRC_H_ */
\ No newline at end of file
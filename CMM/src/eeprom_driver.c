@@ -10,6 +10,7 @@
 #include "config.h"
 #include "eeprom_driver.h"
 #include "uart.h"
+#include "env.h"
 
 #if defined(CFG_EEPROM_ENABLE) && !defined(BOOTLOADER)
 
@@ -19,6 +20,7 @@ void SYSCTRL_Handler(void)
 {
 	if (SYSCTRL->INTFLAG.reg & SYSCTRL_INTFLAG_BOD33DET) {
 		SYSCTRL->INTFLAG.reg |= SYSCTRL_INTFLAG_BOD33DET;
+		env_flush_isr();
 		eeprom_emulator_commit_page_buffer();
 	}
 }
@@ -79,4 +81,41 @@ int eeprom_write(const uint8_t *buf, int offset, int len)
 	return 0;
 }
 
+/*
+ * Write only the EEPROM pages whose contents differ from buf, commit once at the end.
+ * Returns the number of pages written.
+ */
+int eeprom_update(const uint8_t *buf, int offset, int len)
+{
+	uint8_t page[EEPROM_PAGE_SIZE];
+	int chunk, written = 0;
+	
+	if (!eeprom_valid) {
+		return -1;
+	}
+	while (len > 0) {
+		chunk = EEPROM_PAGE_SIZE - (offset % EEPROM_PAGE_SIZE);
+		if (chunk > len) {
+			chunk = len;
+		}
+		if (eeprom_emulator_read_buffer(offset, page, chunk) != STATUS_OK) {
+			return -1;
+		}
+		if (memcmp(page, buf, chunk)) {
+			if (eeprom_emulator_write_buffer(offset, buf, chunk) != STATUS_OK) {
+				return -1;
+			}
+			written++;
+		}
+		buf += chunk;
+		offset += chunk;
+		len -= chunk;
+	}
+	if (written) {
+		eeprom_emulator_commit_page_buffer();
+	}
+	
+	return written;
+}
+
 #endif /* BOOTLOADER */
\ No newline at end of file
@@ -26,5 +26,6 @@ byte 8 to 49 = reserved
 void eeprom_init(void);
 int eeprom_read(uint8_t *buf, int offset, int len);
 int eeprom_write(const uint8_t *buf, int offset, int len);
+int eeprom_update(const uint8_t *buf, int offset, int len);
 
 #endif /* EEPROM_H_ */
\ No newline at end of file
@@ -14,85 +14,324 @@
 #include "uart.h"
 #include "env.h"
 #include "watchdog.h"
+#include "log.h"
+#include "sys_timer.h"
 
 #ifndef BOOTLOADER
 
-#define ENV_MAX_ENTRIES		128
-
 #define CFG_ENV_DESC(_name, _default) \
-	_name,
+	#_name,
 
 static const char *env_vars[] = { CFG_ENV_DESCRIPTORS };
 
 #define ENV_SIZE		(sizeof(env_vars)/sizeof(*env_vars))
 
+/* The enum in env.h and the name table must describe the same variables */
+typedef char env_size_check[(ENV_COUNT == ENV_SIZE && ENV_SIZE < ENV_MAX_ENTRIES && ENV_SIZE <= 64) ? 1 : -1];
+
 #undef CFG_ENV_DESC
 
 #define CFG_ENV_DESC(_name, _default) \
 	_default,
 
-struct env_cache_s {
+struct env_cache_s env_cache = { ENV_SNAP_MAGIC, 0, 0, ENV_SIZE, { 0 }, { CFG_ENV_DESCRIPTORS }};
+static const uint32_t env_defaults[] = { CFG_ENV_DESCRIPTORS };
+
+#undef CFG_ENV_DESC
+
+/*
+ * EEPROM layout from CFG_EEPROM_ENV_OFFSET: snapshot slots A and B (CFG_ENV_SLOT_PAGES each),
+ * followed by the journal (CFG_ENV_JOURNAL_PAGES). A change is appended to the journal as
+ * one record, i.e. one emulated page write. When the journal is full, the environment is
+ * compacted into the other slot with the next generation; records of older generations
+ * are stale from then on. A torn write leaves either the old slot and its journal or a
+ * bad CRC, so the last complete state is restored at boot.
+ */
+#define ENV_SLOT_SIZE			(CFG_ENV_SLOT_PAGES * EEPROM_PAGE_SIZE)
+#define ENV_SLOT_OFFSET(_slot)	(CFG_EEPROM_ENV_OFFSET + (_slot) * ENV_SLOT_SIZE)
+#define ENV_JOURNAL_OFFSET		ENV_SLOT_OFFSET(2)
+#define ENV_SNAP_HDR_SIZE		offsetof(struct env_cache_s, data)
+#define ENV_SNAP_SIZE(_size)	(ENV_SNAP_HDR_SIZE + (_size) * sizeof(uint32_t))
+
+struct env_record_s {
+	uint32_t value;
+	uint16_t seq;
+	uint8_t idx;
+	uint8_t crc;		//CRC8 of the fields above
+};
+
+#define ENV_RECORDS_PER_PAGE	(EEPROM_PAGE_SIZE / sizeof(struct env_record_s))
+#define ENV_JOURNAL_RECORDS		(CFG_ENV_JOURNAL_PAGES * ENV_RECORDS_PER_PAGE)
+#define ENV_RECORD_POLYNOMIAL	0x07
+#define ENV_BENCHMARK_RUNS		16
+
+/* Environment format before the journal: one block at CFG_EEPROM_ENV_OFFSET */
+struct env_legacy_s {
 	uint32_t magic;
 #define ENV_HDR_MAGIC	0x87654321
 	uint8_t size;
 	uint16_t crc;
 	uint32_t data[ENV_MAX_ENTRIES];
-} env_cache = { ENV_HDR_MAGIC, ENV_SIZE, 0, { CFG_ENV_DESCRIPTORS }};
+};
+
+typedef char env_slot_size_check[(ENV_SNAP_SIZE(ENV_SIZE) <= ENV_SLOT_SIZE && sizeof(struct env_legacy_s) <= sizeof(struct env_cache_s)) ? 1 : -1];
+
+uint64_t env_dirty;
+uint64_t env_changed;
+
+/* Write-behind state: changes are saved after CFG_ENV_SAVE_DELAY without further changes */
+static uint64_t env_pending;
+static volatile uint8_t env_saving;
+static uint32_t env_first_change;
+static uint32_t env_last_change;
+
+/* Journal state: active slot, next free record and a copy of the page it lives in */
+static uint8_t env_slot;
+static uint16_t env_journal_pos;
+static uint8_t env_journal_page[EEPROM_PAGE_SIZE];
+
+/* Slot (or old format block) being validated */
+static struct env_cache_s env_snap_buf;
+
+static struct {
+	uint64_t mask;
+	env_notify_t notify;
+} env_subscribers[CFG_ENV_SUBSCRIBERS];
+static uint8_t env_subscriber_count;
+
+static uint16_t env_snapshot_crc(const struct env_cache_s *snap)
+{
+	uint16_t crc = crc16_env(0, (const uint8_t *)snap->data, snap->size*sizeof(uint32_t), 0x1021);
+	
+	return crc16_env(crc, (const uint8_t *)&snap->seq, sizeof(snap->seq), 0x1021);
+}
+
+static uint8_t env_record_crc(const struct env_record_s *rec)
+{
+	return crc8(0xff, (const uint8_t *)rec, offsetof(struct env_record_s, crc), ENV_RECORD_POLYNOMIAL, 1);
+}
+
+/*
+ * Read a snapshot slot, returns 0 if it is valid
+ */
+static int env_read_slot(uint8_t slot, struct env_cache_s *snap)
+{
+	if (eeprom_read((uint8_t *)snap, ENV_SLOT_OFFSET(slot), ENV_SNAP_HDR_SIZE) < 0) {
+		return -1;
+	}
+	if (snap->magic != ENV_SNAP_MAGIC || snap->size < 1 || ENV_SNAP_SIZE(snap->size) > ENV_SLOT_SIZE) {
+		return -1;
+	}
+	if (eeprom_read((uint8_t *)snap->data, ENV_SLOT_OFFSET(slot) + ENV_SNAP_HDR_SIZE, snap->size*sizeof(uint32_t)) < 0) {
+		return -1;
+	}
+	if (env_snapshot_crc(snap) != snap->crc) {
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Restore the newest valid snapshot into cache and replay its journal records.
+ * Returns the number of records (the next free journal position) or -1 if no slot is valid.
+ */
+static int env_recover(struct env_cache_s *cache, uint8_t *slot)
+{
+	struct env_cache_s *snap = &env_snap_buf;
+	struct env_record_s page[ENV_RECORDS_PER_PAGE];
+	int valid0, valid1, pos, i;
+	uint16_t seq0;
+	
+	valid0 = env_read_slot(0, snap) == 0;
+	seq0 = snap->seq;
+	valid1 = env_read_slot(1, snap) == 0;
+	if (valid1 && (!valid0 || (int16_t)(snap->seq - seq0) > 0)) {
+		*slot = 1;
+	} else if (valid0) {
+		*slot = 0;
+		env_read_slot(0, snap);
+	} else {
+		return -1;
+	}
+	cache->seq = snap->seq;
+	for (i = 0; i < snap->size && i < (int)ENV_SIZE; i++) {
+		cache->data[i] = snap->data[i];
+	}
+	
+	for (pos = 0; pos < (int)ENV_JOURNAL_RECORDS; pos++) {
+		struct env_record_s *rec = &page[pos % ENV_RECORDS_PER_PAGE];
+		if (pos % ENV_RECORDS_PER_PAGE == 0) {
+			if (eeprom_read((uint8_t *)page, ENV_JOURNAL_OFFSET + (pos / ENV_RECORDS_PER_PAGE) * EEPROM_PAGE_SIZE, sizeof(page)) < 0) {
+				break;
+			}
+		}
+		if (rec->seq != cache->seq || rec->crc != env_record_crc(rec)) {
+			break;
+		}
+		if (rec->idx < ENV_SIZE) {
+			cache->data[rec->idx] = rec->value;
+		}
+	}
+	
+	return pos;
+}
 
-static uint8_t env_dirty;
+/*
+ * Position the journal at pos: load the page holding pos, clear the stale records behind it
+ */
+static void env_journal_seek(uint16_t pos)
+{
+	uint16_t offset = (pos % ENV_RECORDS_PER_PAGE) * sizeof(struct env_record_s);
+	
+	env_journal_pos = pos;
+	memset(env_journal_page, 0, sizeof(env_journal_page));
+	if (offset && pos < ENV_JOURNAL_RECORDS) {
+		eeprom_read(env_journal_page, ENV_JOURNAL_OFFSET + (pos / ENV_RECORDS_PER_PAGE) * EEPROM_PAGE_SIZE, offset);
+	}
+}
 
 static int env_read(void)
 {
-	struct env_cache_s eeprom_copy;
-	int ret = 0, i;
+	struct env_legacy_s *legacy = (struct env_legacy_s *)&env_snap_buf;
+	int pos, i;
 	
-	if (eeprom_read((uint8_t *)&eeprom_copy, CFG_EEPROM_ENV_OFFSET, sizeof(eeprom_copy)) < 0) {
+	pos = env_recover(&env_cache, &env_slot);
+	if (pos >= 0) {
+		printf("ENV: restored snapshot %c (generation %u) and %d journal records\r\n",
+			'A' + env_slot, env_cache.seq, pos);
+		env_journal_seek(pos);
+		return 0;
+	}
+	
+	/* No valid slot: convert the environment of an older firmware, if there is one */
+	if (eeprom_read((uint8_t *)legacy, CFG_EEPROM_ENV_OFFSET, sizeof(*legacy)) < 0) {
 		printf("ERROR: env_read(): failed to read EEPROM\r\n");
 		return -1;
 	}
-	if (eeprom_copy.magic != ENV_HDR_MAGIC) {
+	if (legacy->magic != ENV_HDR_MAGIC) {
 		printf("ENV: bad magic number\r\n");
 		return -1;
 	}
-	if (eeprom_copy.size < 1 || eeprom_copy.size >= ENV_MAX_ENTRIES) {
+	if (legacy->size < 1 || legacy->size >= ENV_MAX_ENTRIES) {
 		printf("ENV: invalid size\r\n");
 		return -1;
 	}
-	uint16_t crc = crc16_env(0, (const uint8_t *)eeprom_copy.data, eeprom_copy.size*sizeof(uint32_t), 0x1021);
-	if (crc != eeprom_copy.crc) {
+	uint16_t crc = crc16_env(0, (const uint8_t *)legacy->data, legacy->size*sizeof(uint32_t), 0x1021);
+	if (crc != legacy->crc) {
 		printf("ENV: bad CRC\r\n");
 		return -1;
 	}
 	printf("ENV: EEPROM copy is valid, restoring\r\n");
-	if (eeprom_copy.size < env_cache.size) {
+	if (legacy->size < ENV_SIZE) {
 		printf("WARNING: saved environment is shorter than expected, using defaults for the remaining variables\r\n");
-		ret = 1;
-	} else if (eeprom_copy.size > env_cache.size) {
+	} else if (legacy->size > ENV_SIZE) {
 		printf("WARNING: saved environment is longer than expected, ignoring extra values\r\n");
-		ret = 1;
 	}
-	for (i = 0; i < eeprom_copy.size; i++) {
-		env_cache.data[i] = eeprom_copy.data[i];
+	for (i = 0; i < legacy->size && i < (int)ENV_SIZE; i++) {
+		env_cache.data[i] = legacy->data[i];
 	}
+	/* The old block overlaps slot A, so the first snapshot goes to slot B */
+	env_slot = 0;
 	
-	return ret;
+	return 1;
 }
 
-static void env_save(void) {
-	env_cache.magic = ENV_HDR_MAGIC;
+/*
+ * Write the whole environment into the other slot as the next generation and restart the journal
+ */
+static int env_compact(void)
+{
+	uint8_t slot = !env_slot;
+	
+	env_cache.magic = ENV_SNAP_MAGIC;
 	env_cache.size = ENV_SIZE;
-	env_cache.crc = crc16_env(0, (const uint8_t *)env_cache.data, ENV_SIZE*sizeof(uint32_t), 0x1021);
-	if (eeprom_write((uint8_t *)&env_cache, CFG_EEPROM_ENV_OFFSET, sizeof(env_cache)) < 0) {
-		printf("ERROR: env_save(): failed to write to EEPROM\r\n");
+	env_cache.seq++;
+	env_cache.crc = env_snapshot_crc(&env_cache);
+	if (eeprom_update((uint8_t *)&env_cache, ENV_SLOT_OFFSET(slot), ENV_SNAP_SIZE(ENV_SIZE)) < 0) {
+		printf("ERROR: env_compact(): failed to write to EEPROM\r\n");
+		env_cache.seq--;
+		return -1;
+	}
+	env_slot = slot;
+	env_journal_seek(0);
+	
+	return 0;
+}
+
+/*
+ * Append one record per changed variable, records sharing a page cost one page write
+ */
+static void env_save(void) {
+	uint64_t changed;
+	uint16_t page_start;
+	struct env_record_s *rec;
+	int count = 0, i;
+	
+	/* Before the snapshot: from now on a brown-out does not start a second save */
+	env_saving = 1;
+	system_interrupt_enter_critical_section();
+	changed = env_pending;
+	env_pending = 0;
+	system_interrupt_leave_critical_section();
+	page_start = env_journal_pos;
+	for (i = 0; i < (int)ENV_SIZE; i++) {
+		if (changed & ((uint64_t)1 << i)) {
+			count++;
+		}
+	}
+	if (env_journal_pos + count > (int)ENV_JOURNAL_RECORDS) {
+		if (env_compact() < 0) {
+			system_interrupt_enter_critical_section();
+			env_pending |= changed;
+			system_interrupt_leave_critical_section();
+		}
+		env_saving = 0;
+		return;
 	}
+	for (i = 0; i < (int)ENV_SIZE; i++) {
+		if (!(changed & ((uint64_t)1 << i))) {
+			continue;
+		}
+		rec = (struct env_record_s *)env_journal_page + env_journal_pos % ENV_RECORDS_PER_PAGE;
+		rec->value = env_cache.data[i];
+		rec->seq = env_cache.seq;
+		rec->idx = i;
+		rec->crc = env_record_crc(rec);
+		env_journal_pos++;
+		if (env_journal_pos % ENV_RECORDS_PER_PAGE == 0 || env_journal_pos == page_start + count) {
+			if (eeprom_update(env_journal_page, ENV_JOURNAL_OFFSET + ((env_journal_pos - 1) / ENV_RECORDS_PER_PAGE) * EEPROM_PAGE_SIZE,
+					EEPROM_PAGE_SIZE) < 0) {
+				printf("ERROR: env_save(): failed to write to EEPROM\r\n");
+			}
+			if (env_journal_pos % ENV_RECORDS_PER_PAGE == 0) {
+				memset(env_journal_page, 0, sizeof(env_journal_page));
+			}
+		}
+	}
+	env_saving = 0;
 }
 
+/*
+ * Write the defaults as the next generation: the generation number keeps increasing, so the
+ * journal records of the old generations do not match anymore
+ */
 void env_reset(void) {
+	int i;
+	
 	printf("ENV: resetting to default environment\r\n");
-	env_cache.magic = 0;
-	if (eeprom_write((uint8_t *)&env_cache, CFG_EEPROM_ENV_OFFSET, sizeof(env_cache)) < 0) {
-		printf("ERROR: env_save(): failed to write to EEPROM\r\n");
+	env_saving = 1;		/* No brown-out save of the old values */
+	system_interrupt_enter_critical_section();
+	env_dirty = 0;
+	env_pending = 0;
+	system_interrupt_leave_critical_section();
+	for (i = 0; i < (int)ENV_SIZE; i++) {
+		env_cache.data[i] = env_defaults[i];
 	}
+	if (env_compact() < 0) {
+		printf("ERROR: env_reset(): failed to write to EEPROM\r\n");
+	}
+	log_flush();
 	SYSTEM_RESET;
 	/* NOTREACHED */
 }
@@ -101,10 +340,30 @@ void env_init(void)
 {
 	if (env_read()) {
 		printf("ENV: saving default environment\r\n");
-		env_save();
+		env_compact();
 	}
 }
 
+/*
+ * Measure the boot time recovery (snapshot selection and journal replay)
+ */
+void env_benchmark(void)
+{
+	static struct env_cache_s scratch;
+	uint32_t start, elapsed;
+	uint8_t slot;
+	int pos = 0, i;
+	
+	start = get_jiffies();
+	for (i = 0; i < ENV_BENCHMARK_RUNS; i++) {
+		pos = env_recover(&scratch, &slot);
+		WDT_RESET;
+	}
+	elapsed = get_jiffies() - start;
+	printf("ENV: slot %c, generation %u, journal %d/%d records\r\n", 'A' + env_slot, env_cache.seq, env_journal_pos, (int)ENV_JOURNAL_RECORDS);
+	printf("ENV: recovery %lu us (%d records replayed)\r\n", elapsed * 1000 / ENV_BENCHMARK_RUNS, pos);
+}
+
 int env_find(const char *var)
 {
 	int i;
@@ -118,28 +377,41 @@ int env_find(const char *var)
 	return -1;
 }
 
-int env_set(const char *var, uint32_t val)
+const char *env_name(enum env_index idx)
+{
+	return env_vars[idx];
+}
+
+/*
+ * Register a callback for changes of the variables in mask (ENV_BIT()s)
+ */
+int env_subscribe(uint64_t mask, env_notify_t notify)
 {
-	int idx = env_find(var);
-	if (idx < 0) {
-		printf("ENV: variable %s not found\r\n", var);
+	if (env_subscriber_count >= CFG_ENV_SUBSCRIBERS) {
+		printf("ERROR: env_subscribe(): too many subscribers\r\n");
 		return -1;
 	}
-	env_cache.data[idx] = val;
-	env_dirty = 1;
+	env_subscribers[env_subscriber_count].mask = mask;
+	env_subscribers[env_subscriber_count].notify = notify;
+	env_subscriber_count++;
 	
 	return 0;
 }
 
-uint32_t env_get(const char *var)
+/*
+ * Notify the subscribers once for all variables changed since the last call
+ */
+static void env_notify(void)
 {
-	int idx = env_find(var);
-	if (idx < 0) {
-		printf("ENV: variable %s not found\r\n", var);
-		return 0;
-	}
+	uint64_t changed = env_changed;
+	int i;
 	
-	return env_cache.data[idx];
+	env_changed = 0;
+	for (i = 0; i < env_subscriber_count; i++) {
+		if (changed & env_subscribers[i].mask) {
+			env_subscribers[i].notify(changed & env_subscribers[i].mask);
+		}
+	}
 }
 
 void env_print_all(void)
@@ -151,11 +423,54 @@ void env_print_all(void)
 	}
 }
 
+/*
+ * Save pending changes now (e.g. before a reset)
+ */
+void env_flush(void)
+{
+	bool pending;
+	
+	system_interrupt_enter_critical_section();
+	env_pending |= env_dirty;
+	env_dirty = 0;
+	pending = env_pending != 0;
+	system_interrupt_leave_critical_section();
+	if (pending) {
+		env_save();
+	}
+}
+
+/*
+ * Brown-out: save pending changes from interrupt context, unless
+ * the main loop is already writing the environment
+ */
+void env_flush_isr(void)
+{
+	if (!env_saving) {
+		env_flush();
+	}
+}
+
 void do_env(void)
 {
+	uint32_t now = get_jiffies();
+	
+	if (env_changed) {
+		env_notify();
+	}
 	if (env_dirty) {
-		env_save();
+		system_interrupt_enter_critical_section();
+		if (!env_pending) {
+			env_first_change = now;
+		}
+		env_last_change = now;
+		env_pending |= env_dirty;
 		env_dirty = 0;
+		system_interrupt_leave_critical_section();
+	}
+	if (env_pending && (now - env_last_change >= CFG_ENV_SAVE_DELAY ||
+						now - env_first_change >= CFG_ENV_SAVE_MAX_DELAY)) {
+		env_save();
 	}
 }
 
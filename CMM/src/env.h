@@ -9,12 +9,70 @@
 #ifndef ENV_H_
 #define ENV_H_
 
+#define ENV_MAX_ENTRIES		128
+
+/* Variable indices, order given by CFG_ENV_DESCRIPTORS */
+#define CFG_ENV_DESC(_name, _default) \
+	ENV_##_name,
+
+enum env_index {
+	ENV_NONE = -1,
+	CFG_ENV_DESCRIPTORS
+	ENV_COUNT
+};
+
+#undef CFG_ENV_DESC
+
+/* Change mask bit of a variable, for env_subscribe() */
+#define ENV_BIT(_name)		((uint64_t)1 << ENV_##_name)
+
+/* Called from do_env() with the bits of the subscribed variables that changed */
+typedef void (*env_notify_t)(uint64_t changed);
+
+/* Environment snapshot, also the layout of the A/B snapshot slots in the EEPROM */
+struct env_cache_s {
+	uint32_t magic;
+#define ENV_SNAP_MAGIC	0x8765a001
+	uint16_t seq;		//snapshot generation, journal records carry the same number
+	uint16_t crc;		//CRC16 of data[0..size-1] and seq
+	uint8_t size;
+	uint8_t reserved[3];
+	uint32_t data[ENV_MAX_ENTRIES];
+};
+
+extern struct env_cache_s env_cache;
+extern uint64_t env_dirty;
+extern uint64_t env_changed;
+
 void env_init(void);
 void env_reset(void);
 int env_find(const char *var);
-int env_set(const char *var, uint32_t val);
-uint32_t env_get(const char *var);
+const char *env_name(enum env_index idx);
+int env_subscribe(uint64_t mask, env_notify_t notify);
 void env_print_all(void);
+void env_flush(void);
+void env_flush_isr(void);
+void env_benchmark(void);
 void do_env(void);
 
+/*
+ * Typed accessors for internal callers, the index is resolved at compile time
+ */
+static inline uint32_t env_get(enum env_index idx)
+{
+	return env_cache.data[idx];
+}
+
+static inline void env_set(enum env_index idx, uint32_t val)
+{
+	if (env_cache.data[idx] != val) {
+		env_cache.data[idx] = val;
+		env_changed |= (uint64_t)1 << idx;
+		/* 64 bit read-modify-write, env_flush_isr() may run in between */
+		system_interrupt_enter_critical_section();
+		env_dirty |= (uint64_t)1 << idx;
+		system_interrupt_leave_critical_section();
+	}
+}
+
 #endif /* ENV_H_ */
\ No newline at end of file
@@ -13,11 +13,27 @@
 #include "sys_timer.h"
 #include "env.h"
 #include "smbus.h"
+#include "profile.h"
 
 
 #ifndef BOOTLOADER
 
-static uint32_t cnt_tacho[CFG_MAX_FAN_COUNT];
+/*
+ * Tacho state of one fan, written by the EXTINT interrupt
+ */
+struct tacho_state {
+	uint32_t last_edge;		//time stamp (us) of the last accepted edge
+	uint32_t rev_start;		//time stamp (us) at the start of the current revolution
+	uint32_t rev_us;		//duration of the last complete revolution
+	uint8_t pulses;			//pulses within the current revolution
+	bool running;			//last_edge is valid
+	bool rev_ready;			//rev_us updated
+	bool seen;				//an edge was accepted since the last update
+};
+
+static volatile struct tacho_state tacho[CFG_MAX_FAN_COUNT];
+static uint32_t tacho_last_seen[CFG_MAX_FAN_COUNT];
+static uint32_t tacho_min_us;	//shortest valid pulse period (CFG_TACHO_MAX_RPM)
 static uint32_t last_pwm_adjust;
 static uint32_t last_tacho_measure;
 static uint32_t fan_speed_up_time;
@@ -26,16 +42,24 @@ static uint8_t current_pwm;
 uint32_t fantacho[CFG_MAX_FAN_COUNT];
 static uint32_t pwm_frequency;
 static uint8_t pulses_per_rotation;
-static volatile uint8_t ready_flag_get_fan_speed;
 static uint8_t learned_fans_available;
 static uint8_t pwm_autonomous = 20;
+static bool pwm_override;			//fan/temperature fail or max speed input: fixed PWM
+static bool pwm_closed_loop;		//pwm_autonomous is the output of the RPM control
+static uint32_t fan_max_speed[CFG_MAX_FAN_COUNT];
+static int32_t pid_integral;
+static int32_t pid_last_error;
 static struct tc_module tc_instance_pwm;
-static struct tc_module tc_instance_tacho;
 
 static void pwm_calculation_autonomous_mode(void);
+static void pid_reset(void);
+static void pwm_calculation_closed_loop(void);
 static void set_pwm(void);
-static void tc_callback_timer1(struct tc_module *const module_inst);
-static void delete_extint_callbacks(void);
+static void tacho_set_pulses_per_rotation(void);
+static enum tc_clock_prescaler pwm_prescaler(uint32_t frequency);
+static void pwm_set_prescaler(enum tc_clock_prescaler prescaler);
+static void fan_env_changed(uint64_t changed);
+static void tacho_edge(uint8_t fan);
 static void enable_extint_callbacks(void);
 static void extint_detection_callback_int_0(void);
 static void extint_detection_callback_int_1(void);
@@ -43,7 +67,7 @@ static void extint_detection_callback_int_4(void);
 static void extint_detection_callback_int_5(void);
 static void extint_detection_callback_int_13(void);
 static void extint_detection_callback_int_12(void);
-static void get_fan_speed(void);
+static void tacho_update(void);
 static void check_fan_fail(void);
 static void fan_sync_to_smbus(void);
 
@@ -108,8 +132,10 @@ static void pwm_calculation_autonomous_mode(void)
 		
 	x = max_temp_hysteresis;
 	
+	pwm_override = false;
 	if((smbus_get_input_reg(SMBUS_REG__FAN_FAIL) != 0) || (smbus_get_input_reg(SMBUS_REG__TEMP_FAIL) != 0) || (port_pin_get_input_level(CFG_FAN_MAX_SPEED) == 1))
 	{
+		pwm_override = true;
 		if(smbus_get_input_reg(SMBUS_REG__PWR_OK) == 1)
 		{
 			pwm_autonomous = CFG_MAX_PWM;
@@ -138,6 +164,75 @@ static void pwm_calculation_autonomous_mode(void)
 	}
 }
 
+/*
+ * Clear the state of the RPM control
+ */
+static void pid_reset(void)
+{
+	pid_integral = 0;
+	pid_last_error = 0;
+}
+
+/*
+ * Closed loop RPM control: the PWM of the fan curve is taken as speed demand and feed forward,
+ * every learned fan gets demand% of its learned max speed as RPM target. One PWM drives all fans,
+ * so the PID works on the fan with the biggest deficit (in 0.1% of its max speed).
+ * The integral is frozen while the output is saturated in the direction of the error (anti-windup)
+ */
+static void pwm_calculation_closed_loop(void)
+{
+	int32_t error = INT32_MIN, fan_error, target;
+	int32_t integral, output;
+	int32_t kp, ki, kd;
+	
+	pwm_closed_loop = false;
+	if((smbus_get_input_reg(SMBUS_REG__FAN_CONTROL) != 1) || pwm_override || (smbus_get_input_reg(SMBUS_REG__REMOTE) > 0))
+	{
+		pid_reset();
+		return;
+	}
+	
+	for(uint8_t i=0; i<CFG_MAX_FAN_COUNT; i++)
+	{
+		if(((learned_fans_available & (1<<i)) == (1<<i)) && (fan_max_speed[i] > 0))
+		{
+			target = (int32_t) (fan_max_speed[i] * pwm_autonomous / 100);
+			fan_error = (target - (int32_t)fantacho[i]) * 1000 / (int32_t)fan_max_speed[i];
+			if(fan_error > error)
+			{
+				error = fan_error;
+			}
+		}
+	}
+	if(error == INT32_MIN) //no learned fan: stay with the fan curve
+	{
+		pid_reset();
+		return;
+	}
+	
+	kp = smbus_get_input_reg(SMBUS_REG__FAN_PID_KP);
+	ki = smbus_get_input_reg(SMBUS_REG__FAN_PID_KI);
+	kd = smbus_get_input_reg(SMBUS_REG__FAN_PID_KD);
+	
+	integral = pid_integral + ki * error;
+	integral = max(-CFG_MAX_PWM * CFG_FAN_PID_SCALE, min(integral, CFG_MAX_PWM * CFG_FAN_PID_SCALE));
+	output = pwm_autonomous * CFG_FAN_PID_SCALE + kp * error + integral + kd * (error - pid_last_error);
+	
+	if(((output > CFG_MAX_PWM * CFG_FAN_PID_SCALE) && (error > 0)) || ((output < CFG_MIN_PWM * CFG_FAN_PID_SCALE) && (error < 0)))
+	{
+		output -= integral - pid_integral; //saturated: do not integrate further
+	}
+	else
+	{
+		pid_integral = integral;
+	}
+	pid_last_error = error;
+	
+	output = max(CFG_MIN_PWM * CFG_FAN_PID_SCALE, min(output, CFG_MAX_PWM * CFG_FAN_PID_SCALE));
+	pwm_autonomous = (uint8_t) (output / CFG_FAN_PID_SCALE);
+	pwm_closed_loop = true;
+}
+
 /*
  * Set fans to spinup mode, to guarantee that the fans start to run 
  */
@@ -172,7 +267,11 @@ static void set_pwm(void)
 	}
 	else 
 	{
-		if(cnt_change_delay_pwm < CFG_PWM_CHANGE_DELAY)
+		if(pwm_closed_loop)
+		{	//the RPM control has its own dynamic, no additional ramp
+			pwm_to_fan = pwm;
+		}
+		else if(cnt_change_delay_pwm < CFG_PWM_CHANGE_DELAY)
 		{
 			cnt_change_delay_pwm++;
 		}
@@ -210,64 +309,79 @@ static void set_pwm(void)
 
 
 /*
- * Timer Callback for measure the fanspeed
+ * Derive the glitch limit from the pulses per rotation
  */
-static void tc_callback_timer1(struct tc_module *const module_inst)
+static void tacho_set_pulses_per_rotation(void)
 {
-	tc_stop_counter(&tc_instance_tacho);
-	delete_extint_callbacks();
-	
-	for(uint8_t i=0; i<CFG_MAX_FAN_COUNT; i++)
-	{
-		fantacho[i] = cnt_tacho[i] * 2 * (60/pulses_per_rotation);
-	}
-	ready_flag_get_fan_speed = 1;
+	tacho_min_us = 60000000UL / ((uint32_t)CFG_TACHO_MAX_RPM * max(pulses_per_rotation, 1));
 }
 
 /*
- * Delete Tacho interrupts
+ * Called in interrupt context for every tacho edge: timestamp the edge with the system time base,
+ * reject glitches and measure the duration of every revolution. The low 32 bit of the us time
+ * are enough, the differences are wrap safe and a stalled fan is restarted long before
  */
-static void delete_extint_callbacks(void)
+static void tacho_edge(uint8_t fan)
 {
-	extint_unregister_callback(extint_detection_callback_int_0 ,0,EXTINT_CALLBACK_TYPE_DETECT);
-	extint_unregister_callback(extint_detection_callback_int_1 ,1,EXTINT_CALLBACK_TYPE_DETECT);
-	extint_unregister_callback(extint_detection_callback_int_4 ,4,EXTINT_CALLBACK_TYPE_DETECT);
-	extint_unregister_callback(extint_detection_callback_int_5 ,5,EXTINT_CALLBACK_TYPE_DETECT);
-#ifdef SIX_FANs
-	extint_unregister_callback(extint_detection_callback_int_13 ,13,EXTINT_CALLBACK_TYPE_DETECT);
-	extint_unregister_callback(extint_detection_callback_int_12 ,12,EXTINT_CALLBACK_TYPE_DETECT);
-#endif
+	PROFILE_ISR(PROFILE_ISR_EXTINT);
+	volatile struct tacho_state *t = &tacho[fan];
+	uint32_t now = (uint32_t) sys_time_us();
+	
+	if(!t->running)
+	{
+		t->running = true;
+		t->last_edge = now;
+		t->rev_start = now;
+		t->pulses = 0;
+		t->seen = true;
+		return;
+	}
+	
+	if(now - t->last_edge < tacho_min_us) //faster than any fan: glitch
+	{
+		return;
+	}
+	t->last_edge = now;
+	t->seen = true;
+	
+	if(++t->pulses >= pulses_per_rotation)
+	{
+		t->rev_us = now - t->rev_start;
+		t->rev_start = now;
+		t->pulses = 0;
+		t->rev_ready = true;
+	}
 }
 
 /*
- *Enable Tacho interrupts
+ * Enable Tacho interrupts (once at init, they stay enabled)
  */
 static void enable_extint_callbacks(void)
 {
-	extint_chan_enable_callback(0 ,EXTINT_CALLBACK_TYPE_DETECT);
-	extint_chan_clear_detected(0);
 	extint_register_callback(extint_detection_callback_int_0, 0 ,EXTINT_CALLBACK_TYPE_DETECT);
+	extint_chan_clear_detected(0);
+	extint_chan_enable_callback(0 ,EXTINT_CALLBACK_TYPE_DETECT);
 	
-	extint_chan_enable_callback(1 ,EXTINT_CALLBACK_TYPE_DETECT);
-	extint_chan_clear_detected(1);
 	extint_register_callback(extint_detection_callback_int_1, 1 ,EXTINT_CALLBACK_TYPE_DETECT);
+	extint_chan_clear_detected(1);
+	extint_chan_enable_callback(1 ,EXTINT_CALLBACK_TYPE_DETECT);
 	
-	extint_chan_enable_callback(4 ,EXTINT_CALLBACK_TYPE_DETECT);
-	extint_chan_clear_detected(4);
 	extint_register_callback(extint_detection_callback_int_4, 4 ,EXTINT_CALLBACK_TYPE_DETECT);
-		
-	extint_chan_enable_callback(5 ,EXTINT_CALLBACK_TYPE_DETECT);
-	extint_chan_clear_detected(5);
+	extint_chan_clear_detected(4);
+	extint_chan_enable_callback(4 ,EXTINT_CALLBACK_TYPE_DETECT);
+	
 	extint_register_callback(extint_detection_callback_int_5, 5 ,EXTINT_CALLBACK_TYPE_DETECT);
+	extint_chan_clear_detected(5);
+	extint_chan_enable_callback(5 ,EXTINT_CALLBACK_TYPE_DETECT);
 	
 #ifdef SIX_FANs
-	extint_chan_enable_callback(13 ,EXTINT_CALLBACK_TYPE_DETECT);
-	extint_chan_clear_detected(13);
 	extint_register_callback(extint_detection_callback_int_13, 13 ,EXTINT_CALLBACK_TYPE_DETECT);
+	extint_chan_clear_detected(13);
+	extint_chan_enable_callback(13 ,EXTINT_CALLBACK_TYPE_DETECT);
 	
-	extint_chan_enable_callback(12 ,EXTINT_CALLBACK_TYPE_DETECT);
-	extint_chan_clear_detected(12);
 	extint_register_callback(extint_detection_callback_int_12, 12 ,EXTINT_CALLBACK_TYPE_DETECT);
+	extint_chan_clear_detected(12);
+	extint_chan_enable_callback(12 ,EXTINT_CALLBACK_TYPE_DETECT);
 #endif
 }
 
@@ -277,7 +391,7 @@ static void enable_extint_callbacks(void)
  */
 static void extint_detection_callback_int_0(void)
 {	
-	cnt_tacho[0]++;
+	tacho_edge(0);
 }
 
 /*
@@ -285,7 +399,7 @@ static void extint_detection_callback_int_0(void)
  */
 static void extint_detection_callback_int_1(void)
 {	
-	cnt_tacho[1]++;
+	tacho_edge(1);
 }
 
 /*
@@ -293,7 +407,7 @@ static void extint_detection_callback_int_1(void)
  */
 static void extint_detection_callback_int_4(void)
 {	
-	cnt_tacho[2]++;
+	tacho_edge(2);
 }
 
 /*
@@ -301,7 +415,7 @@ static void extint_detection_callback_int_4(void)
  */
 static void extint_detection_callback_int_5(void)
 {	
-	cnt_tacho[3]++;
+	tacho_edge(3);
 }
 
 #ifdef SIX_FANs
@@ -310,7 +424,7 @@ static void extint_detection_callback_int_5(void)
  */
 static void extint_detection_callback_int_13(void)
 {	
-	cnt_tacho[4]++;
+	tacho_edge(4);
 }
 
 /*
@@ -318,26 +432,58 @@ static void extint_detection_callback_int_13(void)
  */
 static void extint_detection_callback_int_12(void)
 {	
-	cnt_tacho[5]++;
+	tacho_edge(5);
 }
 #endif
 
 /*
- * Measure the speed of the fans
+ * Convert the last revolution of every fan to RPM and filter it.
+ * A fan without tacho pulse for CFG_TACHO_STALL_TIMEOUT is reported with 0 rpm
  */
-static void get_fan_speed(void)
+static void tacho_update(void)
 {
+	uint32_t rev_us;
+	bool rev_ready, seen;
+	uint32_t rpm;
+	
 	for(uint8_t i=0; i<CFG_MAX_FAN_COUNT; i++)
 	{
-		cnt_tacho[i] = 0;
+		system_interrupt_enter_critical_section();
+		rev_us = tacho[i].rev_us;
+		rev_ready = tacho[i].rev_ready;
+		seen = tacho[i].seen;
+		tacho[i].rev_ready = false;
+		tacho[i].seen = false;
+		system_interrupt_leave_critical_section();
+		
+		if(seen)
+		{
+			tacho_last_seen[i] = get_jiffies();
+		}
+		else if(get_jiffies() - tacho_last_seen[i] > CFG_TACHO_STALL_TIMEOUT)
+		{
+			system_interrupt_enter_critical_section();
+			tacho[i].running = false; //the next edge starts a new measurement
+			system_interrupt_leave_critical_section();
+			fantacho[i] = 0;
+			continue;
+		}
+		
+		if(rev_ready && rev_us)
+		{
+			rpm = 60000000UL / rev_us;
+			if(fantacho[i] == 0)
+			{
+				fantacho[i] = rpm; //(re)started fan: no filter history
+			}
+			else
+			{
+				fantacho[i] = (uint32_t) ((int32_t)fantacho[i] + (((int32_t)rpm - (int32_t)fantacho[i]) >> CFG_TACHO_FILTER));
+			}
+		}
 	}
-	ready_flag_get_fan_speed = 0;
-	tc_stop_counter(&tc_instance_tacho);
-	tc_start_counter(&tc_instance_tacho);
-	enable_extint_callbacks();
 }
 
-
 /*
  * Check whether there is a fan alarm.
  */
@@ -368,64 +514,111 @@ static void check_fan_fail(void)
  */
 void load_learned_fan_values(void)
 {
-	learned_fans_available = env_get("learned_fans");
+	static const uint8_t max_speed_env[CFG_MAX_FAN_COUNT] = {
+		ENV_max_speed_learned_fan1, ENV_max_speed_learned_fan2, ENV_max_speed_learned_fan3,
+		ENV_max_speed_learned_fan4, ENV_max_speed_learned_fan5, ENV_max_speed_learned_fan6
+	};
+	
+	learned_fans_available = env_get(ENV_learned_fans);
+	for(uint8_t i=0; i<CFG_MAX_FAN_COUNT; i++)
+	{
+		fan_max_speed[i] = env_get((enum env_index)max_speed_env[i]);
+	}
 }
 
 /*
- * Learn the fans (available).
- */	
-void learn_fan(void)
+ * Learn mode: the fans are ramped up to full speed and measured, every step is continued by
+ * learn_fan_timer; learn_fan_done is started when the result is stored (about 8.9 sec)
+ */
+#define LEARN_FAN_RAMP_STEPS	71	//rise the pwm slowly from 30% to 100% (inverted!), 50ms per step
+
+static struct soft_timer learn_fan_timer;
+static struct soft_timer *learn_fan_done;
+static uint8_t learn_fan_pos;
+
+/*
+ * Evaluate the tachos at full speed and store the available fans and their max speed
+ */
+static void learn_fan_store(void)
 {
-		uint16_t fan_available=0;
-		uint8_t fan_count=0;
-	
-		ioport_set_pin_level(CFG_EN_12V_FAN, 1);
+	uint16_t fan_available=0;
+	uint8_t fan_count=0;
 	
-		for (uint8_t i=0; i<71; i++ ) //rise the pwm slowly from 30% to 100% (inverted!)
+	for(uint8_t i=0; i<CFG_MAX_FAN_COUNT; i++) //Check which the Fans run with more than 300rpm
+	{
+		if(fantacho[i]>300)
 		{
-			tc_set_compare_value(&tc_instance_pwm, TC_COMPARE_CAPTURE_CHANNEL_0, 70-i);
-			delay_cycles_ms(50);
+			fan_available |= (1<<i);
+			fan_count++;
 		}
-		
-		delay_cycles_ms(5000); //Wait 5 sec to guarantee that the fans are at full speed 
-
-		get_fan_speed();
-		
-		while(ready_flag_get_fan_speed == 0); //wait until the fanspeed of all fans is measured
-		
-		for(uint8_t i=0; i<CFG_MAX_FAN_COUNT; i++) //Check which the Fans run with more than 300rpm
+		else
 		{
-			if(fantacho[i]>300)
-			{
-				fan_available |= (1<<i);
-				fan_count++;
-			}
-			else
-			{
-				fan_available  &= ~(1<<i);
-			}
+			fan_available  &= ~(1<<i);
 		}
-		
-		printf("Measure fan tacho at max speed:\r\n");
-		for(uint8_t i=0; i<CFG_MAX_FAN_COUNT; i++)
+	}
+	
+	printf("Measure fan tacho at max speed:\r\n");
+	for(uint8_t i=0; i<CFG_MAX_FAN_COUNT; i++)
+	{
+		if((fan_available & 1<<i) == 1<<i)
 		{
-			if((fan_available & 1<<i) == 1<<i)
-			{
-				printf("Tacho%d: %ld\r\n", i, fantacho[i]);
-			}
+			printf("Tacho%d: %ld\r\n", i, fantacho[i]);
 		}
-			
-		env_set("max_speed_learned_fan1", (uint32_t)fantacho[0]);
-		env_set("max_speed_learned_fan2", (uint32_t)fantacho[1]);
-		env_set("max_speed_learned_fan3", (uint32_t)fantacho[2]);
-		env_set("max_speed_learned_fan4", (uint32_t)fantacho[3]);
+	}
+		
+	env_set(ENV_max_speed_learned_fan1, (uint32_t)fantacho[0]);
+	env_set(ENV_max_speed_learned_fan2, (uint32_t)fantacho[1]);
+	env_set(ENV_max_speed_learned_fan3, (uint32_t)fantacho[2]);
+	env_set(ENV_max_speed_learned_fan4, (uint32_t)fantacho[3]);
 #ifdef SIX_FANs
-		env_set("max_speed_learned_fan5", (uint32_t)fantacho[4]);
-		env_set("max_speed_learned_fan6", (uint32_t)fantacho[5]);
+	env_set(ENV_max_speed_learned_fan5, (uint32_t)fantacho[4]);
+	env_set(ENV_max_speed_learned_fan6, (uint32_t)fantacho[5]);
 #endif
-		env_set("learned_fans", (uint32_t)fan_available);
-		
-		tc_set_compare_value(&tc_instance_pwm, TC_COMPARE_CAPTURE_CHANNEL_0, 100-CFG_PWM_INITIAL_VALUE); //set the pwm to 30%		
+	env_set(ENV_learned_fans, (uint32_t)fan_available);
+}
+
+/*
+ * One step of the fan learning (learn_fan_timer callback)
+ */
+static void learn_fan_step(void *arg)
+{
+	uint8_t step = learn_fan_pos++;
+	
+	if(step < LEARN_FAN_RAMP_STEPS)
+	{
+		tc_set_compare_value(&tc_instance_pwm, TC_COMPARE_CAPTURE_CHANNEL_0, LEARN_FAN_RAMP_STEPS - 1 - step);
+		soft_timer_start(&learn_fan_timer, 50, 0);
+	}
+	else if(step == LEARN_FAN_RAMP_STEPS)
+	{
+		soft_timer_start(&learn_fan_timer, 5000, 0); //Wait 5 sec to guarantee that the fans are at full speed 
+	}
+	else if(step == LEARN_FAN_RAMP_STEPS + 1)
+	{
+		tacho_update(); //take over the pulses of the last 5 sec
+		soft_timer_start(&learn_fan_timer, CFG_TACHO_STALL_TIMEOUT + 50, 0);
+	}
+	else
+	{
+		tacho_update(); //stopped fans are reported with 0 rpm now
+		learn_fan_store();
+		tc_set_compare_value(&tc_instance_pwm, TC_COMPARE_CAPTURE_CHANNEL_0, 100-CFG_PWM_INITIAL_VALUE); //set the pwm to 30%
+		soft_timer_start(learn_fan_done, 0, 0);
+	}
+}
+
+/*
+ * Learn the fans (available). Returns at once, done is started when the fans are learned
+ */	
+void learn_fan(struct soft_timer *done)
+{
+	ioport_set_pin_level(CFG_EN_12V_FAN, 1);
+	
+	learn_fan_done = done;
+	learn_fan_pos = 0;
+	soft_timer_stop(&learn_fan_timer);
+	soft_timer_init(&learn_fan_timer, learn_fan_step, NULL);
+	learn_fan_step(NULL);
 }
 
 /*
@@ -433,28 +626,17 @@ void learn_fan(void)
  */
 void fan_init(void)
 {	
-	pwm_frequency = env_get("pwm_frequency"); //take the pwm frequency from the env
+	pwm_frequency = env_get(ENV_pwm_frequency); //take the pwm frequency from the env
 	printf("Fan PWM frequency: %d\r\n", (int)pwm_frequency);
-	pulses_per_rotation = env_get("pulses_per_rotation"); //take the pulses per rotation of the fan from the env
+	pulses_per_rotation = env_get(ENV_pulses_per_rotation); //take the pulses per rotation of the fan from the env
 	printf("Fan pulses per rotation: %d\r\n", pulses_per_rotation);
+	tacho_set_pulses_per_rotation();
 	
 	struct tc_config config_tc_fan_pwm;
 	tc_get_config_defaults(&config_tc_fan_pwm);
 	config_tc_fan_pwm.counter_size = TC_COUNTER_SIZE_8BIT;
 	
-	switch(pwm_frequency)
-	{
-		case 80000: config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV1; 	break;
-		case 40000:	config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV2; 	break;
-		case 20000:	config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV4; 	break;
-		case 10000:	config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV8; 	break;
-		case 5000:	config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV16; 	break;
-		case 1250:	config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV64; 	break;
-		case 312:	config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV256; 	break;
-		case 78:	config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV1024;	break;
-		default:	config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV64;	break;
-	}
-	
+	config_tc_fan_pwm.clock_prescaler = pwm_prescaler(pwm_frequency);
 	config_tc_fan_pwm.clock_source = GCLK_GENERATOR_1;
 	config_tc_fan_pwm.wave_generation = TC_WAVE_GENERATION_NORMAL_PWM;
 	config_tc_fan_pwm.counter_8_bit.value = 0;
@@ -466,19 +648,6 @@ void fan_init(void)
 	tc_init(&tc_instance_pwm, CFG_PWM_MODULE, &config_tc_fan_pwm);
 	tc_enable(&tc_instance_pwm);
 		
-	struct tc_config config_tc_tacho;
-	tc_get_config_defaults(&config_tc_tacho);
-	config_tc_tacho.counter_size = TC_COUNTER_SIZE_16BIT;
-	config_tc_tacho.clock_source = GCLK_GENERATOR_1;
-	config_tc_tacho.clock_prescaler = TC_CLOCK_PRESCALER_DIV256;
-	config_tc_tacho.counter_16_bit.value = 0;
-	config_tc_tacho.counter_16_bit.compare_capture_channel[TC_COMPARE_CAPTURE_CHANNEL_0] = 15625; //500ms
-	tc_init(&tc_instance_tacho, CFG_TACHO_MODULE, &config_tc_tacho);
-	tc_enable(&tc_instance_tacho);
-	tc_register_callback(&tc_instance_tacho, tc_callback_timer1, TC_CALLBACK_CC_CHANNEL0);
-	tc_enable_callback(&tc_instance_tacho, TC_CALLBACK_CC_CHANNEL0);
-	tc_stop_counter(&tc_instance_tacho);
-	
 	struct extint_chan_conf config_extint_0;
 	extint_chan_get_config_defaults(&config_extint_0);
 	config_extint_0.gpio_pin           = CFG_INT0_PIN_FAN1;
@@ -529,7 +698,64 @@ void fan_init(void)
 	extint_chan_set_config(12, &config_extint_12);
 #endif
 	
+	enable_extint_callbacks();
+	
 	ioport_set_pin_dir(CFG_FAN_MAX_SPEED, IOPORT_DIR_INPUT);
+	
+	env_subscribe(ENV_BIT(pwm_frequency) | ENV_BIT(pulses_per_rotation), fan_env_changed);
+}
+
+/*
+ * TC prescaler for a PWM frequency (the PWM period is 100 counts)
+ */
+static enum tc_clock_prescaler pwm_prescaler(uint32_t frequency)
+{
+	switch(frequency)
+	{
+		case 80000: return TC_CLOCK_PRESCALER_DIV1;
+		case 40000:	return TC_CLOCK_PRESCALER_DIV2;
+		case 20000:	return TC_CLOCK_PRESCALER_DIV4;
+		case 10000:	return TC_CLOCK_PRESCALER_DIV8;
+		case 5000:	return TC_CLOCK_PRESCALER_DIV16;
+		case 1250:	return TC_CLOCK_PRESCALER_DIV64;
+		case 312:	return TC_CLOCK_PRESCALER_DIV256;
+		case 78:	return TC_CLOCK_PRESCALER_DIV1024;
+		default:	return TC_CLOCK_PRESCALER_DIV64;
+	}
+}
+
+/*
+ * Change the PWM frequency in place: the prescaler is enable protected,
+ * so only the PWM counter is stopped for the update
+ */
+static void pwm_set_prescaler(enum tc_clock_prescaler prescaler)
+{
+	TcCount8 *const tc = &tc_instance_pwm.hw->COUNT8;
+	
+	tc_disable(&tc_instance_pwm);
+	tc->CTRLA.reg = (tc->CTRLA.reg & ~TC_CTRLA_PRESCALER_Msk) | prescaler;
+	while (tc_is_syncing(&tc_instance_pwm));
+	tc_enable(&tc_instance_pwm);
+}
+
+/*
+ * Apply changed fan variables of the environment (called from do_env)
+ */
+static void fan_env_changed(uint64_t changed)
+{
+	if (changed & ENV_BIT(pwm_frequency)) 
+	{
+		pwm_frequency = env_get(ENV_pwm_frequency);
+		printf("PWM: changing pwm frequency to %d\r\n", (int)pwm_frequency);
+		pwm_set_prescaler(pwm_prescaler(pwm_frequency));
+	}
+	
+	if (changed & ENV_BIT(pulses_per_rotation)) 
+	{
+		pulses_per_rotation = env_get(ENV_pulses_per_rotation);
+		printf("Fan: changing pulses per rotation %d\r\n", pulses_per_rotation);
+		tacho_set_pulses_per_rotation();
+	}
 }
 
 /*
@@ -537,22 +763,17 @@ void fan_init(void)
  */
 static void fan_sync_to_smbus(void)
 {
-	smbus_set_input_reg(SMBUS_REG__FAN_TACHO_1_LOW_BYTE, fantacho[0] & 0xFF);
-	smbus_set_input_reg(SMBUS_REG__FAN_TACHO_1_HIGH_BYTE, (fantacho[0]>>8) & 0xFF);
-	smbus_set_input_reg(SMBUS_REG__FAN_TACHO_2_LOW_BYTE, fantacho[1] & 0xFF);
-	smbus_set_input_reg(SMBUS_REG__FAN_TACHO_2_HIGH_BYTE, (fantacho[1]>>8) & 0xFF);
-	smbus_set_input_reg(SMBUS_REG__FAN_TACHO_3_LOW_BYTE, fantacho[2] & 0xFF);
-	smbus_set_input_reg(SMBUS_REG__FAN_TACHO_3_HIGH_BYTE, (fantacho[2]>>8) & 0xFF);
-	smbus_set_input_reg(SMBUS_REG__FAN_TACHO_4_LOW_BYTE, fantacho[3] & 0xFF);
-	smbus_set_input_reg(SMBUS_REG__FAN_TACHO_4_HIGH_BYTE, (fantacho[3]>>8) & 0xFF);
+	smbus_frame_set_word(SMBUS_REG__FAN_TACHO_1_LOW_BYTE, fantacho[0]);
+	smbus_frame_set_word(SMBUS_REG__FAN_TACHO_2_LOW_BYTE, fantacho[1]);
+	smbus_frame_set_word(SMBUS_REG__FAN_TACHO_3_LOW_BYTE, fantacho[2]);
+	smbus_frame_set_word(SMBUS_REG__FAN_TACHO_4_LOW_BYTE, fantacho[3]);
 #ifdef SIX_FANs
-	smbus_set_input_reg(SMBUS_REG__FAN_TACHO_5_LOW_BYTE, fantacho[4] & 0xFF);
-	smbus_set_input_reg(SMBUS_REG__FAN_TACHO_5_HIGH_BYTE, (fantacho[4]>>8) & 0xFF);
-	smbus_set_input_reg(SMBUS_REG__FAN_TACHO_6_LOW_BYTE, fantacho[5] & 0xFF);
-	smbus_set_input_reg(SMBUS_REG__FAN_TACHO_6_HIGH_BYTE, (fantacho[5]>>8) & 0xFF);
+	smbus_frame_set_word(SMBUS_REG__FAN_TACHO_5_LOW_BYTE, fantacho[4]);
+	smbus_frame_set_word(SMBUS_REG__FAN_TACHO_6_LOW_BYTE, fantacho[5]);
 #endif
-	smbus_set_input_reg(SMBUS_REG__MAX_SPEED, ioport_get_pin_level(CFG_FAN_MAX_SPEED));
-	smbus_set_input_reg(SMBUS_REG__FAN_SPEED, current_pwm);
+	smbus_frame_set_byte(SMBUS_REG__MAX_SPEED, ioport_get_pin_level(CFG_FAN_MAX_SPEED));
+	smbus_frame_set_byte(SMBUS_REG__FAN_SPEED, current_pwm);
+	smbus_telemetry_commit();
 }
 
 
@@ -561,39 +782,21 @@ static void fan_sync_to_smbus(void)
  */
 void do_fan(void)
 {
-	uint32_t new_pwm_frequency;
-	uint8_t new_pulses_per_rotation;
-	
 	if (get_jiffies() - last_pwm_adjust >= 100)
 	{
 		last_pwm_adjust = get_jiffies();
 		pwm_calculation_autonomous_mode();
+		pwm_calculation_closed_loop();
 		set_pwm();
 	}
 	
-	if (get_jiffies() - last_tacho_measure >= 2000) 
+	if (get_jiffies() - last_tacho_measure >= CFG_TACHO_UPDATE) 
 	{
 		last_tacho_measure = get_jiffies();
-		get_fan_speed();
+		tacho_update();
 		fan_sync_to_smbus();	
 		check_fan_fail();
 	}	
-	
-	new_pwm_frequency = env_get("pwm_frequency");
-	if (new_pwm_frequency != pwm_frequency) 
-	{
-		printf("PWM: changing pwm frequency to %d\r\n", (int)new_pwm_frequency);
-		pwm_frequency = new_pwm_frequency;
-		tc_reset(&tc_instance_pwm);
-		fan_init();
-	}
-	
-	new_pulses_per_rotation = env_get("pulses_per_rotation");
-	if (new_pulses_per_rotation != pulses_per_rotation) 
-	{
-		printf("Fan: changing pulses per rotation %d\r\n", new_pulses_per_rotation);
-		pulses_per_rotation = new_pulses_per_rotation;
-	}
 }
 
 #endif /* BOOTLOADER */
\ No newline at end of file
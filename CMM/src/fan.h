@@ -9,6 +9,8 @@
 #ifndef FAN_H_
 #define FAN_H_
 
+#include "soft_timer.h"
+
 #define SIX_FANs
 
 extern uint32_t fanpwm_from_cli;
@@ -23,7 +25,7 @@ extern uint32_t fantacho6;
 
 void load_learned_fan_values(void);
 void set_spinup_speed_of_fans(void);
-void learn_fan(void);
+void learn_fan(struct soft_timer *done);
 void fan_init(void);
 void do_fan(void);
 
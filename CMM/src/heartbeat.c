@@ -26,4 +26,10 @@ void do_heartbeat(uint32_t skip)
 	if ((cnt++ % skip) == 0) {
 		ioport_toggle_pin_level(CFG_HEARTBEAT_LED);
 	}
-}
\ No newline at end of file
+}
+
+/* Main loop task: toggle on every run, the rate is the task period (CFG_TASKS) */
+void heartbeat_toggle(void)
+{
+	do_heartbeat(1);
+}
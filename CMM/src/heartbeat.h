@@ -9,5 +9,6 @@
 #define __HEARTBEAT_H__
 
 void do_heartbeat(uint32_t skip);
+void heartbeat_toggle(void);
 
 #endif /* __HEARTBEAT_H__ */
\ No newline at end of file
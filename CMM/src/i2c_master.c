@@ -5,44 +5,105 @@
  *  Author: E1130513
  */ 
 #include <asf.h>
+#include <string.h>
 
 #include "config.h"
 #include "uart.h"
 #include "sys_timer.h"
 #include "i2c_master.h"
 #include "smbus.h"
+#include "log.h"
+#include "soft_timer.h"
 
 #ifndef BOOTLOADER
 
 static struct i2c_master_module i2c_master_instance;
-struct i2c_master_packet wr_packet;
-struct i2c_master_packet rd_packet;
-static bool i2c_master_write_complete = false;
-static bool i2c_master_read_complete = false;
-uint32_t i2c_master_timeout_counter;
+static struct i2c_master_packet i2c_packet;
+static volatile bool i2c_master_phase_done = false;	//set by the ASF callbacks (complete or error)
+/*
+ * Queued I2C master transfer: write wr_data, then read rd_data (repeated start)
+ */
+struct i2c_master_job {
+	uint8_t address;
+	uint8_t wr_len;
+	uint8_t rd_len;
+	uint8_t tag;					//free for the submitter, e.g. device index
+	uint16_t timeout;				//msec per phase
+	i2c_master_done_t done;
+	uint8_t wr_data[CFG_I2C_MASTER_JOB_DATA];
+	uint8_t rd_data[CFG_I2C_MASTER_JOB_DATA];
+};
+
+static struct i2c_master_job i2c_queue[CFG_I2C_MASTER_QUEUE_SIZE];
+static uint8_t i2c_queue_head;							//next free entry
+static uint8_t i2c_queue_tail;							//oldest job, running if i2c_state != I2C_STATE_IDLE
+static uint8_t i2c_queue_count;
+static uint32_t i2c_job_start;
 static uint8_t tb_present=0;
+static uint32_t i2c_shadow_hit, i2c_shadow_miss, i2c_shadow_verify_fail;
+static struct soft_timer i2c_shadow_verify_timer;
 static uint8_t send_buffer[20];
-static uint8_t read_buffer[255];
-static uint32_t last_i2c_master_write;
+static struct soft_timer i2c_master_write_timer;
 static uint8_t read_i2c_components = 0;
 
+/*
+ * Shadow of the device registers written by the master; a write is only sent if the value differs
+ */
+#define I2C_SHADOW_VALID		0x01	//value is known to be in the device
+#define I2C_SHADOW_PENDING		0x02	//write of pending_value is queued
+
+struct i2c_shadow_reg {
+	uint8_t address;
+	uint8_t reg;
+	uint8_t value;
+	uint8_t pending_value;
+	uint8_t flags;
+};
+
+enum {
+	I2C_SHADOW_TB_FIRST = 0,						//4 registers per trigger bridge
+	I2C_SHADOW_CLK_SYNC100_DIV = 4*4,
+	I2C_SHADOW_COUNT
+};
+
+static struct i2c_shadow_reg i2c_shadow[I2C_SHADOW_COUNT];
+
+static enum {
+	I2C_STATE_IDLE,
+	I2C_STATE_WRITE,
+	I2C_STATE_READ,
+} i2c_state = I2C_STATE_IDLE;
+
 static void i2c_master_write_complete_callback(struct i2c_master_module *const module);
 static void i2c_master_read_complete_callback(struct i2c_master_module *const module);
 static void i2c_master_error_callback(struct i2c_master_module *const module);
-static void i2c_master_write (uint8_t *write_buffer, uint16_t data_length, uint16_t slave_address);
-static void i2c_master_read (uint8_t *read_buffer, uint16_t data_length, uint16_t slave_address);
-static uint8_t i2c_slave_present (uint8_t *read_buffer, uint16_t data_length, uint16_t slave_address);
+static void i2c_master_module_init(void);
+static void i2c_master_recover(void);
+static enum status_code i2c_master_start_phase(struct i2c_master_job *job);
+static void i2c_master_finish(enum status_code status);
+static void i2c_shadow_init(void);
+static void i2c_shadow_write_done(uint8_t tag, enum status_code status, const uint8_t *rd_data);
+static void i2c_shadow_write(uint8_t index, uint8_t value);
+static void i2c_shadow_invalidate(uint8_t address);
+static void i2c_shadow_verify_done(uint8_t tag, enum status_code status, const uint8_t *rd_data);
+static void i2c_shadow_verify(void);
+static void triggerbridge_present_done(uint8_t tag, enum status_code status, const uint8_t *rd_data);
 static void triggerbridge_present(void);
 static void write_triggerbridge_values(void);
+static void clock_module_fw_done(uint8_t tag, enum status_code status, const uint8_t *rd_data);
+static void clock_module_present_done(uint8_t tag, enum status_code status, const uint8_t *rd_data);
 static void read_clock_module(void);
 static void write_clock_module(void);
+static void i2c_master_pump(void);
+static void i2c_master_write_periodic(void *arg);
+static void i2c_shadow_verify_periodic(void *arg);
 
 /*
- * Callback, if the master writes the pointer to the slave complete. The master can start reading the data from the slave
+ * Callback, if the master completed writing to the slave
  */
 static void i2c_master_write_complete_callback(struct i2c_master_module *const module)
 {
-	i2c_master_write_complete = true;
+	i2c_master_phase_done = true;
 }
 
 /*
@@ -50,52 +111,23 @@ static void i2c_master_write_complete_callback(struct i2c_master_module *const m
  */
 static void i2c_master_read_complete_callback(struct i2c_master_module *const module)
 {
-	i2c_master_read_complete = true;
+	i2c_master_phase_done = true;
 }
 
 /*
- * Callback, if an error occurs at the master i2c Module
+ * Callback, if an error occurs at the master i2c Module (e.g. no slave acknowledged the address).
+ * The pump takes the status from i2c_master_get_job_status()
  */
 static void i2c_master_error_callback(struct i2c_master_module *const module)
 {
-/*
-	printf("\r\nI2C Error at Master i2c module: ");
-	if(STATUS_OK == i2c_master_get_job_status(&i2c_master_instance))
-	{
-		printf("STATUS_OK");
-	}
-	if(STATUS_BUSY == i2c_master_get_job_status(&i2c_master_instance))
-	{
-		printf("STATUS_BUSY");
-	}
-	if(STATUS_ERR_DENIED == i2c_master_get_job_status(&i2c_master_instance))
-	{
-		printf("STATUS_ERR_DENIED");
-	}
-	if(STATUS_ERR_PACKET_COLLISION == i2c_master_get_job_status(&i2c_master_instance))
-	{
-		printf("STATUS_ERR_PACKET_COLLISION");
-	}
-	if(STATUS_ERR_BAD_ADDRESS == i2c_master_get_job_status(&i2c_master_instance))
-	{
-		printf("STATUS_ERR_BAD_ADDRESS");
-	}
-	if(STATUS_ERR_TIMEOUT == i2c_master_get_job_status(&i2c_master_instance))
-	{
-		printf("STATUS_ERR_TIMEOUT");
-	}
-	if(STATUS_ERR_OVERFLOW == i2c_master_get_job_status(&i2c_master_instance))
-	{
-		printf("STATUS_ERR_OVERFLOW");
-	}
-*/
+	i2c_master_phase_done = true;
 }
 
 /*
  * Configure the I2C Master module
  * 100kHz Bus frequency
  */
-void i2c_init_master(void)
+static void i2c_master_module_init(void)
 {
 	struct i2c_master_config config_i2c_master;
 	i2c_master_get_config_defaults(&config_i2c_master);
@@ -110,110 +142,249 @@ void i2c_init_master(void)
 	i2c_master_enable_callback(&i2c_master_instance,I2C_MASTER_CALLBACK_READ_COMPLETE);
 	i2c_master_register_callback(&i2c_master_instance, i2c_master_error_callback , I2C_MASTER_CALLBACK_ERROR);
 	i2c_master_enable_callback(&i2c_master_instance,I2C_MASTER_CALLBACK_ERROR);
-	
+}
+
+/*
+ * Initialize the I2C Master
+ */
+void i2c_init_master(void)
+{
+	i2c_master_module_init();
+	i2c_shadow_init();
 	smbus_set_input_reg(SMBUS_REG__SYNC100_DIV, 1);
+	soft_timer_init(&i2c_master_write_timer, i2c_master_write_periodic, NULL);
+	soft_timer_start(&i2c_master_write_timer, 1000, 1000);
+	soft_timer_init(&i2c_shadow_verify_timer, i2c_shadow_verify_periodic, NULL);
+	soft_timer_start(&i2c_shadow_verify_timer, CFG_I2C_MASTER_VERIFY, CFG_I2C_MASTER_VERIFY);
 }
 
 /*
- * Function to write from master to slave
+ * Reset the I2C Master module after a stuck or refused transfer
  */
-static void i2c_master_write (uint8_t *write_buffer, uint16_t data_length, uint16_t slave_address)
+static void i2c_master_recover(void)
 {
-	wr_packet.data = write_buffer;
-	wr_packet.address     = slave_address;
-	wr_packet.data_length = data_length;
+	i2c_master_cancel_job(&i2c_master_instance);
+	i2c_master_reset(&i2c_master_instance);
+	i2c_master_module_init();
+	log_printf("\r\nReset I2C Master because of transfer error");
+}
+
+/*
+ * Queue an I2C transfer: write wr_len bytes, then read rd_len bytes (repeated start) from the slave.
+ * Either length may be 0. done (optional) is called from do_i2c_master() with the result.
+ * return 0 on success, -1 if the job is invalid or the queue is full
+ */
+int i2c_master_submit(uint8_t address, const uint8_t *wr_data, uint8_t wr_len, uint8_t rd_len, uint16_t timeout, i2c_master_done_t done, uint8_t tag)
+{
+	struct i2c_master_job *job;
 	
-	if(STATUS_OK!=i2c_master_write_packet_job(&i2c_master_instance, &wr_packet))
+	if((wr_len > CFG_I2C_MASTER_JOB_DATA) || (rd_len > CFG_I2C_MASTER_JOB_DATA) || (wr_len + rd_len == 0))
 	{
-		i2c_master_reset(&i2c_master_instance);
-		i2c_init_master();
-		printf("\r\nReset I2C Master because of write error");
+		log_printf("I2C: invalid job for 0x%02x\r\n", address);
+		return -1;
 	}
-		
-	i2c_master_write_complete = false;
-	i2c_master_timeout_counter = 0;
-	while(i2c_master_write_complete == false)
+	if(i2c_queue_count >= CFG_I2C_MASTER_QUEUE_SIZE)
 	{
-		delay_cycles_ms(1);
-		if(i2c_master_timeout_counter > CFG_I2C_MASTER_TIMEOUT)
-		{
-			i2c_master_write_complete = true;//Also set true in the i2c_master_write_complete_callback
-		}
-		else
-		{
-			i2c_master_timeout_counter++;
-		}
+		log_printf("I2C: queue full, job for 0x%02x dropped\r\n", address);
+		return -1;
 	}
+	
+	job = &i2c_queue[i2c_queue_head];
+	job->address = address;
+	job->wr_len = wr_len;
+	job->rd_len = rd_len;
+	job->timeout = timeout;
+	job->done = done;
+	job->tag = tag;
+	memcpy(job->wr_data, wr_data, wr_len);
+	
+	i2c_queue_head = (i2c_queue_head + 1) % CFG_I2C_MASTER_QUEUE_SIZE;
+	i2c_queue_count++;
+	
+	return 0;
 }
 
 /*
- * Function to read from slave
+ * Start the write or the read phase of a job
  */
-static void i2c_master_read (uint8_t *read_buf, uint16_t data_length, uint16_t slave_address)
+static enum status_code i2c_master_start_phase(struct i2c_master_job *job)
 {
-	rd_packet.address     = slave_address;
-	rd_packet.data_length = data_length;
-	rd_packet.data        = read_buf;
+	i2c_packet.address = job->address;
+	i2c_master_phase_done = false;
+	i2c_job_start = get_jiffies();
 	
-	if(STATUS_OK!=i2c_master_read_packet_job(&i2c_master_instance, &rd_packet))
+	if(i2c_state == I2C_STATE_WRITE)
 	{
-		i2c_master_reset(&i2c_master_instance);
-		i2c_init_master();
-		printf("\r\nReset I2C Master because of write error");
+		i2c_packet.data = job->wr_data;
+		i2c_packet.data_length = job->wr_len;
+		if(job->rd_len)
+		{
+			return i2c_master_write_packet_job_no_stop(&i2c_master_instance, &i2c_packet);
+		}
+		return i2c_master_write_packet_job(&i2c_master_instance, &i2c_packet);
 	}
 	
-	i2c_master_read_complete = false;
-	i2c_master_timeout_counter = 0;
+	i2c_packet.data = job->rd_data;
+	i2c_packet.data_length = job->rd_len;
+	return i2c_master_read_packet_job(&i2c_master_instance, &i2c_packet);
+}
+
+/*
+ * The running job is done: remove it from the queue and notify the submitter
+ */
+static void i2c_master_finish(enum status_code status)
+{
+	struct i2c_master_job *job = &i2c_queue[i2c_queue_tail];
 	
+	i2c_state = I2C_STATE_IDLE;
+	i2c_queue_tail = (i2c_queue_tail + 1) % CFG_I2C_MASTER_QUEUE_SIZE;
+	i2c_queue_count--;
 	
-	while(i2c_master_read_complete == false)
+	if(job->done)
 	{
-		delay_cycles_ms(1);
-		if(i2c_master_timeout_counter > CFG_I2C_MASTER_TIMEOUT)
-		{
-			i2c_master_read_complete = true;//Also set true in the i2c_master_write_complete_callback
-		}
-		else
+		job->done(job->tag, status, job->rd_data);
+	}
+}
+
+/*
+ * Assign the device registers to the shadow entries
+ */
+static void i2c_shadow_init(void)
+{
+	const uint8_t tb_regs[4] = {6, 7, 2, 3};	//configuration port 0/1, output port 0/1
+	
+	for(uint8_t i=0; i<4; i++)
+	{
+		for(uint8_t j=0; j<4; j++)
 		{
-			i2c_master_timeout_counter++;
+			i2c_shadow[I2C_SHADOW_TB_FIRST + i*4 + j].address = CFG_I2C_MASTER_TB1_ADDRESS + i;
+			i2c_shadow[I2C_SHADOW_TB_FIRST + i*4 + j].reg = tb_regs[j];
 		}
 	}
+	i2c_shadow[I2C_SHADOW_CLK_SYNC100_DIV].address = CFG_I2C_MASTER_CLK_ADDRESS;
+	i2c_shadow[I2C_SHADOW_CLK_SYNC100_DIV].reg = 4; //EEPROM Address of the clock modul of the register Sync100_div
 }
 
 /*
- * Check if i2c slave is present
+ * Shadowed write finished: the device holds the value now, or its state is unknown
  */
-static uint8_t i2c_slave_present (uint8_t *read_buf, uint16_t data_length, uint16_t slave_address)
+static void i2c_shadow_write_done(uint8_t tag, enum status_code status, const uint8_t *rd_data)
 {
-	rd_packet.address     = slave_address;
-	rd_packet.data_length = data_length;
-	rd_packet.data        = read_buf;
+	struct i2c_shadow_reg *shadow = &i2c_shadow[tag];
 	
-	i2c_master_write_packet_job(&i2c_master_instance, &rd_packet);
-	
-	i2c_master_write_complete = false;
-	i2c_master_timeout_counter = 0;
+	shadow->flags &= ~I2C_SHADOW_PENDING;
+	if(status == STATUS_OK)
+	{
+		shadow->value = shadow->pending_value;
+		shadow->flags |= I2C_SHADOW_VALID;
+	}
+	else
+	{
+		shadow->flags &= ~I2C_SHADOW_VALID;
+	}
+}
+
+/*
+ * Write a device register through its shadow; nothing is sent if the device already holds the value
+ */
+static void i2c_shadow_write(uint8_t index, uint8_t value)
+{
+	struct i2c_shadow_reg *shadow = &i2c_shadow[index];
+	uint8_t buffer[2];
 	
-	while(i2c_master_write_complete == false)
+	if(shadow->flags & I2C_SHADOW_PENDING)
 	{
-		if(i2c_master_timeout_counter > CFG_I2C_MASTER_TIMEOUT)
+		if(shadow->pending_value == value)
 		{
-			i2c_master_write_complete = true;//Also set true in the i2c_master_write_complete_callback
-			return 0;
+			i2c_shadow_hit++;
+			return;
 		}
-		else
+	}
+	else if((shadow->flags & I2C_SHADOW_VALID) && (shadow->value == value))
+	{
+		i2c_shadow_hit++;
+		return;
+	}
+	
+	i2c_shadow_miss++;
+	buffer[0] = shadow->reg;
+	buffer[1] = value;
+	if(i2c_master_submit(shadow->address, buffer, 2, 0, CFG_I2C_MASTER_TIMEOUT, i2c_shadow_write_done, index) == 0)
+	{
+		shadow->pending_value = value;
+		shadow->flags |= I2C_SHADOW_PENDING;
+	}
+}
+
+/*
+ * Forget the shadowed values of a device (e.g. not present anymore)
+ */
+static void i2c_shadow_invalidate(uint8_t address)
+{
+	for(uint8_t i=0; i<I2C_SHADOW_COUNT; i++)
+	{
+		if(i2c_shadow[i].address == address)
 		{
-			i2c_master_timeout_counter++;
+			i2c_shadow[i].flags &= ~I2C_SHADOW_VALID;
 		}
-		delay_cycles_ms(1);
 	}
+}
+
+/*
+ * Read back finished: a device that lost its value (e.g. after a reset) is written again on the next update
+ */
+static void i2c_shadow_verify_done(uint8_t tag, enum status_code status, const uint8_t *rd_data)
+{
+	struct i2c_shadow_reg *shadow = &i2c_shadow[tag];
 	
-	if(STATUS_ERR_BAD_ADDRESS == i2c_master_get_job_status(&i2c_master_instance))
+	if(shadow->flags & I2C_SHADOW_PENDING)
 	{
-		return 0;
+		return; //a newer write is queued, the read back is outdated
 	}
-	
-	return 1;
+	if((status != STATUS_OK) || (rd_data[0] != shadow->value))
+	{
+		shadow->flags &= ~I2C_SHADOW_VALID;
+		i2c_shadow_verify_fail++;
+	}
+}
+
+/*
+ * Read back all valid shadowed registers
+ */
+static void i2c_shadow_verify(void)
+{
+	for(uint8_t i=0; i<I2C_SHADOW_COUNT; i++)
+	{
+		if((i2c_shadow[i].flags & (I2C_SHADOW_VALID | I2C_SHADOW_PENDING)) == I2C_SHADOW_VALID)
+		{
+			i2c_master_submit(i2c_shadow[i].address, &i2c_shadow[i].reg, 1, 1, CFG_I2C_MASTER_TIMEOUT, i2c_shadow_verify_done, i);
+		}
+	}
+}
+
+/*
+ * Print the shadow register statistics
+ */
+void i2c_shadow_stats(void)
+{
+	log_printf("I2C shadow: %lu hits, %lu misses, %lu verify failures\r\n", i2c_shadow_hit, i2c_shadow_miss, i2c_shadow_verify_fail);
+}
+
+/*
+ * Check if triggerbridge is present: result of the probe
+ */
+static void triggerbridge_present_done(uint8_t tag, enum status_code status, const uint8_t *rd_data)
+{
+	if(status == STATUS_OK)
+	{
+		tb_present |= (1 << tag);
+	}
+	else
+	{
+		tb_present &= ~(1 << tag);
+		i2c_shadow_invalidate(CFG_I2C_MASTER_TB1_ADDRESS + tag);
+	}
+	smbus_set_input_reg(SMBUS_REG__TBPRES,tb_present);
 }
 
 /*
@@ -222,15 +393,11 @@ static uint8_t i2c_slave_present (uint8_t *read_buf, uint16_t data_length, uint1
 static void triggerbridge_present(void)
 {
 	send_buffer[0] = 0;
-	uint8_t tb1_present, tb2_present, tb3_present, tb4_present;
-	
-	tb1_present =	i2c_slave_present(send_buffer, 1, CFG_I2C_MASTER_TB1_ADDRESS);
-	tb2_present =	i2c_slave_present(send_buffer, 1, CFG_I2C_MASTER_TB2_ADDRESS);
-	tb3_present =	i2c_slave_present(send_buffer, 1, CFG_I2C_MASTER_TB3_ADDRESS);
-	tb4_present =	i2c_slave_present(send_buffer, 1, CFG_I2C_MASTER_TB4_ADDRESS);
 	
-	tb_present = (tb4_present << 3) | (tb3_present << 2) | (tb2_present << 1) | tb1_present;
-	smbus_set_input_reg(SMBUS_REG__TBPRES,tb_present);
+	for(uint8_t i=0; i<4; i++)
+	{
+		i2c_master_submit(CFG_I2C_MASTER_TB1_ADDRESS + i, send_buffer, 1, 0, CFG_I2C_MASTER_TIMEOUT, triggerbridge_present_done, i);
+	}
 }
 
 /*
@@ -247,50 +414,56 @@ static void write_triggerbridge_values(void)
 			tb_en = smbus_get_input_reg(i*2+SMBUS_REG__TB1_EN);
 			tb_dir = smbus_get_input_reg(i*2+1+SMBUS_REG__TB1_EN);
 			
-			send_buffer[0] = 6;
-			send_buffer[1] = ~tb_en;
-			i2c_master_write(send_buffer, 2, CFG_I2C_MASTER_TB1_ADDRESS + i);
-			send_buffer[0] = 7;
-			send_buffer[1] = ~tb_en;
-			i2c_master_write(send_buffer, 2, CFG_I2C_MASTER_TB1_ADDRESS + i);
-			
-			send_buffer[0] = 2;
-			send_buffer[1] = ~tb_dir;
-			i2c_master_write(send_buffer, 2, CFG_I2C_MASTER_TB1_ADDRESS + i);
-			send_buffer[0] = 3;
-			send_buffer[1] = tb_dir;
-			i2c_master_write(send_buffer, 2, CFG_I2C_MASTER_TB1_ADDRESS + i);
+			i2c_shadow_write(I2C_SHADOW_TB_FIRST + i*4 + 0, ~tb_en);
+			i2c_shadow_write(I2C_SHADOW_TB_FIRST + i*4 + 1, ~tb_en);
+			i2c_shadow_write(I2C_SHADOW_TB_FIRST + i*4 + 2, ~tb_dir);
+			i2c_shadow_write(I2C_SHADOW_TB_FIRST + i*4 + 3, tb_dir);
 		}
 	}
 }
 
 /*
- * Read the clock module values
+ * Read the clock module values: firmware bytes read
  */
-static void read_clock_module(void)
+static void clock_module_fw_done(uint8_t tag, enum status_code status, const uint8_t *rd_data)
 {
-	uint8_t clockmodul_present=0;
-	
-	send_buffer[0] = 0;
-	clockmodul_present = i2c_slave_present(send_buffer, 1, CFG_I2C_MASTER_CLK_ADDRESS);
+	if(status != STATUS_OK)
+	{
+		return;
+	}
+	for(uint8_t i=0; i<10; i++)
+	{
+		smbus_frame_set_byte(SMBUS_REG__CLOCK_MODULE_FW_BYTE_1+i, rd_data[i]);
+	}
+	smbus_frame_commit();
+}
+
+/*
+ * Read the clock module values: result of the probe
+ */
+static void clock_module_present_done(uint8_t tag, enum status_code status, const uint8_t *rd_data)
+{
+	uint8_t clockmodul_present = (status == STATUS_OK);
 	
 	smbus_set_input_reg(SMBUS_REG__CLOCKMODUL_PRESENT, clockmodul_present);
+	if(clockmodul_present == 0)
+	{
+		i2c_shadow_invalidate(CFG_I2C_MASTER_CLK_ADDRESS);
+	}
 	if(clockmodul_present == 1)
 	{
 		send_buffer[0] = 0;
-		i2c_master_write(send_buffer, 1, CFG_I2C_MASTER_CLK_ADDRESS);
-		i2c_master_read(read_buffer, 10, CFG_I2C_MASTER_CLK_ADDRESS);
-		smbus_set_input_reg(SMBUS_REG__CLOCK_MODULE_FW_BYTE_1, read_buffer[0]);
-		smbus_set_input_reg(SMBUS_REG__CLOCK_MODULE_FW_BYTE_2, read_buffer[1]);
-		smbus_set_input_reg(SMBUS_REG__CLOCK_MODULE_FW_BYTE_3, read_buffer[2]);
-		smbus_set_input_reg(SMBUS_REG__CLOCK_MODULE_FW_BYTE_4, read_buffer[3]);
-		smbus_set_input_reg(SMBUS_REG__CLOCK_MODULE_FW_BYTE_5, read_buffer[4]);
-		smbus_set_input_reg(SMBUS_REG__CLOCK_MODULE_FW_BYTE_6, read_buffer[5]);
-		smbus_set_input_reg(SMBUS_REG__CLOCK_MODULE_FW_BYTE_7, read_buffer[6]);
-		smbus_set_input_reg(SMBUS_REG__CLOCK_MODULE_FW_BYTE_8, read_buffer[7]);
-		smbus_set_input_reg(SMBUS_REG__CLOCK_MODULE_FW_BYTE_9, read_buffer[8]);
-		smbus_set_input_reg(SMBUS_REG__CLOCK_MODULE_FW_BYTE_10, read_buffer[9]);
-	}	
+		i2c_master_submit(CFG_I2C_MASTER_CLK_ADDRESS, send_buffer, 1, 10, CFG_I2C_MASTER_TIMEOUT, clock_module_fw_done, 0);
+	}
+}
+
+/*
+ * Read the clock module values
+ */
+static void read_clock_module(void)
+{
+	send_buffer[0] = 0;
+	i2c_master_submit(CFG_I2C_MASTER_CLK_ADDRESS, send_buffer, 1, 0, CFG_I2C_MASTER_TIMEOUT, clock_module_present_done, 0);
 }
 
 /*
@@ -298,27 +471,22 @@ static void read_clock_module(void)
  */
 static void write_clock_module(void)
 {
-	static uint8_t sync100_div_privious_value;
-	
 	if(smbus_get_input_reg(SMBUS_REG__WRITE_DATA) == 1) //Write only, if "Write_Data" is '1' which is set by i2c
 	{
 		smbus_set_input_reg(SMBUS_REG__WRITE_DATA, 0); //Clr "Write_Data"
 		send_buffer[0] = 8; //PLL Address Register
 		send_buffer[1] = smbus_get_input_reg(SMBUS_REG__ADD_HIGH_BYTE);
 		send_buffer[2] = smbus_get_input_reg(SMBUS_REG__ADD_LOW_BYTE); 
-		i2c_master_write(send_buffer, 3, CFG_I2C_MASTER_CLK_ADDRESS);
+		i2c_master_submit(CFG_I2C_MASTER_CLK_ADDRESS, send_buffer, 3, 0, CFG_I2C_MASTER_TIMEOUT, NULL, 0);
 		
 		send_buffer[0] = 12; //PLL Data Register
 		send_buffer[1] = smbus_get_input_reg(SMBUS_REG__DATA);
-		i2c_master_write(send_buffer, 2, CFG_I2C_MASTER_CLK_ADDRESS);
+		i2c_master_submit(CFG_I2C_MASTER_CLK_ADDRESS, send_buffer, 2, 0, CFG_I2C_MASTER_TIMEOUT, NULL, 0);
 	}
 	
-	if(sync100_div_privious_value != smbus_get_input_reg(SMBUS_REG__SYNC100_DIV)) //Write only the sync 100 register, if a new valuie is available
+	if(smbus_get_input_reg(SMBUS_REG__CLOCKMODUL_PRESENT) == 1) //Sync100_div is only written, if a new value is available
 	{
-		send_buffer[0] = 4; //EEPROM Address of the clock modul of the register Sync100_div
-		send_buffer[1] = smbus_get_input_reg(SMBUS_REG__SYNC100_DIV);
-		i2c_master_write(send_buffer, 2, CFG_I2C_MASTER_CLK_ADDRESS);
-		sync100_div_privious_value = smbus_get_input_reg(SMBUS_REG__SYNC100_DIV); //save the new value
+		i2c_shadow_write(I2C_SHADOW_CLK_SYNC100_DIV, smbus_get_input_reg(SMBUS_REG__SYNC100_DIV));
 	}
 }
 
@@ -441,6 +609,75 @@ void initial_read_i2c_components(void)
 }
 
 
+/*
+ * Pump the job queue: start the next job, advance a running job from its write to its read
+ * phase, complete it or abort it after its timeout. Never waits for the bus
+ */
+static void i2c_master_pump(void)
+{
+	struct i2c_master_job *job;
+	enum status_code status;
+	
+	if(i2c_state == I2C_STATE_IDLE)
+	{
+		if(i2c_queue_count == 0)
+		{
+			return;
+		}
+		job = &i2c_queue[i2c_queue_tail];
+		i2c_state = job->wr_len ? I2C_STATE_WRITE : I2C_STATE_READ;
+		if(i2c_master_start_phase(job) != STATUS_OK)
+		{
+			i2c_master_recover();
+			i2c_master_finish(STATUS_ERR_DENIED);
+		}
+		return;
+	}
+	
+	job = &i2c_queue[i2c_queue_tail];
+	if(!i2c_master_phase_done)
+	{
+		if(get_jiffies() - i2c_job_start > job->timeout)
+		{
+			i2c_master_recover();
+			i2c_master_finish(STATUS_ERR_TIMEOUT);
+		}
+		return;
+	}
+	
+	status = i2c_master_get_job_status(&i2c_master_instance);
+	if((status == STATUS_OK) && (i2c_state == I2C_STATE_WRITE) && job->rd_len)
+	{
+		i2c_state = I2C_STATE_READ;
+		if(i2c_master_start_phase(job) != STATUS_OK)
+		{
+			i2c_master_recover();
+			i2c_master_finish(STATUS_ERR_DENIED);
+		}
+		return;
+	}
+	i2c_master_finish(status);
+}
+
+
+/*
+ * Write the trigger bridge and clock module values every second (soft timer)
+ */
+static void i2c_master_write_periodic(void *arg)
+{
+	write_triggerbridge_values();
+	write_clock_module();
+//	read_pdb();
+}
+
+/*
+ * Verify the shadowed registers every CFG_I2C_MASTER_VERIFY (soft timer)
+ */
+static void i2c_shadow_verify_periodic(void *arg)
+{
+	i2c_shadow_verify();
+}
+
 /*
  * Do the i2c master relevant functions
  */
@@ -448,19 +685,13 @@ void do_i2c_master(void)
 {	
 	if(read_i2c_components == 1)
 	{
+		read_i2c_components = 0;
 		triggerbridge_present();
 		read_clock_module();
 //		read_fru_info_pdb();
-		read_i2c_components = 0;
 	}
 	
-	if (get_jiffies() - last_i2c_master_write >= 1000)
-	{
-		last_i2c_master_write = get_jiffies();
-		write_triggerbridge_values();
-		write_clock_module();
-//		read_pdb();
-	}	
+	i2c_master_pump();
 }
 
 #endif /* BOOTLOADER */
\ No newline at end of file
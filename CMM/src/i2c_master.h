@@ -9,7 +9,14 @@
 #ifndef I2C_MASTER_H_
 #define I2C_MASTER_H_
 
+/*
+ * Completion of a queued transfer, rd_data holds the read bytes if status is STATUS_OK
+ */
+typedef void (*i2c_master_done_t)(uint8_t tag, enum status_code status, const uint8_t *rd_data);
+
 void i2c_init_master(void);
+int i2c_master_submit(uint8_t address, const uint8_t *wr_data, uint8_t wr_len, uint8_t rd_len, uint16_t timeout, i2c_master_done_t done, uint8_t tag);
+void i2c_shadow_stats(void);
 void initial_read_i2c_components(void);
 void do_i2c_master(void);
 
@@ -14,13 +14,19 @@
 #include "fan.h"
 #include "led.h"
 #include "power_management.h"
+#include "soft_timer.h"
 
 #ifndef BOOTLOADER
 
 static void voltage_test(void);
+static void learn_continue(void *arg);
+
+static struct soft_timer learn_timer;	/* Continues the learn sequence after every step */
+static uint8_t learn_step;
 
 /*
- * Check whether the voltages have the correct value and so check also the cabling of the power supply
+ * Check whether the voltages have the correct value and so check also the cabling of the power supply.
+ * Called 2 sec after the 5V were turned on
  */
 static void voltage_test(void)
 {
@@ -40,9 +46,6 @@ static void voltage_test(void)
 	}
 	*/
 	
-	turn_5V_on();
-
-	delay_cycles_ms(2000);
 	voltages_get_values();
 		/*
 	check_voltage_ok();
@@ -73,39 +76,61 @@ static void voltage_test(void)
 }
 
 /*
- * Learn fan and temp values and signalize the values via the user interface at the front plate
+ * Learn sequence, one step per call; the steps that take time start learn_timer when they are done
  */
-void learn(void)
+static void learn_continue(void *arg)
 {
-	static uint8_t init_done;
-	
-	if (!init_done) {
-		ioport_set_pin_dir(CFG_DIP4_LEARN, IOPORT_DIR_INPUT);
-		init_done = 1;
-	}
-	
-	if((env_get("learned") == 0) || (ioport_get_pin_level(CFG_DIP4_LEARN) == 0))
+	switch(learn_step++)
 	{
+		case 0:
 		printf("\r\nPlease wait until the voltage test...\r\n\r\n");
+		turn_5V_on();	// power open one by one
+		soft_timer_start(&learn_timer, 2000, 0);
+		break;
 		
-		voltage_test();	// power open one by one
-		
+		case 1:
+		voltage_test();
 		printf("\r\nPlease wait until the Fan Controller learned...\r\n\r\n");
+		learn_fan(&learn_timer);
+		break;
 		
-		learn_fan();
-		
+		case 2:
 		learn_temp();
+		signalize_learn_state(&learn_timer);
+		break;
 		
-		signalize_learn_state();
-		
-		env_set("learned", 1);
-		
-		do_env();
-		
+		default:
+		env_set(ENV_learned, 1);
+		env_flush();
 		printf("\r\nLearning process finnished\r\n\r\n");
-		
-		signalize_restart_system();
-	}	
+		signalize_restart_system(); //until the system is restarted
+		break;
+	}
+}
+
+/*
+ * Learn fan and temp values and signalize the values via the user interface at the front plate.
+ * Returns true if the learn mode was started: it runs from the main loop (CFG_LEARN_TASKS) and
+ * ends with the request to restart the system
+ */
+bool learn(void)
+{
+	static uint8_t init_done;
+	
+	if (!init_done) {
+		ioport_set_pin_dir(CFG_DIP4_LEARN, IOPORT_DIR_INPUT);
+		init_done = 1;
+	}
+	
+	if((env_get(ENV_learned) == 0) || (ioport_get_pin_level(CFG_DIP4_LEARN) == 0))
+	{
+		learn_step = 0;
+		soft_timer_init(&learn_timer, learn_continue, NULL);
+		learn_continue(NULL);
+		return true;
+	}
+	
+	return false;
 }
 
 #endif /* BOOTLOADER */
\ No newline at end of file
@@ -9,6 +9,8 @@
 #ifndef LEARN_H_
 #define LEARN_H_
 
-void learn(void);
+#include <stdbool.h>
+
+bool learn(void);
 
 #endif /* LEARN_H_ */
\ No newline at end of file
@@ -14,13 +14,21 @@
 #include "env.h"
 #include "smbus.h"
 #include "adc_measure.h"
+#include "soft_timer.h"
 
 #ifndef BOOTLOADER
 
-static uint32_t led_1sec_timer;
-static uint32_t force_led_to_green_delay = 0;
+static struct soft_timer force_led_to_green_timer;	/* Running: the LED is forced to green */
+static struct soft_timer led_signal_timer;			/* Blink pattern of the signalize_*() functions */
+static struct soft_timer *led_signal_done;
+static uint8_t led_signal_count[2];				/* Learn state: blinks for the temps, the fans */
+static uint8_t led_signal_group;
+static uint8_t led_signal_toggles;
 
 static void signalize_in_operating_mode(void);
+static void led_signal_toggle(void *arg);
+static void led_signal_learn_state(void *arg);
+static void force_LED_to_green_end(void *arg);
 
 /*
  * Initialize the System LED'S
@@ -31,6 +39,25 @@ void led_init(void)
 	ioport_set_pin_dir(CFG_LED_GRN, IOPORT_DIR_OUTPUT);
 	LED_Off(CFG_LED_RED);
 	LED_Off(CFG_LED_GRN);
+	soft_timer_init(&force_led_to_green_timer, force_LED_to_green_end, NULL);
+}
+
+/*
+ * Periodic blinking of a signalize_*() pattern, arg is the LED
+ */
+static void led_signal_toggle(void *arg)
+{
+	LED_Toggle((uintptr_t)arg);
+}
+
+/*
+ * Blink a LED until the next pattern is started (the signalize functions return at once)
+ */
+static void led_signal_blink(uint8_t led, uint32_t period)
+{
+	soft_timer_stop(&led_signal_timer);	//the previous pattern may still run
+	soft_timer_init(&led_signal_timer, led_signal_toggle, (void *)(uintptr_t)led);
+	soft_timer_start(&led_signal_timer, 0, period);
 }
 
 /*
@@ -38,11 +65,9 @@ void led_init(void)
  */
 void signalize_3v3_not_ok(void)
 {
-	while(1)
-	{
-		LED_On(CFG_LED_RED);
-		LED_Off(CFG_LED_GRN);
-	}
+	soft_timer_stop(&led_signal_timer);
+	LED_On(CFG_LED_RED);
+	LED_Off(CFG_LED_GRN);
 }
 
 /*
@@ -50,12 +75,8 @@ void signalize_3v3_not_ok(void)
  */
 void signalize_5v_not_ok(void)
 {	
-	while(1)
-	{
-		LED_Toggle(CFG_LED_RED);
-		LED_Off(CFG_LED_GRN);
-		delay_cycles_ms(500);
-	}
+	LED_Off(CFG_LED_GRN);
+	led_signal_blink(CFG_LED_RED, 500);
 }
 
 /*
@@ -63,12 +84,8 @@ void signalize_5v_not_ok(void)
  */
 void signalize_12v_not_ok(void)
 {
-	while(1)
-	{
-		LED_Toggle(CFG_LED_RED);
-		LED_Off(CFG_LED_GRN);
-		delay_cycles_ms(166);
-	}
+	LED_Off(CFG_LED_GRN);
+	led_signal_blink(CFG_LED_RED, 166);
 }
 
 /*
@@ -76,25 +93,47 @@ void signalize_12v_not_ok(void)
  */
 void signalize_restart_system(void)
 {
-	while(1)
+	LED_Off(CFG_LED_GRN);
+	led_signal_blink(CFG_LED_GRN, 100);
+}
+
+/*
+ * Learn state pattern, one step per call: 2 sec off, blink the temps (500ms on, 500ms off),
+ * 2 sec off, blink the fans, 2 sec off, then led_signal_done is started
+ */
+static void led_signal_learn_state(void *arg)
+{
+	if(led_signal_group >= 2)
 	{
-		LED_On(CFG_LED_GRN);
-		delay_cycles_ms(100);
-		LED_Off(CFG_LED_GRN);
-		delay_cycles_ms(100);
+		soft_timer_start(led_signal_done, 0, 0);
+		return;
+	}
+	
+	if(led_signal_toggles < 2 * led_signal_count[led_signal_group])
+	{
+		LED_Toggle(CFG_LED_GRN);
+		led_signal_toggles++;
+		soft_timer_start(&led_signal_timer, 500, 0);
+	}
+	else
+	{
+		LED_Off(CFG_LED_GRN); //2 sec delay, that the following count blinking can be visualized
+		led_signal_group++;
+		led_signal_toggles = 0;
+		soft_timer_start(&led_signal_timer, 2000, 0);
 	}
 }
 
 /*
- * Signalize how many fans and temps are learned
+ * Signalize how many fans and temps are learned. Returns at once, done is started after the pattern
  */
-void signalize_learn_state(void)
+void signalize_learn_state(struct soft_timer *done)
 {
 	uint8_t learned_fans, learned_fans_count=0;
 	uint8_t learned_temps, learned_temps_count=0;
 	
-	learned_fans = env_get("learned_fans");
-	learned_temps = env_get("learned_temperature_sensors");
+	learned_fans = env_get(ENV_learned_fans);
+	learned_temps = env_get(ENV_learned_temperature_sensors);
 	
 	for(uint8_t i=0; i<8; i++)
 	{
@@ -111,29 +150,15 @@ void signalize_learn_state(void)
 	
 	LED_Off(CFG_LED_GRN); //LED's of and 2 sec delay, that the following cont blinking of the NTC's / Tacho's can be visualized
 	LED_Off(CFG_LED_RED);
-	delay_cycles_ms(2000);
-	
-	for(uint8_t i=0; i<learned_temps_count; i++)
-	{
-		LED_On(CFG_LED_GRN);
-		delay_cycles_ms(500);
-		LED_Off(CFG_LED_GRN);
-		delay_cycles_ms(500);
-	}
 	
-	LED_Off(CFG_LED_GRN);
-	delay_cycles_ms(2000);
-	
-	for(uint8_t i=0; i<learned_fans_count; i++)
-	{
-		LED_On(CFG_LED_GRN);
-		delay_cycles_ms(500);
-		LED_Off(CFG_LED_GRN);
-		delay_cycles_ms(500);
-	}
-	
-	LED_Off(CFG_LED_GRN);
-	delay_cycles_ms(2000);
+	led_signal_count[0] = learned_temps_count;
+	led_signal_count[1] = learned_fans_count;
+	led_signal_group = 0;
+	led_signal_toggles = 0;
+	led_signal_done = done;
+	soft_timer_stop(&led_signal_timer);
+	soft_timer_init(&led_signal_timer, led_signal_learn_state, NULL);
+	soft_timer_start(&led_signal_timer, 2000, 0);
 }
 
 /*
@@ -210,23 +235,27 @@ static void signalize_in_operating_mode(void)
  */
 void force_LED_to_green(void)
 {
-	force_led_to_green_delay = get_jiffies();
+	soft_timer_start(&force_led_to_green_timer, 5000, 0);
 	LED_Off(CFG_LED_RED);
 	LED_On(CFG_LED_GRN);
 }
 
 /*
- * Do the led relevant functions
+ * The forced green is over, show the operating state at once
+ */
+static void force_LED_to_green_end(void *arg)
+{
+	signalize_in_operating_mode();
+}
+
+/*
+ * Do the led relevant functions (periodic task, see CFG_TASKS)
  */
 void do_led(void)
 {
-	if (get_jiffies() - force_led_to_green_delay >= 5000)
+	if (!soft_timer_pending(&force_led_to_green_timer))
 	{
-		if (get_jiffies() - led_1sec_timer >= 1000)
-		{
-			led_1sec_timer = get_jiffies();
-			signalize_in_operating_mode();
-		}
+		signalize_in_operating_mode();
 	}	
 }
 
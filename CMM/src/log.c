@@ -0,0 +1,115 @@
+/*
+ * log.c: deferred console output
+ *
+ * Created: 10/17/2026
+ *  Author: E1210640
+ */ 
+
+#include <asf.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "config.h"
+#include "ring_buffer.h"
+#include "uart.h"
+#include "sys_timer.h"
+#include "log.h"
+
+#ifndef BOOTLOADER
+
+/*
+ * Messages are formatted into a RAM ring and written to the console by the main loop, so
+ * log_printf() never waits for the UART and can be used from interrupt handlers.
+ * A message that does not fit completely is dropped and counted
+ */
+RING_DECLARE(log_ring, char, CFG_LOG_RING_SIZE)
+
+static struct log_ring log_ring;		/* Several producers (main loop, interrupts): put under a critical section */
+static uint32_t log_drop_count;		/* Dropped messages (total) */
+static uint32_t log_drop_reported;	/* Dropped messages already reported on the console */
+#ifdef CFG_LOG_TIMESTAMP
+static bool log_line_start = true;	/* The next message starts a new line (messages may end without newline) */
+#endif
+
+void log_printf(const char *fmt, ...)
+{
+	char buf[CFG_LOG_LINE_SIZE];
+	va_list ap;
+	unsigned int len = 0;
+	int cnt;
+	
+#ifdef CFG_LOG_TIMESTAMP
+	if (log_line_start) {
+		uint64_t now = sys_time_us();
+		
+		cnt = snprintf(buf, sizeof(buf), "[%5lu.%06lu] ", (uint32_t)(now / 1000000), (uint32_t)(now % 1000000));
+		len = cnt > 0 ? cnt : 0;
+	}
+#endif
+	va_start(ap, fmt);
+	cnt = vsnprintf(buf + len, sizeof(buf) - len, fmt, ap);
+	va_end(ap);
+	if (cnt < 0) {
+		return;
+	}
+	len += cnt;
+	if (len >= sizeof(buf)) {
+		len = sizeof(buf) - 1;
+	}
+#ifdef CFG_LOG_TIMESTAMP
+	log_line_start = len && buf[len - 1] == '\n';
+#endif
+	
+	system_interrupt_enter_critical_section();
+	if (log_ring_space(&log_ring) < len) {
+		log_drop_count++;
+	} else {
+		log_ring_put_buf(&log_ring, buf, len);
+	}
+	system_interrupt_leave_critical_section();
+}
+
+uint32_t log_dropped(void)
+{
+	return log_drop_count;
+}
+
+/* Write up to len buffered characters to the console */
+static int log_drain(int len)
+{
+	char buf[CFG_LOG_DRAIN_SIZE];
+	int cnt;
+	
+	if (len > uart_tx_free(CFG_CONSOLE_CHANNEL)) {
+		len = uart_tx_free(CFG_CONSOLE_CHANNEL);
+	}
+	cnt = log_ring_get_buf(&log_ring, buf, len < (int)sizeof(buf) ? len : (int)sizeof(buf));
+	if (cnt) {
+		uart_write(CFG_CONSOLE_CHANNEL, (const uint8_t *)buf, cnt);
+	}
+	
+	return cnt;
+}
+
+/* Write out everything buffered (e.g. before a reset, when the main loop does not run anymore) */
+void log_flush(void)
+{
+	do {
+		log_drain(CFG_LOG_DRAIN_SIZE);
+		uart_flush(CFG_CONSOLE_CHANNEL);
+	} while (log_ring_count(&log_ring));
+}
+
+/* Main loop: move a bounded chunk of buffered messages to the console output buffer (never waits) */
+void do_log(void)
+{
+	uint32_t dropped = log_drop_count;
+	
+	if (dropped != log_drop_reported) {
+		log_drop_reported = dropped;
+		log_printf("LOG: %lu messages dropped\r\n", dropped);
+	}
+	log_drain(CFG_LOG_DRAIN_SIZE);
+}
+
+#endif /* BOOTLOADER */
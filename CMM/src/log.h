@@ -0,0 +1,23 @@
+/*
+ * log.h
+ *
+ * Created: 10/17/2026
+ *  Author: E1210640
+ */ 
+
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include "config.h"
+
+#ifdef BOOTLOADER
+#define log_printf(args...) printf(args)
+#define log_flush()
+#else
+void log_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void log_flush(void);
+uint32_t log_dropped(void);
+void do_log(void);
+#endif
+
+#endif /* __LOG_H__ */
@@ -26,6 +26,26 @@
 #include "fan.h"
 #include "led.h"
 #include "i2c_master.h"
+#include "log.h"
+#include "sched.h"
+#include "soft_timer.h"
+#include "profile.h"
+
+#ifndef BOOTLOADER
+#define CFG_TASK(_name, _function, _period, _deadline) \
+	{ #_name, _function, _period, _deadline },
+
+static const struct sched_task main_tasks[] = { CFG_TASKS };
+static const struct sched_task learn_tasks[] = { CFG_LEARN_TASKS };
+
+#undef CFG_TASK
+
+#define MAIN_TASKS		(sizeof(main_tasks)/sizeof(*main_tasks))
+#define LEARN_TASKS		(sizeof(learn_tasks)/sizeof(*learn_tasks))
+
+static struct sched_stats main_task_stats[MAIN_TASKS];
+static struct sched_stats learn_task_stats[LEARN_TASKS];
+#endif /* BOOTLOADER */
 
 
 
@@ -75,9 +95,6 @@ int main (void)
 	
 	/* Enable global interrupts */
 	system_interrupt_enable_global();
-	learn();
-	load_learned_fan_values();
-	load_learned_temp_values();
 	
 #ifdef CFG_WDT_TIMEOUT
 	wdt_init(CFG_WDT_TIMEOUT);
@@ -88,17 +105,17 @@ int main (void)
 
 		
 	/* Main loop for the tasks */
+	if (learn()) {
+		sched_init(learn_tasks, learn_task_stats, LEARN_TASKS);
+	} else {
+		load_learned_fan_values();
+		load_learned_temp_values();
+		sched_init(main_tasks, main_task_stats, MAIN_TASKS);
+	}
 	while (1) {
 		WDT_RESET;
-		do_env();
-		do_heartbeat(10000);
-		do_cli();
-		do_smbus();
-		do_fan();
-		do_i2c_master();
-		do_measure();
-		do_power_management();
-		do_led();
+		profile_loop();
+		sched_run();
 	}
 #endif /* BOOTLOADER */
 }
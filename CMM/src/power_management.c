@@ -15,6 +15,7 @@
 #include "smbus.h"
 #include "fan.h"
 #include "led.h"
+#include "soft_timer.h"
 
 #ifndef BOOTLOADER
 
@@ -23,10 +24,29 @@ static void extint_detection_callback_int_15(void);
 static void extint_detection_callback_int_10(void);
 static void extint_detection_callback_int_11(void);
 static void power_management_sync_to_smbus(void);
+static void power_on_sequence(void *arg);
+static void power_off_sequence(void *arg);
+static void ps_on_debounced(void *arg);
+
+/*
+ * The rails are switched in sequence with delays in between; the sequences are continued by
+ * software timers, so the main loop keeps running (and the watchdog is served) meanwhile
+ */
+enum power_state {
+	POWER_OFF,
+	POWER_TURNING_ON,
+	POWER_ON,
+	POWER_TURNING_OFF
+};
 
 static uint32_t last_print;
 static uint32_t delay_turn_voltages_off_at_startup=0;
-static uint32_t voltages_on=0;
+static enum power_state power_state = POWER_OFF;
+static uint8_t power_step;					/* Next step of the running sequence */
+static struct soft_timer power_on_timer;
+static struct soft_timer power_off_timer;
+static struct soft_timer ps_on_debounce;
+static volatile bool ps_on_changed;		/* Edge on a PS_ON input, set by the interrupt */
 
 /*
  * Set PS_On signal for enable the PXIe voltages
@@ -77,43 +97,112 @@ void turn_m12V_on(void)
 }
 
 /*
- * turn on all PXIe voltages
+ * Power on sequence, one step per call; every step but the last one schedules the next
+ */
+static void power_on_sequence(void *arg)
+{
+	uint32_t delay;
+	
+	switch(power_step++)
+	{
+		case 0:
+		ioport_set_pin_level(CFG_EN_12V_FAN, 1);
+		set_spinup_speed_of_fans();
+		set_ps_on(CFG_PS_ON_OUT_2_12V_N, 0);
+		//45ms delay resulting through the PDB!!! 
+		set_ps_on(CFG_PS_ON_OUT_1_5V_N, 0);
+		delay = 3;
+		break;
+		
+		case 1:
+		set_ps_on(CFG_PS_ON_OUT_3_3V3_N, 0);
+		delay = 10;
+		break;
+		
+		case 2:
+		set_ps_on(CFG_PS_ON_OUT_4_M12V_N, 0);
+		delay = 300; //Take care that the PWR_OK is set after voltages are stable
+		break;
+		
+		default:
+		initial_read_i2c_components();
+		adc_guard_arm(true); //Watch the rails with the ADC window monitor from now on
+		ioport_set_pin_level(CFG_PWR_OK_UC_N, 0); //Set Power OK to the Embedded Controller
+		force_LED_to_green(); //force Front LED to green for 5 seconds
+		delay_turn_voltages_off_at_startup = get_jiffies(); //force ignore checking Power off for 5 seconds 
+		power_state = POWER_ON;
+		return;
+	}
+	soft_timer_start(&power_on_timer, delay, 0);
+}
+
+/*
+ * Power off sequence, one step per call
+ */
+static void power_off_sequence(void *arg)
+{
+	uint32_t delay;
+	
+	switch(power_step++)
+	{
+		case 0:
+		adc_guard_arm(false);
+		ioport_set_pin_level(CFG_PWR_OK_UC_N, 1); //Clear Power OK to the Embedded Controller
+		ioport_set_pin_level(CFG_EN_12V_FAN, 0);
+		delay = 1;
+		break;
+		
+		case 1:
+		set_ps_on(CFG_PS_ON_OUT_4_M12V_N, 1);
+		delay = 10;
+		break;
+		
+		case 2:
+		set_ps_on(CFG_PS_ON_OUT_3_3V3_N, 1);
+		delay = 10;
+		break;
+		
+		case 3:
+		set_ps_on(CFG_PS_ON_OUT_2_12V_N, 1);
+		delay = 10;
+		break;
+		
+		default:
+		set_ps_on(CFG_PS_ON_OUT_1_5V_N, 1);
+		power_state = POWER_OFF;
+		return;
+	}
+	soft_timer_start(&power_off_timer, delay, 0);
+}
+
+/*
+ * turn on all PXIe voltages (starts the sequence, an interrupted power off sequence is abandoned)
  */
 void turn_voltages_on(void)
 {
-	ioport_set_pin_level(CFG_EN_12V_FAN, 1);
-	set_spinup_speed_of_fans();
-	set_ps_on(CFG_PS_ON_OUT_2_12V_N, 0);
-	//delay_cycles_ms(45);			//Delay resulting through the PDB!!! 
-	set_ps_on(CFG_PS_ON_OUT_1_5V_N, 0);
-	delay_cycles_ms(3);
-	set_ps_on(CFG_PS_ON_OUT_3_3V3_N, 0);
-	delay_cycles_ms(10);
-	set_ps_on(CFG_PS_ON_OUT_4_M12V_N, 0);
-	delay_cycles_ms(300); //Take care that the PWR_OK is set after voltages are stable 	
-	initial_read_i2c_components();
-	ioport_set_pin_level(CFG_PWR_OK_UC_N, 0); //Set Power OK to the Embedded Controller
-	force_LED_to_green(); //force Front LED to green for 5 seconds
-	delay_turn_voltages_off_at_startup = get_jiffies(); //force ignore checking Power off for 5 seconds 
-	voltages_on = 1;
+	if((power_state == POWER_ON) || (power_state == POWER_TURNING_ON))
+	{
+		return;
+	}
+	soft_timer_stop(&power_off_timer);
+	power_state = POWER_TURNING_ON;
+	power_step = 0;
+	power_on_sequence(NULL);
 } 
 
 /*
- * turn off all PXIe voltages
+ * turn off all PXIe voltages (starts the sequence, an interrupted power on sequence is abandoned)
  */
 void turn_voltages_off(void)
 {
-	ioport_set_pin_level(CFG_PWR_OK_UC_N, 1); //Clear Power OK to the Embedded Controller
-	ioport_set_pin_level(CFG_EN_12V_FAN, 0);
-	delay_cycles_ms(1);
-	set_ps_on(CFG_PS_ON_OUT_4_M12V_N, 1);
-	delay_cycles_ms(10);
-	set_ps_on(CFG_PS_ON_OUT_3_3V3_N, 1);
-	delay_cycles_ms(10);
-	set_ps_on(CFG_PS_ON_OUT_2_12V_N, 1);
-	delay_cycles_ms(10);
-	set_ps_on(CFG_PS_ON_OUT_1_5V_N, 1);
-	voltages_on = 0;	
+	if((power_state == POWER_OFF) || (power_state == POWER_TURNING_OFF))
+	{
+		return;
+	}
+	soft_timer_stop(&power_on_timer);
+	power_state = POWER_TURNING_OFF;
+	power_step = 0;
+	power_off_sequence(NULL);
 }
 
 /*
@@ -121,6 +210,10 @@ void turn_voltages_off(void)
  */
 void power_management_init(void)
 {
+	soft_timer_init(&power_on_timer, power_on_sequence, NULL);
+	soft_timer_init(&power_off_timer, power_off_sequence, NULL);
+	soft_timer_init(&ps_on_debounce, ps_on_debounced, NULL);
+	
 	ioport_set_pin_dir(CFG_DIP1_PS_ON_LOGIC, IOPORT_DIR_INPUT);
 	ioport_set_pin_dir(CFG_DIP2_AC_OK, IOPORT_DIR_INPUT);	
 	struct extint_chan_conf config_extint_15;
@@ -197,15 +290,29 @@ static void extint_detection_callback_int_15(void)
 }
 
 /*
- * Turn on/off the system depending the PS_ON from the System Module
+ * PS_ON from the System Module changed, evaluated after debouncing (ps_on_debounced())
  */
 static void extint_detection_callback_int_10(void)
 {
-	delay_cycles_ms(5);
-	
+	ps_on_changed = true;
+}
+
+/*
+ * External PS_On changed (Inhibit Mode), evaluated after debouncing (ps_on_debounced())
+ */
+static void extint_detection_callback_int_11(void)
+{
+	ps_on_changed = true;
+}
+
+/*
+ * Turn on/off the system depending the selected PS_ON input, CFG_PS_ON_DEBOUNCE after its last edge
+ */
+static void ps_on_debounced(void *arg)
+{
 	if(ioport_get_pin_level(CFG_SEL_SS_PS_ON) == 0)
 	{
-		if(ioport_get_pin_level(CFG_SS_PS_ON_IN) == 0)
+		if(ioport_get_pin_level(CFG_SS_PS_ON_IN) == 0) //PS_ON from the System Module
 		{
 			turn_voltages_on();
 		}
@@ -214,18 +321,9 @@ static void extint_detection_callback_int_10(void)
 			turn_voltages_off();
 		}
 	}
-}
-
-/*
- * Turn on off the system depending the External PS_On (Inhibit Mode)
- */
-static void extint_detection_callback_int_11(void)
-{
-	delay_cycles_ms(5);
-	
-	if(ioport_get_pin_level(CFG_SEL_SS_PS_ON) == 1)
+	else
 	{
-		if(ioport_get_pin_level(CFG_EXT_PS_ON_IN) == 1)
+		if(ioport_get_pin_level(CFG_EXT_PS_ON_IN) == 1) //External PS_On (Inhibit Mode)
 		{
 			turn_voltages_on();
 		}
@@ -242,15 +340,16 @@ static void extint_detection_callback_int_11(void)
  */
 static void power_management_sync_to_smbus(void)
 {
-	smbus_set_input_reg(SMBUS_REG__SEL_SS_PS_ON, ioport_get_pin_level(CFG_SEL_SS_PS_ON));
-	smbus_set_input_reg(SMBUS_REG__SS_PS_ON_IN, ioport_get_pin_level(CFG_SS_PS_ON_IN));
-	smbus_set_input_reg(SMBUS_REG__EXT_PS_ON_IN, ioport_get_pin_level(CFG_EXT_PS_ON_IN));
-	smbus_set_input_reg(SMBUS_REG__PS_ON_OUT_1, (~port_pin_get_output_level(CFG_PS_ON_OUT_1_5V_N))&1);
-	smbus_set_input_reg(SMBUS_REG__PS_ON_OUT_2, (~port_pin_get_output_level(CFG_PS_ON_OUT_2_12V_N))&1);
-	smbus_set_input_reg(SMBUS_REG__PS_ON_OUT_3, (~port_pin_get_output_level(CFG_PS_ON_OUT_3_3V3_N))&1);
-	smbus_set_input_reg(SMBUS_REG__PS_ON_OUT_4, (~port_pin_get_output_level(CFG_PS_ON_OUT_4_M12V_N))&1);
-	smbus_set_input_reg(SMBUS_REG__AC_OK, ioport_get_pin_level(CFG_AC_OK_IN));
-	smbus_set_input_reg(SMBUS_REG__PWR_OK, !ioport_get_pin_level(CFG_PWR_OK_UC_N)&1);
+	smbus_frame_set_byte(SMBUS_REG__SEL_SS_PS_ON, ioport_get_pin_level(CFG_SEL_SS_PS_ON));
+	smbus_frame_set_byte(SMBUS_REG__SS_PS_ON_IN, ioport_get_pin_level(CFG_SS_PS_ON_IN));
+	smbus_frame_set_byte(SMBUS_REG__EXT_PS_ON_IN, ioport_get_pin_level(CFG_EXT_PS_ON_IN));
+	smbus_frame_set_byte(SMBUS_REG__PS_ON_OUT_1, (~port_pin_get_output_level(CFG_PS_ON_OUT_1_5V_N))&1);
+	smbus_frame_set_byte(SMBUS_REG__PS_ON_OUT_2, (~port_pin_get_output_level(CFG_PS_ON_OUT_2_12V_N))&1);
+	smbus_frame_set_byte(SMBUS_REG__PS_ON_OUT_3, (~port_pin_get_output_level(CFG_PS_ON_OUT_3_3V3_N))&1);
+	smbus_frame_set_byte(SMBUS_REG__PS_ON_OUT_4, (~port_pin_get_output_level(CFG_PS_ON_OUT_4_M12V_N))&1);
+	smbus_frame_set_byte(SMBUS_REG__AC_OK, ioport_get_pin_level(CFG_AC_OK_IN));
+	smbus_frame_set_byte(SMBUS_REG__PWR_OK, !ioport_get_pin_level(CFG_PWR_OK_UC_N)&1);
+	smbus_telemetry_commit();
 }
 
 /*
@@ -258,7 +357,22 @@ static void power_management_sync_to_smbus(void)
  */
 void do_power_management(void)
 {	
-	if(voltages_on == 0)
+	uint8_t rail_fault;
+	
+	if(ps_on_changed)
+	{
+		ps_on_changed = false;
+		soft_timer_start(&ps_on_debounce, CFG_PS_ON_DEBOUNCE, 0); //every edge restarts the debounce time
+	}
+	
+	rail_fault = adc_guard_fault_get(); //Not throttled, the window monitor already cleared Power OK
+	if((rail_fault != 0) && (power_state == POWER_ON))
+	{
+		printf("Rail fault (0x%02x) detected by the ADC window monitor, turning voltages off\r\n", rail_fault);
+		turn_voltages_off();
+	}
+	
+	if(power_state == POWER_OFF)
 	{
 		if((ioport_get_pin_level(CFG_SEL_SS_PS_ON) == 1) && (ioport_get_pin_level(CFG_EXT_PS_ON_IN) == 1))
 		{
@@ -274,7 +388,7 @@ void do_power_management(void)
 			
 			power_management_sync_to_smbus();
 				
-			if((read_pwr_ok() != 7) && (voltages_on == 1))
+			if((read_pwr_ok() != 7) && (power_state == POWER_ON))
 			{
 				ioport_set_pin_level(CFG_PWR_OK_UC_N, 1);
 				turn_voltages_off();
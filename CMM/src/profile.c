@@ -0,0 +1,181 @@
+/*
+ * profile.c: execution time profiler for the main loop tasks and the interrupt handlers
+ *
+ * Created: 10/17/2026
+ *  Author: E1210640
+ */ 
+
+#include <asf.h>
+#include <stdio.h>
+
+#include "config.h"
+#include "sys_timer.h"
+#include "sched.h"
+#include "smbus.h"
+#include "profile.h"
+
+#if defined(CFG_PROFILE) && !defined(BOOTLOADER)
+
+/*
+ * Times are taken in CPU cycles (sys_timer_cycles(), i.e. SysTick->VAL), converted to us for output.
+ * Task entries are written by the main loop only, every ISR entry only by its own handler.
+ * The loop histogram counts the periods between two scheduler passes, bucket i < profile_buckets[i] us
+ */
+#define PROFILE_BUCKETS		8
+
+struct profile_entry {
+	uint32_t calls;
+	uint32_t min;
+	uint32_t max;
+	uint64_t total;
+};
+
+static const char *profile_isr_names[PROFILE_ISR_COUNT] = { "systick", "smbus", "extint", "adc" };
+static const uint32_t profile_buckets[PROFILE_BUCKETS] = { 10, 30, 100, 300, 1000, 3000, 10000, UINT32_MAX };
+
+static struct profile_entry profile_tasks[CFG_PROFILE_TASKS];
+static volatile struct profile_entry profile_isrs[PROFILE_ISR_COUNT];
+static uint32_t profile_hist[PROFILE_BUCKETS];
+static uint32_t profile_last_loop;
+static uint32_t profile_last_sync;
+
+static void profile_add(volatile struct profile_entry *e, uint32_t cycles)
+{
+	if (!e->calls || cycles < e->min) {
+		e->min = cycles;
+	}
+	if (cycles > e->max) {
+		e->max = cycles;
+	}
+	e->total += cycles;
+	e->calls++;
+}
+
+void profile_scope_exit(struct profile_scope *scope)
+{
+	profile_add(&profile_isrs[scope->isr], sys_timer_cycles() - scope->start);
+}
+
+void profile_task_done(uint8_t task, uint32_t start)
+{
+	if (task < CFG_PROFILE_TASKS) {
+		profile_add(&profile_tasks[task], sys_timer_cycles() - start);
+	}
+}
+
+static uint32_t profile_cycles_per_us(void)
+{
+	return max(system_cpu_clock_get_hz() / 1000000, 1);
+}
+
+/*
+ * Called by the main loop on every pass
+ */
+void profile_loop(void)
+{
+	uint32_t now = sys_timer_cycles();
+	uint32_t us = (now - profile_last_loop) / profile_cycles_per_us();
+	int i;
+	
+	if (profile_last_loop) {
+		for (i = 0; us >= profile_buckets[i]; i++)
+			;
+		profile_hist[i]++;
+	}
+	profile_last_loop = now;
+	
+	if (get_jiffies() - profile_last_sync >= 1000) {
+		profile_last_sync = get_jiffies();
+		profile_sync_to_smbus(smbus_get_input_reg(SMBUS_REG__PROFILE_SELECT));
+	}
+}
+
+static void profile_print_entry(const char *name, struct profile_entry e, uint32_t per_us)
+{
+	if (!e.calls) {
+		printf("%-18s %10s\r\n", name, "0");
+		return;
+	}
+	printf("%-18s %10lu %9lu %9lu %9lu\r\n", name, e.calls, e.min / per_us,
+		(uint32_t)(e.total / e.calls) / per_us, e.max / per_us);
+}
+
+void profile_print(void)
+{
+	struct profile_entry e;
+	uint32_t per_us = profile_cycles_per_us();
+	const char *name;
+	int i;
+	
+	printf("%-18s %10s %9s %9s %9s\r\n", "task/isr", "calls", "min_us", "avg_us", "max_us");
+	for (i = 0; i < CFG_PROFILE_TASKS && (name = sched_task_name(i)); i++) {
+		profile_print_entry(name, profile_tasks[i], per_us);
+	}
+	for (i = 0; i < PROFILE_ISR_COUNT; i++) {
+		system_interrupt_enter_critical_section();
+		e = profile_isrs[i];
+		system_interrupt_leave_critical_section();
+		profile_print_entry(profile_isr_names[i], e, per_us);
+	}
+	printf("Loop period:");
+	for (i = 0; i < PROFILE_BUCKETS; i++) {
+		if (profile_buckets[i] == UINT32_MAX) {
+			printf(" >=%lu: %lu", profile_buckets[i - 1], profile_hist[i]);
+		} else {
+			printf(" <%lu: %lu", profile_buckets[i], profile_hist[i]);
+		}
+	}
+	printf(" (us)\r\n");
+}
+
+void profile_clear(void)
+{
+	system_interrupt_enter_critical_section();
+	memset(profile_tasks, 0, sizeof(profile_tasks));
+	memset((void *)profile_isrs, 0, sizeof(profile_isrs));
+	memset(profile_hist, 0, sizeof(profile_hist));
+	system_interrupt_leave_critical_section();
+}
+
+/*
+ * Fill the SMBus profile block with entry index (tasks first, then the ISRs, then the
+ * loop histogram, layout see README.md)
+ */
+void profile_sync_to_smbus(uint8_t index)
+{
+	uint32_t per_us = profile_cycles_per_us();
+	uint8_t tasks, nr = SMBUS_REG__PROFILE;
+	struct profile_entry e;
+	int i;
+	
+	for (tasks = 0; tasks < CFG_PROFILE_TASKS && sched_task_name(tasks); tasks++)
+		;
+	smbus_frame_set_byte(nr++, SMBUS_PROFILE_VERSION);
+	smbus_frame_set_byte(nr++, index);
+	smbus_frame_set_byte(nr++, tasks);
+	smbus_frame_set_byte(nr++, PROFILE_ISR_COUNT);
+	if (index < tasks + PROFILE_ISR_COUNT) {
+		if (index < tasks) {
+			e = profile_tasks[index];
+		} else {
+			system_interrupt_enter_critical_section();
+			e = profile_isrs[index - tasks];
+			system_interrupt_leave_critical_section();
+		}
+		smbus_frame_set_word(nr, e.calls);
+		smbus_frame_set_word(nr + 2, e.calls >> 16);
+		smbus_frame_set_word(nr + 4, min(e.min / per_us, UINT16_MAX));
+		smbus_frame_set_word(nr + 6, min(e.calls ? (uint32_t)(e.total / e.calls) / per_us : 0, UINT16_MAX));
+		smbus_frame_set_word(nr + 8, min(e.max / per_us, UINT16_MAX));
+		for (i = 10; i < 16; i++) {
+			smbus_frame_set_byte(nr + i, 0);
+		}
+	} else {
+		for (i = 0; i < PROFILE_BUCKETS; i++) {
+			smbus_frame_set_word(nr + 2*i, min(profile_hist[i], UINT16_MAX));
+		}
+	}
+	smbus_frame_commit();
+}
+
+#endif /* CFG_PROFILE */
@@ -0,0 +1,52 @@
+/*
+ * profile.h
+ *
+ * Created: 10/17/2026
+ *  Author: E1210640
+ */ 
+
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include "config.h"
+#include "sys_timer.h"
+
+/* Instrumented interrupt handlers */
+#define PROFILE_ISRS		PROFILE_ISR_DESC(SYSTICK) \
+							PROFILE_ISR_DESC(SMBUS) \
+							PROFILE_ISR_DESC(EXTINT) \
+							PROFILE_ISR_DESC(ADC)
+
+#define PROFILE_ISR_DESC(_name) \
+	PROFILE_ISR_##_name,
+
+enum profile_isr { PROFILE_ISRS PROFILE_ISR_COUNT };
+
+#undef PROFILE_ISR_DESC
+
+#if defined(CFG_PROFILE) && !defined(BOOTLOADER)
+
+struct profile_scope {
+	uint8_t isr;
+	uint32_t start;
+};
+
+void profile_scope_exit(struct profile_scope *scope);
+void profile_task_done(uint8_t task, uint32_t start);
+void profile_loop(void);
+void profile_print(void);
+void profile_clear(void);
+void profile_sync_to_smbus(uint8_t index);
+
+/* Place at the top of an interrupt handler: measures until the handler returns (any return path) */
+#define PROFILE_ISR(_isr) \
+	struct profile_scope profile_scope __attribute__((cleanup(profile_scope_exit))) = { _isr, sys_timer_cycles() }
+
+#else
+
+#define PROFILE_ISR(_isr)
+#define profile_loop()
+
+#endif
+
+#endif /* __PROFILE_H__ */
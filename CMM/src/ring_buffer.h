@@ -8,62 +8,129 @@
 #ifndef __RING_BUFFER__
 #define __RING_BUFFER__
 
-struct ring_buffer {
-	int size;
-	int head;
-	int tail;
-	uint8_t data[];
-};
+#include <string.h>
 
-#define RING_BUFFER(_name, _size) \
-	struct { \
-		int size; \
-		int head; \
-		int tail; \
-		uint8_t data[_size]; \
-	} _name = { (_size), 0, 0, {0} }
-
-static inline int ring_size(void *ptr)
-{
-	struct ring_buffer *ring = (struct ring_buffer *)ptr;
-	
-	return ring->head < ring->tail ? ring->size - ring->tail + ring->head : ring->head - ring->tail;
-}
-
-static inline void ring_put(void *ptr, uint8_t data)
-{
-	struct ring_buffer *ring = (struct ring_buffer *)ptr;
-	
-	if ((ring->head + 1) % ring->size != ring->tail) {
-		ring->data[ring->head++] = data;
-		ring->head %= ring->size;
-	}
-}
-
-static inline uint8_t ring_get(void *ptr)
-{
-	struct ring_buffer *ring = (struct ring_buffer *)ptr;
-	uint8_t ret = 0;
-	
-	if (ring->head != ring->tail) {
-		ret = ring->data[ring->tail++];
-		ring->tail %= ring->size;
-	}
-	
-	return ret;
-}
-
-static inline int ring_get_buf(void *ptr, uint8_t *buf, int size)
-{
-	struct ring_buffer *ring = (struct ring_buffer *)ptr;
-	int cnt = ring_size(ring) < size ? ring_size(ring) : size;
-	int i;
-	
-	for (i = 0; i < cnt; i++) {
-		buf[i] = ring_get(ring);
+/*
+ * RING_DECLARE(name, type, size) declares "struct name" and its functions name_put(), name_get(), ...
+ *
+ * The size must be a power of 2. head and tail run freely and are masked on access, so all
+ * size entries can be used. The ring is safe without masking interrupts as long as there is only
+ * one producer (writes head) and one consumer (writes tail), e.g. an interrupt handler and the
+ * main loop. The Cortex-M0+ does not reorder memory accesses; the __DMB() keeps the compiler
+ * from moving the data accesses across the index update that publishes them.
+ * A zero-initialized ring is empty.
+ */
+#define RING_DECLARE(_name, _type, _size) \
+	struct _name { \
+		volatile uint32_t head;		/* Next entry to write (producer only) */ \
+		volatile uint32_t tail;		/* Next entry to read (consumer only) */ \
+		_type data[_size]; \
+	}; \
+	\
+	typedef char _name##_size_is_power_of_2[((_size) & ((_size) - 1)) == 0 ? 1 : -1]; \
+	\
+	static inline uint32_t _name##_count(const struct _name *ring) \
+	{ \
+		return ring->head - ring->tail; \
+	} \
+	\
+	static inline uint32_t _name##_space(const struct _name *ring) \
+	{ \
+		return (_size) - (ring->head - ring->tail); \
+	} \
+	\
+	static inline int _name##_put(struct _name *ring, _type value) \
+	{ \
+		uint32_t head = ring->head; \
+		\
+		if (head - ring->tail >= (_size)) { \
+			return 0; \
+		} \
+		ring->data[head & ((_size) - 1)] = value; \
+		__DMB(); \
+		ring->head = head + 1; \
+		return 1; \
+	} \
+	\
+	static inline int _name##_get(struct _name *ring, _type *value) \
+	{ \
+		uint32_t tail = ring->tail; \
+		\
+		if (ring->head == tail) { \
+			return 0; \
+		} \
+		__DMB(); \
+		*value = ring->data[tail & ((_size) - 1)]; \
+		__DMB(); \
+		ring->tail = tail + 1; \
+		return 1; \
+	} \
+	\
+	/* Copy up to len entries into the ring, returns the number copied */ \
+	static inline uint32_t _name##_put_buf(struct _name *ring, const _type *buf, uint32_t len) \
+	{ \
+		uint32_t head = ring->head, space = (_size) - (head - ring->tail), pos = head & ((_size) - 1), first; \
+		\
+		/* The consumer may free entries meanwhile: tail is read once, len must not grow */ \
+		if (len > space) { \
+			len = space; \
+		} \
+		first = len < (_size) - pos ? len : (_size) - pos; \
+		memcpy(&ring->data[pos], buf, first * sizeof(_type)); \
+		memcpy(&ring->data[0], buf + first, (len - first) * sizeof(_type)); \
+		__DMB(); \
+		ring->head = head + len; \
+		return len; \
+	} \
+	\
+	/* Copy up to len entries out of the ring, returns the number copied */ \
+	static inline uint32_t _name##_get_buf(struct _name *ring, _type *buf, uint32_t len) \
+	{ \
+		uint32_t tail = ring->tail, count = ring->head - tail, pos = tail & ((_size) - 1), first; \
+		\
+		/* The producer may add entries meanwhile: head is read once, len must not grow */ \
+		if (len > count) { \
+			len = count; \
+		} \
+		__DMB(); \
+		first = len < (_size) - pos ? len : (_size) - pos; \
+		memcpy(buf, &ring->data[pos], first * sizeof(_type)); \
+		memcpy(buf + first, &ring->data[0], (len - first) * sizeof(_type)); \
+		__DMB(); \
+		ring->tail = tail + len; \
+		return len; \
+	} \
+	\
+	/* Fill an entry in place: name_write_slot() returns NULL if full, name_write_done() publishes it */ \
+	static inline _type *_name##_write_slot(struct _name *ring) \
+	{ \
+		uint32_t head = ring->head; \
+		\
+		return head - ring->tail >= (_size) ? NULL : &ring->data[head & ((_size) - 1)]; \
+	} \
+	\
+	static inline void _name##_write_done(struct _name *ring) \
+	{ \
+		__DMB(); \
+		ring->head = ring->head + 1; \
+	} \
+	\
+	/* Use the oldest entry in place: name_read_slot() returns NULL if empty, name_read_done() frees it */ \
+	static inline _type *_name##_read_slot(struct _name *ring) \
+	{ \
+		uint32_t tail = ring->tail; \
+		\
+		if (ring->head == tail) { \
+			return NULL; \
+		} \
+		__DMB(); \
+		return &ring->data[tail & ((_size) - 1)]; \
+	} \
+	\
+	static inline void _name##_read_done(struct _name *ring) \
+	{ \
+		__DMB(); \
+		ring->tail = ring->tail + 1; \
 	}
-	
-	return cnt;
-}
 
-#endif /* __RING_BUFFER__ */
\ No newline at end of file
+#endif /* __RING_BUFFER__ */
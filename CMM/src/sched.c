@@ -0,0 +1,138 @@
+/*
+ * sched.c: cooperative main loop scheduler
+ *
+ * Created: 10/17/2026
+ *  Author: E1210640
+ */ 
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "config.h"
+#include "sys_timer.h"
+#include "sched.h"
+#include "profile.h"
+
+#ifndef BOOTLOADER
+
+/*
+ * Every sched_run() starts exactly one task:
+ * - the first periodic task (table order = priority) whose due time has passed, or
+ * - if none is due, the next background task (period 0) in round robin order.
+ * A periodic task therefore waits at most for the longest single run of another task,
+ * which is what its deadline is checked against. A periodic task that fell behind by
+ * more than a period skips the missed runs instead of running back to back.
+ * The only time source is get_jiffies() and no ASF is used, so the scheduler runs on a host
+ * with a simulated tick (see test/sched_test.c)
+ */
+static const struct sched_task *sched_tasks;
+static struct sched_stats *sched_stats;
+static uint8_t sched_count;
+static uint8_t sched_background;		/* Next background task to check */
+
+void sched_init(const struct sched_task *tasks, struct sched_stats *stats, uint8_t count)
+{
+	uint32_t now = get_jiffies();
+	uint8_t i;
+	
+	sched_tasks = tasks;
+	sched_stats = stats;
+	sched_count = count;
+	sched_background = 0;
+	for (i = 0; i < count; i++) {
+		stats[i].next_due = now + tasks[i].period;
+	}
+	sched_clear_stats();
+}
+
+static void sched_dispatch(uint8_t i, uint32_t late)
+{
+	const struct sched_task *task = &sched_tasks[i];
+	struct sched_stats *stats = &sched_stats[i];
+	uint32_t start, run;
+	
+	if (late > stats->max_late) {
+		stats->max_late = late < UINT16_MAX ? late : UINT16_MAX;
+	}
+	if (task->deadline && late > task->deadline) {
+		stats->misses++;
+	}
+#ifdef CFG_PROFILE
+	uint32_t cycles = sys_timer_cycles();
+#endif
+	start = get_jiffies();
+	task->run();
+	run = get_jiffies() - start;
+#ifdef CFG_PROFILE
+	profile_task_done(i, cycles);
+#endif
+	if (run > stats->max_run) {
+		stats->max_run = run < UINT16_MAX ? run : UINT16_MAX;
+	}
+	stats->runs++;
+}
+
+/*
+ * Start the next task (called by the main loop)
+ */
+void sched_run(void)
+{
+	uint32_t now = get_jiffies();
+	uint32_t late;
+	uint8_t i, n;
+	
+	for (i = 0; i < sched_count; i++) {
+		if (!sched_tasks[i].period || (int32_t)(now - sched_stats[i].next_due) < 0) {
+			continue;
+		}
+		late = now - sched_stats[i].next_due;
+		sched_stats[i].next_due += sched_tasks[i].period;
+		if ((int32_t)(now - sched_stats[i].next_due) >= 0) {
+			sched_stats[i].next_due = now + sched_tasks[i].period;
+		}
+		sched_dispatch(i, late);
+		return;
+	}
+	
+	for (n = 0; n < sched_count; n++) {
+		i = sched_background;
+		sched_background = (sched_background + 1) % sched_count;
+		if (!sched_tasks[i].period) {
+			sched_dispatch(i, 0);
+			return;
+		}
+	}
+}
+
+void sched_print_stats(void)
+{
+	uint8_t i;
+	
+	printf("%-18s %6s %8s %10s %8s %8s %7s\r\n", "task", "period", "deadline", "runs", "misses", "max_late", "max_run");
+	for (i = 0; i < sched_count; i++) {
+		printf("%-18s %6u %8u %10lu %8lu %8u %7u\r\n", sched_tasks[i].name, sched_tasks[i].period, sched_tasks[i].deadline,
+			(unsigned long)sched_stats[i].runs, (unsigned long)sched_stats[i].misses, sched_stats[i].max_late, sched_stats[i].max_run);
+	}
+}
+
+/*
+ * Name of task i, NULL if there is no such task
+ */
+const char *sched_task_name(uint8_t i)
+{
+	return i < sched_count ? sched_tasks[i].name : NULL;
+}
+
+void sched_clear_stats(void)
+{
+	uint8_t i;
+	
+	for (i = 0; i < sched_count; i++) {
+		sched_stats[i].runs = 0;
+		sched_stats[i].misses = 0;
+		sched_stats[i].max_late = 0;
+		sched_stats[i].max_run = 0;
+	}
+}
+
+#endif /* BOOTLOADER */
@@ -0,0 +1,38 @@
+/*
+ * sched.h
+ *
+ * Created: 10/17/2026
+ *  Author: E1210640
+ */ 
+
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+/*
+ * Main loop task, see CFG_TASKS
+ */
+struct sched_task {
+	const char *name;
+	void (*run)(void);
+	uint16_t period;		//ms between two runs, 0: background task
+	uint16_t deadline;		//ms a due task may wait for its start, 0: no deadline
+};
+
+/*
+ * Run time state and deadline accounting of a task
+ */
+struct sched_stats {
+	uint32_t next_due;		//jiffies of the next run (periodic tasks)
+	uint32_t runs;
+	uint32_t misses;		//starts later than the deadline
+	uint16_t max_late;		//ms between due time and start
+	uint16_t max_run;		//ms of the longest run
+};
+
+void sched_init(const struct sched_task *tasks, struct sched_stats *stats, uint8_t count);
+void sched_run(void);
+void sched_print_stats(void);
+void sched_clear_stats(void);
+const char *sched_task_name(uint8_t i);
+
+#endif /* __SCHED_H__ */
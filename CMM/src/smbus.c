@@ -18,6 +18,9 @@
 #include "sys_timer.h"
 #include "debug.h"
 #include "env.h"
+#include "log.h"
+#include "ring_buffer.h"
+#include "profile.h"
 
 
 #ifndef BOOTLOADER
@@ -25,32 +28,134 @@
 #define PEC_POLYNOMIAL				0x07
 
 static struct i2c_slave_module i2c_slave_instance;
-static uint8_t smbus_data_regs[256];	/* SMBus Registers*/
+static uint8_t smbus_data_banks[2][256];	/* SMBus Registers, published bank and bank of the next frame */
+static uint8_t *volatile smbus_data_regs = smbus_data_banks[0];	/* Published bank (served to the master) */
+static uint8_t *smbus_data_back = smbus_data_banks[1];	/* Next frame, equal to the published bank outside a frame */
+static uint8_t smbus_frame_first = 0xFF;	/* Registers staged in the next frame */
+static uint8_t smbus_frame_last;
+static uint16_t smbus_telemetry_seq;	/* Sequence number of the telemetry snapshot */
 static uint8_t i2c_tx_buf[256];		/* Transmit buffer */
 static uint8_t i2c_rx_buf[256];		/* Receive buffer */
 static uint8_t i2c_tx_len;			/* Data length for transmission */
-static uint8_t cmd_buf[256];		/* Command data buffer for deferred processing */
-static uint8_t cmd_len;				/* Current command+data length */
+/* Write commands for deferred processing (filled by the I2C interrupt, drained by the main loop) */
+struct smbus_cmd {
+	uint8_t buf[256];				/* Command+data */
+	uint8_t len;					/* Command+data length */
+	uint8_t pec;					/* PEC of the slave address, the command data is added by the main loop */
+};
+RING_DECLARE(smbus_cmd_ring, struct smbus_cmd, CFG_SMBUS_CMD_QUEUE_SIZE)
+static struct smbus_cmd_ring cmd_queue;	/* Filled by the interrupt, drained by the main loop */
+static uint8_t cmd_barriers;		/* Queued upgrade commands */
 static uint8_t smbus_status;		/* Device status */
 static uint8_t current_pec;			/* Current PEC value */
-static uint32_t activation_start;	/* Activation start time */
+static uint64_t activation_deadline = SYS_TIME_NEVER;	/* Scheduled firmware activation */
 
 
+/*
+ * The register banks are only written from the main loop; the I2C interrupt only reads the
+ * published bank. Single bytes are stored in both banks, multi-byte values are staged with
+ * smbus_frame_set_*() and published together by smbus_frame_commit()
+ */
 uint8_t smbus_get_input_reg(uint8_t nr)
 {
-	uint8_t ret;
-	system_interrupt_enter_critical_section();
-	ret = smbus_data_regs[nr];
-	system_interrupt_leave_critical_section();
-	
-	return ret;
+	return smbus_data_back[nr];
 }
 
 void smbus_set_input_reg(uint8_t nr, uint8_t val)
 {
-	system_interrupt_enter_critical_section();
+	smbus_data_back[nr] = val;
 	smbus_data_regs[nr] = val;
-	system_interrupt_leave_critical_section();
+}
+
+void smbus_frame_set_byte(uint8_t nr, uint8_t val)
+{
+	smbus_data_back[nr] = val;
+	if (nr < smbus_frame_first) {
+		smbus_frame_first = nr;
+	}
+	if (nr > smbus_frame_last) {
+		smbus_frame_last = nr;
+	}
+}
+
+void smbus_frame_set_word(uint8_t nr, uint16_t val)
+{
+	smbus_frame_set_byte(nr, val & 0xFF);
+	smbus_frame_set_byte(nr + 1, (val >> 8) & 0xFF);
+}
+
+/*
+ * Pack the live telemetry of the next frame into the snapshot block (little endian):
+ *  0 version, 1 sequence, 3 3V3/5V/5VAUX/12V/M12V [mV], 13 inlet/outlet1-4 temperature [C],
+ * 18 tacho 1-6 [rpm], 30 fan speed, 31 fan fail, 32 temp fail, 33 PS_ON bits, 34 PWR_OK,
+ * 35 max speed, 36 TB present, 37 clock module present
+ */
+static void smbus_telemetry_build(void)
+{
+	const uint8_t *regs = smbus_data_back;
+	uint8_t nr = SMBUS_REG__TELEMETRY;
+	uint8_t ps_on = 0;
+	int i;
+
+	smbus_telemetry_seq++;
+	smbus_frame_set_byte(nr++, SMBUS_TELEMETRY_VERSION);
+	smbus_frame_set_word(nr, smbus_telemetry_seq);
+	nr += 2;
+	smbus_frame_set_word(nr, regs[SMBUS_REG__3V3_LOW_BYTE] | (regs[SMBUS_REG__3V3_HIGH_BYTE] << 8));
+	nr += 2;
+	smbus_frame_set_word(nr, regs[SMBUS_REG__5V_LOW_BYTE] | (regs[SMBUS_REG__5V_HIGH_BYTE] << 8));
+	nr += 2;
+	smbus_frame_set_word(nr, regs[SMBUS_REG__5VAUX_LOW_BYTE] | (regs[SMBUS_REG__5VAUX_HIGH_BYTE] << 8));
+	nr += 2;
+	smbus_frame_set_word(nr, regs[SMBUS_REG__12V_LOW_BYTE] | (regs[SMBUS_REG__12V_HIGH_BYTE] << 8));
+	nr += 2;
+	smbus_frame_set_word(nr, regs[SMBUS_REG__M12V_LOW_BYTE] | (regs[SMBUS_REG__M12V_HIGH_BYTE] << 8));
+	nr += 2;
+	for (i = SMBUS_REG__TEMP_AIR_INLET; i <= SMBUS_REG__TEMP_AIR_OUTLET4; i++) {
+		smbus_frame_set_byte(nr++, regs[i]);
+	}
+	for (i = SMBUS_REG__FAN_TACHO_1_LOW_BYTE; i <= SMBUS_REG__FAN_TACHO_6_HIGH_BYTE; i++) {
+		smbus_frame_set_byte(nr++, regs[i]);
+	}
+	smbus_frame_set_byte(nr++, regs[SMBUS_REG__FAN_SPEED]);
+	smbus_frame_set_byte(nr++, regs[SMBUS_REG__FAN_FAIL]);
+	smbus_frame_set_byte(nr++, regs[SMBUS_REG__TEMP_FAIL]);
+	for (i = SMBUS_REG__SEL_SS_PS_ON; i <= SMBUS_REG__AC_OK; i++) {
+		ps_on |= (regs[i] & 1) << (i - SMBUS_REG__SEL_SS_PS_ON);
+	}
+	smbus_frame_set_byte(nr++, ps_on);
+	smbus_frame_set_byte(nr++, regs[SMBUS_REG__PWR_OK]);
+	smbus_frame_set_byte(nr++, regs[SMBUS_REG__MAX_SPEED]);
+	smbus_frame_set_byte(nr++, regs[SMBUS_REG__TBPRES]);
+	smbus_frame_set_byte(nr++, regs[SMBUS_REG__CLOCKMODUL_PRESENT]);
+}
+
+/*
+ * Publish the staged frame with a single pointer store, then bring the new back bank up to date.
+ * The telemetry snapshot is left as it is (see smbus_telemetry_commit())
+ */
+void smbus_frame_commit(void)
+{
+	uint8_t *front = smbus_data_regs;
+
+	if (smbus_frame_first > smbus_frame_last) {
+		return;
+	}
+	smbus_data_regs = smbus_data_back;
+	smbus_data_back = front;
+	memcpy(&smbus_data_back[smbus_frame_first], &smbus_data_regs[smbus_frame_first], smbus_frame_last - smbus_frame_first + 1);
+	smbus_frame_first = 0xFF;
+	smbus_frame_last = 0;
+}
+
+/*
+ * Publish a new sample: the staged frame together with a telemetry snapshot of the next sequence number.
+ * Only for measurement updates, so that the sequence number counts samples
+ */
+void smbus_telemetry_commit(void)
+{
+	smbus_telemetry_build();
+	smbus_frame_commit();
 }
 
 static void smbus_set_status_bit(uint8_t new_status)
@@ -83,11 +188,11 @@ static uint8_t smbus_pec_adjust(uint8_t *buf, int len, int finish)
 	return current_pec;
 }
 
-/* Verify the PEC byte for a write command */
-static int smbus_pec_verify(int len, int expected_len)
+/* Verify the PEC byte for a write command (pec includes the PEC byte itself, so it is 0 if valid) */
+static int smbus_pec_verify(uint8_t pec, int len, int expected_len)
 {
-	if (len == expected_len + 1 && current_pec) {
-		printf("SMBUS UPGRADE: PEC mismatch\r\n");
+	if (len == expected_len + 1 && pec) {
+		log_printf("SMBUS UPGRADE: PEC mismatch\r\n");
 		smbus_set_status_bit(SMBUS_STATUS_PEC_ERROR);
 		return -1;
 	} else {
@@ -96,558 +201,271 @@ static int smbus_pec_verify(int len, int expected_len)
 	return 0;
 }
 
+/* Upgrade command handlers (called from the main loop once the command has been validated) */
+static void smbus_upgrade_start(uint8_t *data, int len)
+{
+	log_printf("SMBUS UPGRADE: START command received, erasing Flash...\r\n");
+	if (upgrade_start()) {
+		log_printf("SMBUS UPGRADE: Flash erase failed\r\n");
+		smbus_set_status_bit(SMBUS_STATUS_UPGRADE_ERROR);
+	} else {
+		log_printf("SMBUS UPGRADE: Flash erase successful\r\n");
+		smbus_clear_status_bit(SMBUS_STATUS_UPGRADE_ERROR);
+	}
+}
+
+static void smbus_upgrade_send_data(uint8_t *data, int len)
+{
+	if (upgrade_parse_ihex(data) >= 0) {
+		smbus_clear_status_bit(SMBUS_STATUS_UPGRADE_ERROR);
+	} else {
+		smbus_set_status_bit(SMBUS_STATUS_UPGRADE_ERROR);
+	}
+}
+
+static void smbus_upgrade_activate(uint8_t *data, int len)
+{
+	log_printf("SMBUS UPGRADE: ACTIVATE command received, verifying firmware...\r\n");
+	if (!upgrade_verify()) {
+		log_printf("SMBUS UPGRADE: verified OK, scheduling activation...\r\n");
+		smbus_clear_status_bit(SMBUS_STATUS_UPGRADE_ERROR);
+		activation_deadline = sys_deadline(SYS_TIME_MS(3000));
+	} else {
+		log_printf("SMBUS UPGRADE: verification failed\r\n");
+		smbus_set_status_bit(SMBUS_STATUS_UPGRADE_ERROR);
+	}
+}
+
+#ifdef CFG_PROFILE
+static void smbus_profile_select(uint8_t *data, int len)
+{
+	profile_sync_to_smbus(data[0]);
+}
+
+#define SMBUS_PROFILE_REGISTERS \
+	SMBUS_REG(SMBUS_REG__PROFILE_SELECT,				SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_RW,	ENV_NONE,		smbus_profile_select,	0) \
+	SMBUS_REG(SMBUS_REG__PROFILE,						SMBUS_PROTO_BLOCK,	SMBUS_PROFILE_LEN,	SMBUS_ACCESS_R,	ENV_NONE,	NULL,	0)
+#else
+#define SMBUS_PROFILE_REGISTERS
+#endif
+
+/* SMBus protocols */
+#define SMBUS_PROTO_SEND	0	/* Send byte (command code only) */
+#define SMBUS_PROTO_BYTE	1	/* Read/write byte */
+#define SMBUS_PROTO_WORD	2	/* Read/write word (low byte first) */
+#define SMBUS_PROTO_BLOCK	3	/* Block read/write (byte count first) */
+
+/* Register access flags */
+#define SMBUS_ACCESS_R		(1 << 0)
+#define SMBUS_ACCESS_W		(1 << 1)
+#define SMBUS_ACCESS_RW		(SMBUS_ACCESS_R | SMBUS_ACCESS_W)
+
+/*
+ * SMBus register map:
+ *
+ * SMBUS_REG(command, protocol, length, access, env_index, write_hook, error_status)
+ *
+ * Byte/word registers are backed by smbus_data_regs[command...command+length-1] (published bank);
+ * writes are stored there (and in the environment, unless env_index is ENV_NONE)
+ * before the write hook is called. Send byte and block write commands are
+ * passed to the write hook only. error_status is set if a write is rejected
+ * due to a bad length or PEC.
+ */
+#define SMBUS_REGISTERS \
+	SMBUS_REG(SMBUS_REG__5VAUX_LOW_BYTE,				SMBUS_PROTO_WORD,	2,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__3V3_LOW_BYTE,					SMBUS_PROTO_WORD,	2,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__5V_LOW_BYTE,					SMBUS_PROTO_WORD,	2,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__12V_LOW_BYTE,					SMBUS_PROTO_WORD,	2,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__M12V_LOW_BYTE,					SMBUS_PROTO_WORD,	2,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__SEL_SS_PS_ON,					SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__SS_PS_ON_IN,					SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__EXT_PS_ON_IN,					SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__PS_ON_OUT_1,					SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__PS_ON_OUT_2,					SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__PS_ON_OUT_3,					SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__PS_ON_OUT_4,					SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__AC_OK,							SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__PWR_OK,						SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__REMOTE,						SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_RW,	ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__SET_FAN,						SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_RW,	ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__FAN_CURVE,						SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_RW,	ENV_fan_curve,	NULL,	0) \
+	SMBUS_REG(SMBUS_REG__FAN_TACHO_1_LOW_BYTE,			SMBUS_PROTO_WORD,	2,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__FAN_TACHO_2_LOW_BYTE,			SMBUS_PROTO_WORD,	2,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__FAN_TACHO_3_LOW_BYTE,			SMBUS_PROTO_WORD,	2,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__FAN_TACHO_4_LOW_BYTE,			SMBUS_PROTO_WORD,	2,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__FAN_TACHO_5_LOW_BYTE,			SMBUS_PROTO_WORD,	2,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__FAN_TACHO_6_LOW_BYTE,			SMBUS_PROTO_WORD,	2,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__FAN_UNIT_READY,				SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__FAN_FAIL,						SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__FAN_SPEED,						SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__TEMP_AIR_INLET,				SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__TEMP_AIR_OUTLET1,				SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__TEMP_AIR_OUTLET2,				SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__TEMP_AIR_OUTLET3,				SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__TEMP_AIR_OUTLET4,				SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__TEMP_FAIL,						SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__TBPRES,						SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__TB1_EN,						SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_RW,	ENV_tb1en,	NULL,	0) \
+	SMBUS_REG(SMBUS_REG__TB1_DIR,						SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_RW,	ENV_tb1dir,	NULL,	0) \
+	SMBUS_REG(SMBUS_REG__TB2_EN,						SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_RW,	ENV_tb2en,	NULL,	0) \
+	SMBUS_REG(SMBUS_REG__TB2_DIR,						SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_RW,	ENV_tb2dir,	NULL,	0) \
+	SMBUS_REG(SMBUS_REG__TB3_EN,						SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_RW,	ENV_tb3en,	NULL,	0) \
+	SMBUS_REG(SMBUS_REG__TB3_DIR,						SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_RW,	ENV_tb3dir,	NULL,	0) \
+	SMBUS_REG(SMBUS_REG__TB4_EN,						SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_RW,	ENV_tb4en,	NULL,	0) \
+	SMBUS_REG(SMBUS_REG__TB4_DIR,						SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_RW,	ENV_tb4dir,	NULL,	0) \
+	SMBUS_REG(SMBUS_REG__ADD_LOW_BYTE,					SMBUS_PROTO_WORD,	2,	SMBUS_ACCESS_RW,	ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__DATA,							SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_RW,	ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__WRITE_DATA,					SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_RW,	ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__CLOCKMODUL_PRESENT,			SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__SYNC100_DIV,					SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_RW,	ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__CLOCK_MODULE_FW_BYTE_1,		SMBUS_PROTO_BLOCK,	10,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__CONFIG,						SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__MAX_SPEED,						SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__FAN_CONTROL,					SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_RW,	ENV_fan_control,	NULL,	0) \
+	SMBUS_REG(SMBUS_REG__FAN_PID_KP,					SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_RW,	ENV_fan_pid_kp,	NULL,	0) \
+	SMBUS_REG(SMBUS_REG__FAN_PID_KI,					SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_RW,	ENV_fan_pid_ki,	NULL,	0) \
+	SMBUS_REG(SMBUS_REG__FAN_PID_KD,					SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_RW,	ENV_fan_pid_kd,	NULL,	0) \
+	SMBUS_REG(SMBUS_REG__CMM_FW_BYTE_1,					SMBUS_PROTO_BLOCK,	10,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__CMM_VERSION,					SMBUS_PROTO_BYTE,	1,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__CMM_PDB_POWER_3V3_LOW_BYTE,	SMBUS_PROTO_WORD,	2,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__CMM_PDB_MAX_POWER_3V3_LOW_BYTE,	SMBUS_PROTO_WORD,	2,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__CMM_PDB_POWER_5V_LOW_BYTE,		SMBUS_PROTO_WORD,	2,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__CMM_PDB_MAX_POWER_5V_LOW_BYTE,	SMBUS_PROTO_WORD,	2,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__CMM_PDB_POWER_12V_LOW_BYTE,	SMBUS_PROTO_WORD,	2,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__CMM_PDB_MAX_POWER_12V_LOW_BYTE,	SMBUS_PROTO_WORD,	2,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__CMM_PDB_MAX_POWER_TOTAL_LOW_BYTE,	SMBUS_PROTO_WORD,	2,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__CMM_PDB_PRODUCT_NUM_Byte_1,	SMBUS_PROTO_BLOCK,	8,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__CMM_PDB_SERIAL_NUM_Byte_1,		SMBUS_PROTO_BLOCK,	12,	SMBUS_ACCESS_R,		ENV_NONE,		NULL,	0) \
+	SMBUS_REG(SMBUS_REG__TELEMETRY,						SMBUS_PROTO_BLOCK,	SMBUS_TELEMETRY_LEN,	SMBUS_ACCESS_R,	ENV_NONE,	NULL,	0) \
+	SMBUS_PROFILE_REGISTERS \
+	SMBUS_REG(SMBUS_CMD_UPGRADE_START,					SMBUS_PROTO_SEND,	0,	SMBUS_ACCESS_W,		ENV_NONE,		smbus_upgrade_start,		0) \
+	SMBUS_REG(SMBUS_CMD_UPGRADE_SEND_DATA,				SMBUS_PROTO_BLOCK,	255,	SMBUS_ACCESS_W,		ENV_NONE,		smbus_upgrade_send_data,	SMBUS_STATUS_UPGRADE_ERROR) \
+	SMBUS_REG(SMBUS_CMD_UPGRADE_ACTIVATE,				SMBUS_PROTO_SEND,	0,	SMBUS_ACCESS_W,		ENV_NONE,		smbus_upgrade_activate,		0)
+
+struct smbus_reg_desc {
+	uint8_t reg;
+	uint8_t proto;
+	uint8_t len;
+	uint8_t access;
+	uint8_t err_status;
+	int8_t env;
+	void (*write)(uint8_t *data, int len);
+};
+
+/* Register indices in smbus_reg_map[] */
+#define SMBUS_REG(_reg, _proto, _len, _access, _env, _write, _err) \
+	SMBUS_REG_IDX_##_reg,
+
+enum { SMBUS_REGISTERS SMBUS_REG_COUNT };
+
+#undef SMBUS_REG
+#define SMBUS_REG(_reg, _proto, _len, _access, _env, _write, _err) \
+	{ _reg, _proto, _len, _access, _err, _env, _write },
+
+static const struct smbus_reg_desc smbus_reg_map[] = { SMBUS_REGISTERS };
+
+/* Command code -> smbus_reg_map[] index + 1 (0 = unsupported command) */
+#undef SMBUS_REG
+#define SMBUS_REG(_reg, _proto, _len, _access, _env, _write, _err) \
+	[_reg] = SMBUS_REG_IDX_##_reg + 1,
+
+static const uint8_t smbus_reg_lookup[256] = { SMBUS_REGISTERS };
+
+#undef SMBUS_REG
+
+static inline const struct smbus_reg_desc *smbus_find_reg(uint8_t cmd)
+{
+	uint8_t idx = smbus_reg_lookup[cmd];
+	
+	return idx ? &smbus_reg_map[idx - 1] : NULL;
+}
+
 /* SMBus command processing functions */
 static void smbus_process_read(uint8_t cmd)
 {
+	const struct smbus_reg_desc *desc;
+	const uint8_t *regs = smbus_data_regs;
 	
-	switch(cmd) {
-		case SMBUS_CMD_GET_STATUS:
-			i2c_tx_buf[0] = smbus_status;
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__5VAUX_LOW_BYTE:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__5VAUX_LOW_BYTE];
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__5VAUX_HIGH_BYTE];
-			i2c_tx_len = 2;
-			break;
-			
-		case SMBUS_REG__3V3_LOW_BYTE:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__3V3_LOW_BYTE];
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__3V3_HIGH_BYTE];
-			i2c_tx_len = 2;
-			break;
-			
-		case SMBUS_REG__5V_LOW_BYTE:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__5V_LOW_BYTE];
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__5V_HIGH_BYTE];
-			i2c_tx_len = 2;
-			break;
-			
-		case SMBUS_REG__12V_LOW_BYTE:
-			
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__12V_LOW_BYTE];
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__12V_HIGH_BYTE];
-			i2c_tx_len = 2;
-			break;
-			
-		case SMBUS_REG__M12V_LOW_BYTE:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__M12V_LOW_BYTE];
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__M12V_HIGH_BYTE];
-			i2c_tx_len = 2;
-			break;
-			
-		case SMBUS_REG__SEL_SS_PS_ON:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__SEL_SS_PS_ON];
-			i2c_tx_len = 1;
-			break;
-			
-		case SMBUS_REG__SS_PS_ON_IN:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__SS_PS_ON_IN];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__EXT_PS_ON_IN:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__EXT_PS_ON_IN];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__PS_ON_OUT_1:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__PS_ON_OUT_1];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__PS_ON_OUT_2:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__PS_ON_OUT_2];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__PS_ON_OUT_3:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__PS_ON_OUT_3];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__PS_ON_OUT_4:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__PS_ON_OUT_4];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__AC_OK:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__AC_OK];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__PWR_OK:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__PWR_OK];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__REMOTE:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__REMOTE];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__SET_FAN:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__SET_FAN];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__FAN_CURVE:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__FAN_CURVE];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__FAN_TACHO_1_LOW_BYTE:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__FAN_TACHO_1_LOW_BYTE];
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__FAN_TACHO_1_HIGH_BYTE];
-			i2c_tx_len = 2;
-			break;
-		
-		case SMBUS_REG__FAN_TACHO_2_LOW_BYTE:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__FAN_TACHO_2_LOW_BYTE];
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__FAN_TACHO_2_HIGH_BYTE];
-			i2c_tx_len = 2;
-			break;
-		
-		case SMBUS_REG__FAN_TACHO_3_LOW_BYTE:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__FAN_TACHO_3_LOW_BYTE];
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__FAN_TACHO_3_HIGH_BYTE];
-			i2c_tx_len = 2;
-			break;
-		
-		case SMBUS_REG__FAN_TACHO_4_LOW_BYTE:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__FAN_TACHO_4_LOW_BYTE];
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__FAN_TACHO_4_HIGH_BYTE];
-			i2c_tx_len = 2;
-			break;
-		
-		case SMBUS_REG__FAN_TACHO_5_LOW_BYTE:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__FAN_TACHO_5_LOW_BYTE];
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__FAN_TACHO_5_HIGH_BYTE];
-			i2c_tx_len = 2;
-			break;
-		
-		case SMBUS_REG__FAN_TACHO_6_LOW_BYTE:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__FAN_TACHO_6_LOW_BYTE];
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__FAN_TACHO_6_HIGH_BYTE];
-			i2c_tx_len = 2;
-			break;
-		
-		case SMBUS_REG__FAN_UNIT_READY:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__FAN_UNIT_READY];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__FAN_FAIL:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__FAN_FAIL];
-			i2c_tx_len = 1;
-			break;
-			
-		case SMBUS_REG__FAN_SPEED:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__FAN_SPEED];
-			i2c_tx_len = 1;
-			break;
-			
-		case SMBUS_REG__TEMP_AIR_INLET:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__TEMP_AIR_INLET];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__TEMP_AIR_OUTLET1:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__TEMP_AIR_OUTLET1];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__TEMP_AIR_OUTLET2:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__TEMP_AIR_OUTLET2];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__TEMP_AIR_OUTLET3:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__TEMP_AIR_OUTLET3];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__TEMP_AIR_OUTLET4:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__TEMP_AIR_OUTLET4];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__TEMP_FAIL:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__TEMP_FAIL];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__TBPRES:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__TBPRES];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__TB1_EN:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__TB1_EN];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__TB1_DIR:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__TB1_DIR];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__TB2_EN:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__TB2_EN];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__TB2_DIR:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__TB2_DIR];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__TB3_EN:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__TB3_EN];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__TB3_DIR:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__TB3_DIR];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__TB4_EN:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__TB4_EN];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__TB4_DIR:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__TB4_DIR];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__ADD_LOW_BYTE:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__ADD_LOW_BYTE];
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__ADD_HIGH_BYTE];
-			i2c_tx_len = 2;
-			break;
-		
-		case SMBUS_REG__DATA:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__DATA];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__WRITE_DATA:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__WRITE_DATA];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__CLOCKMODUL_PRESENT:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__CLOCKMODUL_PRESENT];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__SYNC100_DIV:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__SYNC100_DIV];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__CLOCK_MODULE_FW_BYTE_1:
-			i2c_tx_buf[0] = 10;
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__CLOCK_MODULE_FW_BYTE_1];
-			i2c_tx_buf[2] = smbus_data_regs[SMBUS_REG__CLOCK_MODULE_FW_BYTE_2];
-			i2c_tx_buf[3] = smbus_data_regs[SMBUS_REG__CLOCK_MODULE_FW_BYTE_3];
-			i2c_tx_buf[4] = smbus_data_regs[SMBUS_REG__CLOCK_MODULE_FW_BYTE_4];
-			i2c_tx_buf[5] = smbus_data_regs[SMBUS_REG__CLOCK_MODULE_FW_BYTE_5];
-			i2c_tx_buf[6] = smbus_data_regs[SMBUS_REG__CLOCK_MODULE_FW_BYTE_6];
-			i2c_tx_buf[7] = smbus_data_regs[SMBUS_REG__CLOCK_MODULE_FW_BYTE_7];
-			i2c_tx_buf[8] = smbus_data_regs[SMBUS_REG__CLOCK_MODULE_FW_BYTE_8];
-			i2c_tx_buf[9] = smbus_data_regs[SMBUS_REG__CLOCK_MODULE_FW_BYTE_9];
-			i2c_tx_buf[10] = smbus_data_regs[SMBUS_REG__CLOCK_MODULE_FW_BYTE_10];
-			i2c_tx_len = 11;
-			break;
-		
-		case SMBUS_REG__CONFIG:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__CONFIG];
-			i2c_tx_len = 1;
-			break;
-		
-		case SMBUS_REG__MAX_SPEED:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__MAX_SPEED];
-			i2c_tx_len = 1;
-			break;
-			
-		case SMBUS_REG__CMM_FW_BYTE_1:
-			i2c_tx_buf[0] = 10;
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__CMM_FW_BYTE_1];
-			i2c_tx_buf[2] = smbus_data_regs[SMBUS_REG__CMM_FW_BYTE_2];
-			i2c_tx_buf[3] = smbus_data_regs[SMBUS_REG__CMM_FW_BYTE_3];
-			i2c_tx_buf[4] = smbus_data_regs[SMBUS_REG__CMM_FW_BYTE_4];
-			i2c_tx_buf[5] = smbus_data_regs[SMBUS_REG__CMM_FW_BYTE_5];
-			i2c_tx_buf[6] = smbus_data_regs[SMBUS_REG__CMM_FW_BYTE_6];
-			i2c_tx_buf[7] = smbus_data_regs[SMBUS_REG__CMM_FW_BYTE_7];
-			i2c_tx_buf[8] = smbus_data_regs[SMBUS_REG__CMM_FW_BYTE_8];
-			i2c_tx_buf[9] = smbus_data_regs[SMBUS_REG__CMM_FW_BYTE_9];
-			i2c_tx_buf[10] = smbus_data_regs[SMBUS_REG__CMM_FW_BYTE_10];	
-			i2c_tx_len = 11;
-			break;
-			
-		case SMBUS_REG__CMM_VERSION:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__CMM_VERSION];
-			i2c_tx_len = 1;
-			break;
-			
-		case SMBUS_REG__CMM_PDB_POWER_3V3_LOW_BYTE:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__CMM_PDB_POWER_3V3_LOW_BYTE];
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__CMM_PDB_POWER_3V3_HIGH_BYTE];
-			i2c_tx_len = 2;
-			break;
-			
-		case SMBUS_REG__CMM_PDB_MAX_POWER_3V3_LOW_BYTE:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__CMM_PDB_MAX_POWER_3V3_LOW_BYTE];
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__CMM_PDB_MAX_POWER_3V3_HIGH_BYTE];
-			i2c_tx_len = 2;
-			break;
-			
-		case SMBUS_REG__CMM_PDB_POWER_5V_LOW_BYTE:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__CMM_PDB_POWER_5V_LOW_BYTE];
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__CMM_PDB_POWER_5V_HIGH_BYTE];
-			i2c_tx_len = 2;
-			break;
-			
-		case SMBUS_REG__CMM_PDB_MAX_POWER_5V_LOW_BYTE:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__CMM_PDB_MAX_POWER_5V_LOW_BYTE];
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__CMM_PDB_MAX_POWER_5V_HIGH_BYTE];
-			i2c_tx_len = 2;
-			break;
-			
-		case SMBUS_REG__CMM_PDB_POWER_12V_LOW_BYTE:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__CMM_PDB_POWER_12V_LOW_BYTE];
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__CMM_PDB_POWER_12V_HIGH_BYTE];
-			i2c_tx_len = 2;
-			break;
-		
-		case SMBUS_REG__CMM_PDB_MAX_POWER_12V_LOW_BYTE:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__CMM_PDB_MAX_POWER_12V_LOW_BYTE];
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__CMM_PDB_MAX_POWER_12V_HIGH_BYTE];
-			i2c_tx_len = 2;
-			break;
-		
-		case SMBUS_REG__CMM_PDB_MAX_POWER_TOTAL_LOW_BYTE:
-			i2c_tx_buf[0] = smbus_data_regs[SMBUS_REG__CMM_PDB_MAX_POWER_TOTAL_LOW_BYTE];
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__CMM_PDB_MAX_POWER_TOTAL_HIGH_BYTE];
-			i2c_tx_len = 2;
-			break;
-		
-		case SMBUS_REG__CMM_PDB_PRODUCT_NUM_Byte_1:	
-			i2c_tx_buf[0] = 8;
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__CMM_PDB_PRODUCT_NUM_Byte_1];
-			i2c_tx_buf[2] = smbus_data_regs[SMBUS_REG__CMM_PDB_PRODUCT_NUM_Byte_2];
-			i2c_tx_buf[3] = smbus_data_regs[SMBUS_REG__CMM_PDB_PRODUCT_NUM_Byte_3];
-			i2c_tx_buf[4] = smbus_data_regs[SMBUS_REG__CMM_PDB_PRODUCT_NUM_Byte_4];
-			i2c_tx_buf[5] = smbus_data_regs[SMBUS_REG__CMM_PDB_PRODUCT_NUM_Byte_5];
-			i2c_tx_buf[6] = smbus_data_regs[SMBUS_REG__CMM_PDB_PRODUCT_NUM_Byte_6];
-			i2c_tx_buf[7] = smbus_data_regs[SMBUS_REG__CMM_PDB_PRODUCT_NUM_Byte_7];
-			i2c_tx_buf[8] = smbus_data_regs[SMBUS_REG__CMM_PDB_PRODUCT_NUM_Byte_8];
-			i2c_tx_len = 9;
-		break;
-		
-		case SMBUS_REG__CMM_PDB_SERIAL_NUM_Byte_1:		
-			i2c_tx_buf[0] = 12;
-			i2c_tx_buf[1] = smbus_data_regs[SMBUS_REG__CMM_PDB_SERIAL_NUM_Byte_1];
-			i2c_tx_buf[2] = smbus_data_regs[SMBUS_REG__CMM_PDB_SERIAL_NUM_Byte_2];
-			i2c_tx_buf[3] = smbus_data_regs[SMBUS_REG__CMM_PDB_SERIAL_NUM_Byte_3];
-			i2c_tx_buf[4] = smbus_data_regs[SMBUS_REG__CMM_PDB_SERIAL_NUM_Byte_4];
-			i2c_tx_buf[5] = smbus_data_regs[SMBUS_REG__CMM_PDB_SERIAL_NUM_Byte_5];
-			i2c_tx_buf[6] = smbus_data_regs[SMBUS_REG__CMM_PDB_SERIAL_NUM_Byte_6];
-			i2c_tx_buf[7] = smbus_data_regs[SMBUS_REG__CMM_PDB_SERIAL_NUM_Byte_7];
-			i2c_tx_buf[8] = smbus_data_regs[SMBUS_REG__CMM_PDB_SERIAL_NUM_Byte_8];
-			i2c_tx_buf[9] = smbus_data_regs[SMBUS_REG__CMM_PDB_SERIAL_NUM_Byte_9];
-			i2c_tx_buf[10] = smbus_data_regs[SMBUS_REG__CMM_PDB_SERIAL_NUM_Byte_10];
-			i2c_tx_buf[11] = smbus_data_regs[SMBUS_REG__CMM_PDB_SERIAL_NUM_Byte_11];
-			i2c_tx_buf[12] = smbus_data_regs[SMBUS_REG__CMM_PDB_SERIAL_NUM_Byte_12];
-			i2c_tx_len = 13;
-		break;
-				
-		/* TBD: add code for processing other read commands, if needed */
-		default:
-			i2c_tx_len = 0;		/* NACK this read */
-			break;
+	if (cmd == SMBUS_CMD_GET_STATUS) {
+		i2c_tx_buf[0] = smbus_status;
+		i2c_tx_len = 1;
+		return;
+	}
+	desc = smbus_find_reg(cmd);
+	if (!desc || !(desc->access & SMBUS_ACCESS_R)) {
+		i2c_tx_len = 0;		/* NACK this read */
+		return;
+	}
+	if (desc->proto == SMBUS_PROTO_BLOCK) {
+		i2c_tx_buf[0] = desc->len;
+		memcpy(i2c_tx_buf + 1, &regs[desc->reg], desc->len);
+		i2c_tx_len = desc->len + 1;
+	} else {
+		memcpy(i2c_tx_buf, &regs[desc->reg], desc->len);
+		i2c_tx_len = desc->len;
 	}
 }
 
-static void smbus_process_write(uint8_t *buf, int len)
+static void smbus_process_write(uint8_t *buf, int len, uint8_t pec)
 {
-	int cnt;
+	const struct smbus_reg_desc *desc = smbus_find_reg(buf[0]);
+	uint8_t *data = buf + 1;
+	int cnt, expected_len;
 
-	switch (buf[0]) {
-		case SMBUS_CMD_UPGRADE_START:
-			if (smbus_pec_verify(len, 1) < 0) {
-				break;
-			}
-			printf("SMBUS UPGRADE: START command received, erasing Flash...\r\n");
-			if (upgrade_start()) {
-				printf("SMBUS UPGRADE: Flash erase failed\r\n");
-				smbus_set_status_bit(SMBUS_STATUS_UPGRADE_ERROR);
-			} else {
-				printf("SMBUS UPGRADE: Flash erase successful\r\n");
-				smbus_clear_status_bit(SMBUS_STATUS_UPGRADE_ERROR);
-			}
-			break;
-		case SMBUS_CMD_UPGRADE_SEND_DATA:
+	if (!desc || !(desc->access & SMBUS_ACCESS_W)) {
+		return;
+	}
+	switch (desc->proto) {
+		case SMBUS_PROTO_BLOCK:
 			cnt = buf[1];
-			smbus_set_status_bit(SMBUS_STATUS_UPGRADE_ERROR);
-			if (len < 2 || (len != cnt + 2 && len != cnt + 3)) {
-				printf("SMBUS UPGRADE: invalid Send Data command length\r\n");
-				smbus_set_status_bit(SMBUS_STATUS_UPGRADE_ERROR);
-				break;
-			}
-			if (smbus_pec_verify(len, cnt + 2) < 0) {
-				break;
-			}
-			if (upgrade_parse_ihex(buf + 2) >= 0) {
-				smbus_clear_status_bit(SMBUS_STATUS_UPGRADE_ERROR);
-			} else {
-				smbus_set_status_bit(SMBUS_STATUS_UPGRADE_ERROR);
-			}
-			break;
-		case SMBUS_CMD_UPGRADE_ACTIVATE:
-			if (smbus_pec_verify(len, 1) < 0) {
-				break;
-			}
-			printf("SMBUS UPGRADE: ACTIVATE command received, verifying firmware...\r\n");
-			if (!upgrade_verify()) {
-				printf("SMBUS UPGRADE: verified OK, scheduling activation...\r\n");
-				smbus_clear_status_bit(SMBUS_STATUS_UPGRADE_ERROR);
-				activation_start = get_jiffies();
-			} else {
-				printf("SMBUS UPGRADE: verification failed\r\n");
-				smbus_set_status_bit(SMBUS_STATUS_UPGRADE_ERROR);
-			}
-			break;
-			
-		case SMBUS_REG__REMOTE:
-			if (smbus_pec_verify(len, 2) < 0) {
-				break;
-			}
-			smbus_data_regs[SMBUS_REG__REMOTE] = buf[1];
-			break;
-			
-		case SMBUS_REG__SET_FAN:
-			if (smbus_pec_verify(len, 2) < 0) {
-				break;
-			}
-			smbus_data_regs[SMBUS_REG__SET_FAN] = buf[1];
-			break;
-			
-		case SMBUS_REG__FAN_CURVE:
-			if (smbus_pec_verify(len, 2) < 0) {
-				break;
-			}
-			smbus_data_regs[SMBUS_REG__FAN_CURVE] = buf[1];
-			env_set("fan_curve", smbus_data_regs[SMBUS_REG__FAN_CURVE]);
-			break;
-					
-		case SMBUS_REG__TB1_EN:
-			if (smbus_pec_verify(len, 2) < 0) {
-				break;
-			}
-			smbus_data_regs[SMBUS_REG__TB1_EN] = buf[1];
-			env_set("tb1en", smbus_data_regs[SMBUS_REG__TB1_EN]);
-			break;
-		
-		case SMBUS_REG__TB1_DIR:
-			if (smbus_pec_verify(len, 2) < 0) {
-				break;
-			}
-			smbus_data_regs[SMBUS_REG__TB1_DIR] = buf[1];
-			env_set("tb1dir", smbus_data_regs[SMBUS_REG__TB1_DIR]);
-			break;
-			
-		case SMBUS_REG__TB2_EN:
-			if (smbus_pec_verify(len, 2) < 0) {
-				break;
+			data = buf + 2;
+			expected_len = cnt + 2;
+			if (len < 2 || cnt > desc->len || (len != expected_len && len != expected_len + 1)) {
+				log_printf("SMBUS: invalid block write length (command 0x%02x)\r\n", desc->reg);
+				smbus_set_status_bit(desc->err_status);
+				return;
 			}
-			smbus_data_regs[SMBUS_REG__TB2_EN] = buf[1];
-			env_set("tb2en", smbus_data_regs[SMBUS_REG__TB2_EN]);
 			break;
-			
-		case SMBUS_REG__TB2_DIR:
-			if (smbus_pec_verify(len, 2) < 0) {
-				break;
-			}
-			smbus_data_regs[SMBUS_REG__TB2_DIR] = buf[1];
-			env_set("tb2dir", smbus_data_regs[SMBUS_REG__TB2_DIR]);
-		break;
-		
-		case SMBUS_REG__TB3_EN:
-			if (smbus_pec_verify(len, 2) < 0) {
-				break;
-			}
-			smbus_data_regs[SMBUS_REG__TB3_EN] = buf[1];
-			env_set("tb3en", smbus_data_regs[SMBUS_REG__TB3_EN]);
-			break;
-		
-		case SMBUS_REG__TB3_DIR:
-			if (smbus_pec_verify(len, 2) < 0) {
-				break;
-			}
-			smbus_data_regs[SMBUS_REG__TB3_DIR] = buf[1];
-			env_set("tb3dir", smbus_data_regs[SMBUS_REG__TB3_DIR]);
-			break;
-		
-		case SMBUS_REG__TB4_EN:
-			if (smbus_pec_verify(len, 2) < 0) {
-				break;
-			}
-			smbus_data_regs[SMBUS_REG__TB4_EN] = buf[1];
-			env_set("tb4en", smbus_data_regs[SMBUS_REG__TB4_EN]);
-			break;
-		
-		case SMBUS_REG__TB4_DIR:
-			if (smbus_pec_verify(len, 2) < 0) {
-				break;
-			}
-			smbus_data_regs[SMBUS_REG__TB4_DIR] = buf[1];
-			env_set("tb4dir", smbus_data_regs[SMBUS_REG__TB4_DIR]);
-			break;
-			
-		case SMBUS_REG__ADD_LOW_BYTE:
-			if (smbus_pec_verify(len, 3) < 0) {
-				break;
-			}
-			smbus_data_regs[SMBUS_REG__ADD_LOW_BYTE] = buf[1];
-			smbus_data_regs[SMBUS_REG__ADD_HIGH_BYTE] = buf[2];
-			break;
-
-		case SMBUS_REG__DATA:
-			if (smbus_pec_verify(len, 2) < 0) {
-				break;
-			}
-			smbus_data_regs[SMBUS_REG__DATA] = buf[1];
-			break;
-		
-		case SMBUS_REG__WRITE_DATA:
-			if (smbus_pec_verify(len, 2) < 0) {
-				break;
-			}
-			smbus_data_regs[SMBUS_REG__WRITE_DATA] = buf[1];
-			break;
-		
-		case SMBUS_REG__SYNC100_DIV:
-			if (smbus_pec_verify(len, 2) < 0) {
-				break;
-			}
-			smbus_data_regs[SMBUS_REG__SYNC100_DIV] = buf[1];
+		case SMBUS_PROTO_SEND:
+			cnt = 0;
+			expected_len = 1;
 			break;
-						
-		/* TBD: add support for other write commands here, if required */
 		default:
+			cnt = desc->len;
+			expected_len = cnt + 1;
+			if (len < expected_len) {
+				return;
+			}
 			break;
 	}
+	if (smbus_pec_verify(pec, len, expected_len) < 0) {
+		smbus_set_status_bit(desc->err_status);
+		return;
+	}
+	if (desc->proto == SMBUS_PROTO_BYTE || desc->proto == SMBUS_PROTO_WORD) {
+		for (int i = 0; i < cnt; i++) {
+			smbus_frame_set_byte(desc->reg + i, data[i]);
+		}
+		smbus_frame_commit();
+		if (desc->env != ENV_NONE) {
+			env_set((enum env_index)desc->env, data[0]);
+		}
+	}
+	if (desc->write) {
+		desc->write(data, cnt);
+	}
 }
 
+/* Upgrade commands are not pipelined: BUSY stays set until they have been executed */
+static int smbus_cmd_is_barrier(uint8_t cmd)
+{
+	return cmd == SMBUS_CMD_UPGRADE_START || cmd == SMBUS_CMD_UPGRADE_SEND_DATA || cmd == SMBUS_CMD_UPGRADE_ACTIVATE;
+}
 
 /* The following function is called when a read request is received (AR), most likely after a repeated start */
 static void i2c_read_request_callback(struct i2c_slave_module *const module)
 {
+	PROFILE_ISR(PROFILE_ISR_SMBUS);
 	struct i2c_slave_packet packet;
 	uint8_t len = i2c_tx_len;
 
@@ -659,6 +477,7 @@ static void i2c_read_request_callback(struct i2c_slave_module *const module)
 /* The following function is called when a write request is received (AW) */
 static void i2c_write_request_callback(struct i2c_slave_module *const module)
 {
+	PROFILE_ISR(PROFILE_ISR_SMBUS);
 	struct i2c_slave_packet packet;
 
 	/* Initialize the PEC (starting from the write address) */
@@ -671,13 +490,14 @@ static void i2c_write_request_callback(struct i2c_slave_module *const module)
 	packet.data = i2c_rx_buf;
 	
 	if (i2c_slave_read_packet_job(module, &packet) != STATUS_OK) {
-		printf("SMBUS: i2c_slave_read_packet_job failed\r\n");
+		log_printf("SMBUS: i2c_slave_read_packet_job failed\r\n");
 	}
 }
 
 /* The following function is called after a write transaction has been completed (i.e. after a stop or repeated start condition) */
 static void i2c_write_complete_callback(struct i2c_slave_module *const module)
 {
+	PROFILE_ISR(PROFILE_ISR_SMBUS);
 	uint8_t len = module->buffer - i2c_rx_buf;
 	uint32_t flags = i2c_slave_get_status(module);
 	
@@ -698,10 +518,24 @@ static void i2c_write_complete_callback(struct i2c_slave_module *const module)
 		}
 	} else if (!(smbus_status & SMBUS_STATUS_BUSY)) {
 		/* SMBus write command: defer processing to the main loop (since write commands can take a long time to execute) */
-		memcpy(cmd_buf, i2c_rx_buf, len);
-		cmd_len = len;
-		/* Set the busy status: it will be cleared once the command is processed */
-		smbus_set_status_bit(SMBUS_STATUS_BUSY);
+		struct smbus_cmd *cmd = smbus_cmd_ring_write_slot(&cmd_queue);
+		if (!cmd) {
+			return;
+		}
+		memcpy(cmd->buf, i2c_rx_buf, len);
+		cmd->len = len;
+		cmd->pec = current_pec;
+		smbus_cmd_ring_write_done(&cmd_queue);
+		if (smbus_cmd_is_barrier(i2c_rx_buf[0])) {
+			cmd_barriers++;
+		}
+		/*
+			Set the busy status if no further command fits or if an upgrade command is queued
+			(the master waits for these): it will be cleared once the command is processed
+		 */
+		if (!smbus_cmd_ring_space(&cmd_queue) || cmd_barriers) {
+			smbus_set_status_bit(SMBUS_STATUS_BUSY);
+		}
 	}
 }
 
@@ -710,19 +544,36 @@ static void i2c_error_last_transfer_callback(struct i2c_slave_module *const modu
 {
 	uint32_t flags = i2c_slave_get_status(module);
 	if (flags & I2C_SLAVE_STATUS_SCL_LOW_TIMEOUT) {
-		printf("SMBUS: SCL Low Timeout detected!\r\n");
+		log_printf("SMBUS: SCL Low Timeout detected!\r\n");
 	} else {
-		printf("SMBUS: unknown I2C error (status = 0x%08lx)\r\n", flags);
+		log_printf("SMBUS: unknown I2C error (status = 0x%08lx)\r\n", flags);
 	}
 	/* Clear the error status (the bus will be released automatically) */
 	i2c_slave_clear_status(module, flags);
 }
 
+/*
+ * An environment variable behind a register changed (e.g. CLI setenv): publish the new value
+ */
+static void smbus_env_changed(uint64_t changed)
+{
+	int reg;
+	
+	for (reg = 0; reg < SMBUS_REG_COUNT; reg++) {
+		if (smbus_reg_map[reg].env != ENV_NONE && (changed & ((uint64_t)1 << smbus_reg_map[reg].env))) {
+			smbus_frame_set_byte(smbus_reg_map[reg].reg, (uint8_t) env_get((enum env_index)smbus_reg_map[reg].env));
+		}
+	}
+	smbus_frame_commit();
+}
+
 void smbus_init(void)
 {
 	struct i2c_slave_config config_i2c_slave;
 	struct system_gclk_gen_config gclk_slow_conf;
 	struct system_gclk_chan_config gclk_slow_chan_conf;
+	uint64_t env_mask = 0;
+	int reg;
 	
 	i2c_slave_get_config_defaults(&config_i2c_slave);
 	config_i2c_slave.address = CFG_I2C_SLAVE_ADDRESS >> 1;
@@ -762,71 +613,69 @@ void smbus_init(void)
 	i2c_slave_register_callback(&i2c_slave_instance, i2c_error_last_transfer_callback, I2C_SLAVE_CALLBACK_ERROR_LAST_TRANSFER);
 	i2c_slave_enable_callback(&i2c_slave_instance, I2C_SLAVE_CALLBACK_ERROR_LAST_TRANSFER);
 	
-	smbus_data_regs[SMBUS_REG__FAN_CURVE] = (uint8_t) env_get("fan_curve");
-	smbus_data_regs[SMBUS_REG__TB1_EN] = (uint8_t) env_get("tb1en");
-	smbus_data_regs[SMBUS_REG__TB1_DIR] = (uint8_t) env_get("tb1dir");
-	smbus_data_regs[SMBUS_REG__TB2_EN] = (uint8_t) env_get("tb2en");
-	smbus_data_regs[SMBUS_REG__TB2_DIR] = (uint8_t) env_get("tb2dir");
-	smbus_data_regs[SMBUS_REG__TB3_EN] = (uint8_t) env_get("tb3en");
-	smbus_data_regs[SMBUS_REG__TB3_DIR] = (uint8_t) env_get("tb3dir");
-	smbus_data_regs[SMBUS_REG__TB4_EN] = (uint8_t) env_get("tb4en");
-	smbus_data_regs[SMBUS_REG__TB4_DIR] = (uint8_t) env_get("tb4dir");
-	
+	/* Restore the persistent registers from the environment and follow later changes (CLI setenv) */
+	for (reg = 0; reg < SMBUS_REG_COUNT; reg++) {
+		if (smbus_reg_map[reg].env != ENV_NONE) {
+			smbus_set_input_reg(smbus_reg_map[reg].reg, (uint8_t) env_get((enum env_index)smbus_reg_map[reg].env));
+			env_mask |= (uint64_t)1 << smbus_reg_map[reg].env;
+		}
+	}
+	env_subscribe(env_mask, smbus_env_changed);
 	
 	char cmm_firmware_number[10] = CFG_FIRMWARE_NUMBER;
 	
 	for (uint8_t i=0; i<sizeof(cmm_firmware_number); i++)
 	{
-		smbus_data_regs[SMBUS_REG__CMM_FW_BYTE_1+i] = cmm_firmware_number[i];
+		smbus_set_input_reg(SMBUS_REG__CMM_FW_BYTE_1+i, cmm_firmware_number[i]);
 	}
 	
-	smbus_data_regs[SMBUS_REG__CMM_VERSION] = CFG_FIRMWARE_VERSION;
+	smbus_set_input_reg(SMBUS_REG__CMM_VERSION, CFG_FIRMWARE_VERSION);
 }
 
 void do_smbus(void)
 {
-	uint8_t status;
+	struct smbus_cmd *cmd;
 	
 	static uint8_t init_done;
 	
 	if (!init_done) {
-		smbus_data_regs[SMBUS_REG__CONFIG] = (ioport_get_pin_level(CFG_DIP4_LEARN)<<3)|(ioport_get_pin_level(CFG_DIP3)<<2)|(ioport_get_pin_level(CFG_DIP2_AC_OK)<<1)|(ioport_get_pin_level(CFG_DIP1_PS_ON_LOGIC));
+		smbus_set_input_reg(SMBUS_REG__CONFIG, (ioport_get_pin_level(CFG_DIP4_LEARN)<<3)|(ioport_get_pin_level(CFG_DIP3)<<2)|(ioport_get_pin_level(CFG_DIP2_AC_OK)<<1)|(ioport_get_pin_level(CFG_DIP1_PS_ON_LOGIC)));
 		init_done = 1;
 	}
 	
 
 	/* Check for scheduled activation */
-	if (activation_start && get_jiffies() - activation_start > 3000) {
-		printf("SMBUS UPGRADE: activating firmware...\r\n");
+	if (sys_deadline_passed(activation_deadline)) {
+		log_printf("SMBUS UPGRADE: activating firmware...\r\n");
 		if (upgrade_activate()) {
-			printf("SMBUS UPGRADE: activation failed\r\n");
+			log_printf("SMBUS UPGRADE: activation failed\r\n");
 			smbus_set_status_bit(SMBUS_STATUS_UPGRADE_ERROR);
-			activation_start = 0;
+			activation_deadline = SYS_TIME_NEVER;
 		}
 		else{
-			printf("SMBUS UPGRADE: activation finished, carry out power cycle. \r\n");
-			activation_start = 0;
+			log_printf("SMBUS UPGRADE: activation finished, carry out power cycle. \r\n");
+			activation_deadline = SYS_TIME_NEVER;
 		}
 	}
 	
-	/* Protect against the interrupt handler updating the status */
-	system_interrupt_enter_critical_section();
-	status = smbus_status;
-	system_interrupt_leave_critical_section();
-	
-	if (!(status & SMBUS_STATUS_BUSY)) {
-		/* No pending command */
-		return;
+	/* Process the deferred write commands in order */
+	while ((cmd = smbus_cmd_ring_read_slot(&cmd_queue)) != NULL) {
+		uint8_t pec = crc8(cmd->pec, cmd->buf, cmd->len, PEC_POLYNOMIAL, 1);
+		int barrier = smbus_cmd_is_barrier(cmd->buf[0]);
+		
+		smbus_process_write(cmd->buf, cmd->len, pec);
+		smbus_cmd_ring_read_done(&cmd_queue);
+		
+		/* Clear the busy status (ready to accept more commands) unless an upgrade command is still queued */
+		system_interrupt_enter_critical_section();
+		if (barrier) {
+			cmd_barriers--;
+		}
+		if (!cmd_barriers) {
+			smbus_status &= ~SMBUS_STATUS_BUSY;
+		}
+		system_interrupt_leave_critical_section();
 	}
-
-	/* Adjust the PEC to include the command data */
-	smbus_pec_adjust(cmd_buf, cmd_len, 1);
-	
-	/* Process deferred write command */
-	smbus_process_write(cmd_buf, cmd_len);
-
-	/* Clear the busy status (ready to accept more commands) */
-	smbus_clear_status_bit(SMBUS_STATUS_BUSY);
 }
 
 #endif /* BOOTLOADER */
\ No newline at end of file
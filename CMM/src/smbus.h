@@ -93,6 +93,10 @@
 
 #define SMBUS_REG__CONFIG					0x55
 #define SMBUS_REG__MAX_SPEED				0x56
+#define SMBUS_REG__FAN_CONTROL				0x57 //write + ENV (0 = fan curve, 1 = closed loop)
+#define SMBUS_REG__FAN_PID_KP				0x58 //write + ENV
+#define SMBUS_REG__FAN_PID_KI				0x59 //write + ENV
+#define SMBUS_REG__FAN_PID_KD				0x5A //write + ENV
 
 #define SMBUS_REG__CMM_FW_BYTE_1			0x60
 #define SMBUS_REG__CMM_FW_BYTE_2			0x61
@@ -143,8 +147,21 @@
 #define SMBUS_REG__CMM_PDB_SERIAL_NUM_Byte_11		0x93
 #define SMBUS_REG__CMM_PDB_SERIAL_NUM_Byte_12		0x94
 
+#define SMBUS_REG__TELEMETRY				0xA0 //block read, SMBUS_TELEMETRY_LEN bytes (layout see README.md)
+#define SMBUS_TELEMETRY_VERSION				1
+#define SMBUS_TELEMETRY_LEN					38
+
+#define SMBUS_REG__PROFILE_SELECT			0xC6 //profile entry shown in SMBUS_REG__PROFILE (CFG_PROFILE only)
+#define SMBUS_REG__PROFILE					0xC8 //block read, SMBUS_PROFILE_LEN bytes (layout see README.md)
+#define SMBUS_PROFILE_VERSION				1
+#define SMBUS_PROFILE_LEN					20
+
 uint8_t smbus_get_input_reg(uint8_t nr);
 void smbus_set_input_reg(uint8_t nr, uint8_t val);
+void smbus_frame_set_byte(uint8_t nr, uint8_t val);
+void smbus_frame_set_word(uint8_t nr, uint16_t val);
+void smbus_frame_commit(void);
+void smbus_telemetry_commit(void);
 void smbus_init(void);
 void do_smbus(void);
 
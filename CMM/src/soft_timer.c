@@ -0,0 +1,143 @@
+/*
+ * soft_timer.c: software timers run from the main loop
+ *
+ * Created: 10/17/2026
+ *  Author: E1210640
+ */ 
+
+#include <asf.h>
+
+#include "config.h"
+#include "sys_timer.h"
+#include "soft_timer.h"
+
+#ifndef BOOTLOADER
+
+/*
+ * Hashed timer wheel with 1 ms resolution: a timer is kept in the slot (expires mod CFG_SOFT_TIMER_SLOTS).
+ * do_soft_timer() visits the slots of the ms passed since its last run (all of them at most once)
+ * and fires the timers there that are due; timers of a later wheel revolution are left in place.
+ * Starting and stopping is O(1) resp. O(timers per slot)
+ */
+#define SOFT_TIMER_MASK		(CFG_SOFT_TIMER_SLOTS - 1)
+
+typedef char soft_timer_slots_check[(CFG_SOFT_TIMER_SLOTS & SOFT_TIMER_MASK) == 0 ? 1 : -1];
+
+static struct soft_timer *soft_timer_wheel[CFG_SOFT_TIMER_SLOTS];
+static uint32_t soft_timer_now;		/* Last ms processed by do_soft_timer() */
+
+/* Wrap safe: a is later than b */
+static inline bool soft_timer_after(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) > 0;
+}
+
+static void soft_timer_insert(struct soft_timer *timer, uint32_t expires)
+{
+	struct soft_timer **slot;
+	
+	/* A slot already processed is only visited again one revolution later */
+	if (!soft_timer_after(expires, soft_timer_now)) {
+		expires = soft_timer_now + 1;
+	}
+	slot = &soft_timer_wheel[expires & SOFT_TIMER_MASK];
+	timer->expires = expires;
+	timer->next = *slot;
+	timer->armed = true;
+	*slot = timer;
+}
+
+/*
+ * Set up a stopped timer (static or soft_timer_stop()ped: an armed one is still linked in the wheel)
+ */
+void soft_timer_init(struct soft_timer *timer, void (*fn)(void *arg), void *arg)
+{
+	timer->next = NULL;
+	timer->fn = fn;
+	timer->arg = arg;
+	timer->period = 0;
+	timer->armed = false;
+}
+
+/*
+ * (Re)start the timer: first run after delay ms, then every period ms (0: one-shot)
+ */
+void soft_timer_start(struct soft_timer *timer, uint32_t delay, uint32_t period)
+{
+	soft_timer_stop(timer);
+	timer->period = period;
+	soft_timer_insert(timer, get_jiffies() + delay);
+}
+
+void soft_timer_stop(struct soft_timer *timer)
+{
+	struct soft_timer **p;
+	
+	if (!timer->armed) {
+		return;
+	}
+	for (p = &soft_timer_wheel[timer->expires & SOFT_TIMER_MASK]; *p; p = &(*p)->next) {
+		if (*p == timer) {
+			*p = timer->next;
+			break;
+		}
+	}
+	timer->next = NULL;
+	timer->armed = false;
+}
+
+bool soft_timer_pending(const struct soft_timer *timer)
+{
+	return timer->armed;
+}
+
+/*
+ * Fire the due timers of one slot. A callback may change any slot list, so the scan restarts
+ * after every callback; fired timers are either removed or moved behind now, so it terminates
+ */
+static void soft_timer_slot(struct soft_timer **slot, uint32_t now)
+{
+	struct soft_timer **p = slot;
+	struct soft_timer *timer;
+	
+	while ((timer = *p) != NULL) {
+		if (soft_timer_after(timer->expires, now)) {
+			p = &timer->next;
+			continue;
+		}
+		*p = timer->next;
+		timer->next = NULL;
+		timer->armed = false;
+		if (timer->period) {
+			/* Keep the rate, but do not fire back to back after a stall */
+			soft_timer_insert(timer, soft_timer_after(timer->expires + timer->period, now) ?
+				timer->expires + timer->period : now + timer->period);
+		}
+		timer->fn(timer->arg);
+		p = slot;
+	}
+}
+
+/*
+ * Main loop task: run the callbacks of the expired timers
+ */
+void do_soft_timer(void)
+{
+	uint32_t now = get_jiffies();
+	uint32_t ticks = now - soft_timer_now;
+	uint32_t t;
+	
+	if (ticks == 0) {
+		return;
+	}
+	if (ticks > CFG_SOFT_TIMER_SLOTS) {
+		ticks = CFG_SOFT_TIMER_SLOTS;
+	}
+	t = now - ticks;
+	soft_timer_now = now;
+	while (ticks--) {
+		soft_timer_slot(&soft_timer_wheel[++t & SOFT_TIMER_MASK], now);
+	}
+}
+
+#endif /* BOOTLOADER */
@@ -0,0 +1,33 @@
+/*
+ * soft_timer.h
+ *
+ * Created: 10/17/2026
+ *  Author: E1210640
+ */ 
+
+#ifndef __SOFT_TIMER_H__
+#define __SOFT_TIMER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * One-shot or periodic software timer. The callback runs in main loop context (do_soft_timer()),
+ * it may start and stop any timer, including its own. Only use from the main loop
+ */
+struct soft_timer {
+	struct soft_timer *next;	//next timer in the same wheel slot
+	void (*fn)(void *arg);
+	void *arg;
+	uint32_t expires;		//jiffies
+	uint32_t period;		//ms, 0: one-shot
+	bool armed;
+};
+
+void soft_timer_init(struct soft_timer *timer, void (*fn)(void *arg), void *arg);
+void soft_timer_start(struct soft_timer *timer, uint32_t delay, uint32_t period);
+void soft_timer_stop(struct soft_timer *timer);
+bool soft_timer_pending(const struct soft_timer *timer);
+void do_soft_timer(void);
+
+#endif /* __SOFT_TIMER_H__ */
@@ -10,12 +10,26 @@
 
 #include "sys_timer.h"
 #include "uart.h"
+#include "adc_measure.h"
+#include "profile.h"
 
-static uint32_t jiffies;
+/*
+ * 64 bit millisecond count, split in two words so that the interrupt only writes one of them
+ * per tick. Readers do not lock, they read again when a tick came in between (see sys_timer_read())
+ */
+static volatile uint32_t jiffies;
+static volatile uint32_t jiffies_hi;
 
 ISR(SysTick_Handler)
 {
-	jiffies++;
+	if (++jiffies == 0) {
+		jiffies_hi++;
+	}
+	/* After the increment: sys_timer_read() would not see the wrap before it */
+	PROFILE_ISR(PROFILE_ISR_SYSTICK);
+#ifndef BOOTLOADER
+	adc_guard_tick();
+#endif
 }
 
 void sys_timer_init(void)
@@ -24,13 +38,59 @@ void sys_timer_init(void)
 	printf("System timer: %ld Hz\r\n", system_cpu_clock_get_hz());
 }
 
+/* A single aligned word read is atomic, no need to lock */
 uint32_t get_jiffies(void)
 {
-	uint32_t tmp;
+	return jiffies;
+}
+
+/*
+ * Consistent snapshot of the tick count and the CPU cycles elapsed in the current tick, without
+ * masking interrupts: read again if the SysTick interrupt ran in between. With the interrupt
+ * blocked (called from an interrupt handler or a critical section) a wrap of SysTick->VAL is only
+ * pending, that tick is added here
+ */
+static uint64_t sys_timer_read(uint32_t *cycles)
+{
+	uint32_t lo, hi, val, pending, load = SysTick->LOAD;
 	
-	system_interrupt_enter_critical_section();
-	tmp = jiffies;
-	system_interrupt_leave_critical_section();
+	do {
+		hi = jiffies_hi;
+		lo = jiffies;
+		val = SysTick->VAL;
+		pending = (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) ? 1 : 0;
+		if (pending) {
+			/* VAL may have been read just before the wrap */
+			val = SysTick->VAL;
+		}
+	} while (lo != jiffies || hi != jiffies_hi);
 	
-	return tmp;
-}
\ No newline at end of file
+	*cycles = load - val;
+	
+	return (((uint64_t)hi << 32) | lo) + pending;
+}
+
+/*
+ * CPU cycles since the system timer was started (wraps after 2^32 cycles), for short time measurements
+ */
+uint32_t sys_timer_cycles(void)
+{
+	uint32_t cycles, ticks;
+	
+	ticks = (uint32_t) sys_timer_read(&cycles);
+	
+	return ticks * (SysTick->LOAD + 1) + cycles;
+}
+
+/*
+ * Microseconds since the system timer was started, never wraps
+ */
+uint64_t sys_time_us(void)
+{
+	uint32_t cycles;
+	uint64_t ticks;
+	
+	ticks = sys_timer_read(&cycles);
+	
+	return ticks * 1000 + cycles * 1000 / (SysTick->LOAD + 1);
+}
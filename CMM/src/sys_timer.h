@@ -9,7 +9,42 @@
 #ifndef __SYS_TIMER_H__
 #define __SYS_TIMER_H__
 
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Microseconds, for sys_time_us() based timeouts */
+#define SYS_TIME_MS(_ms)		((uint64_t)(_ms) * 1000)
+#define SYS_TIME_SEC(_sec)		((uint64_t)(_sec) * 1000000)
+/* Deadline that never expires (instead of a 0 "not armed" marker, 0 is a valid time) */
+#define SYS_TIME_NEVER			UINT64_MAX
+
 void sys_timer_init(void);
 uint32_t get_jiffies(void);
+uint32_t sys_timer_cycles(void);
+uint64_t sys_time_us(void);
+
+/*
+ * Deadline timeout_us from now
+ */
+static inline uint64_t sys_deadline(uint64_t timeout_us)
+{
+	return sys_time_us() + timeout_us;
+}
+
+/*
+ * The deadline has passed (never for SYS_TIME_NEVER)
+ */
+static inline bool sys_deadline_passed(uint64_t deadline)
+{
+	return deadline != SYS_TIME_NEVER && sys_time_us() >= deadline;
+}
+
+/*
+ * Microseconds since the time stamp 'since'
+ */
+static inline uint64_t sys_elapsed_us(uint64_t since)
+{
+	return sys_time_us() - since;
+}
 
-#endif /* __SYS_TIMER_H__ */
\ No newline at end of file
+#endif /* __SYS_TIMER_H__ */
@@ -36,30 +36,36 @@ struct {
 	int pinmux_pad3;
 } uart_config[] = { CFG_UART_CHANNELS };
 
-#undef CFG_UART_CHANNEL
-#define CFG_UART_CHANNEL(_chan, ...) \
-	static RING_BUFFER(uart_ring_##_chan, CFG_UART_RING_SIZE);
-
-/* UART input buffers (one for each defined channel) */
-CFG_UART_CHANNELS
+#define UART_CHANNELS (int)(sizeof(uart_config)/sizeof(*uart_config))
 
-#undef CFG_UART_CHANNEL
-#define CFG_UART_CHANNEL(_chan, ...) \
-	{ \
-		(struct ring_buffer *)&uart_ring_##_chan, \
-	},
+RING_DECLARE(uart_rx_ring, uint8_t, CFG_UART_RING_SIZE)
 
 /* Dynamic UART data (input buffer, USART instance, current input character) */
 struct {
-	struct ring_buffer *ring;
+	struct uart_rx_ring ring;
 	struct usart_module usart_instance;
 	uint16_t current_char;
-} uart_data[] = { CFG_UART_CHANNELS };
-
-#define UART_CHANNELS (int)(sizeof(uart_config)/sizeof(*uart_config))
+} uart_data[UART_CHANNELS];
 
 #ifndef BOOTLOADER
 
+#define UART_TX_CHUNK	32		/* Characters handed to the driver per transmit job */
+
+RING_DECLARE(uart_tx_ring, uint8_t, CFG_UART_TX_RING_SIZE)
+
+/*
+ * Transmit data: the ring is drained by the DRE interrupt of the ASF driver in chunks,
+ * the chunk being transmitted is no longer part of the ring.
+ * uart_write() is the producer (main loop or interrupt, serialised by a critical section),
+ * uart_tx_kick() (main loop or interrupt) the consumer
+ */
+struct {
+	struct uart_tx_ring ring;
+	uint8_t chunk[UART_TX_CHUNK];
+	volatile uint8_t busy;
+	uint32_t dropped;
+} uart_tx[UART_CHANNELS];
+
 int quiet;
 
 static int uart_find_channel(struct usart_module *mod)
@@ -84,30 +90,110 @@ static void uart_callback(struct usart_module *const mod)
 		return;
 	}
 	/* Store the newly-received character in the input buffer */
-	ring_put(uart_data[chan].ring, uart_data[chan].current_char);
+	uart_rx_ring_put(&uart_data[chan].ring, uart_data[chan].current_char);
 	/* Prepare for receiving next character */
 	usart_read_job((struct usart_module *const)mod, &uart_data[chan].current_char);
 }
 
-int uart_gets(int chan, char *buf, int maxlen)
+/* Start transmitting the next chunk of the output buffer (called with interrupts disabled) */
+static void uart_tx_kick(int chan)
 {
-	struct ring_buffer *ring = uart_data[chan].ring;
-	int ret;
+	int len;
+	
+	if (uart_tx[chan].busy) {
+		return;
+	}
+	len = uart_tx_ring_get_buf(&uart_tx[chan].ring, uart_tx[chan].chunk, UART_TX_CHUNK);
+	if (len && usart_write_buffer_job(&uart_data[chan].usart_instance, uart_tx[chan].chunk, len) == STATUS_OK) {
+		uart_tx[chan].busy = 1;
+	}
+}
 
-	system_interrupt_enter_critical_section();
-	ret = ring_get_buf(ring, (uint8_t *)buf, maxlen);
-	system_interrupt_leave_critical_section();
+/* UART callback: called by the ASF driver when a chunk has been transmitted */
+static void uart_tx_callback(struct usart_module *const mod)
+{
+	int chan = uart_find_channel(mod);
 	
-	return ret;
+	if (chan < 0) {
+		return;
+	}
+	uart_tx[chan].busy = 0;
+	uart_tx_kick(chan);
 }
 
-#endif /* BOOTLOADER */
+/* The transmit interrupt cannot run (called from an interrupt handler or with interrupts disabled) */
+static int uart_tx_irq_blocked(void)
+{
+	return __get_IPSR() != 0 || __get_PRIMASK() != 0;
+}
 
-void uart_putc(int chan, char data)
+/* printf() output goes through the console output buffer */
+static int uart_stdio_putc(void volatile *usart, char c)
+{
+	uart_putc(CFG_CONSOLE_CHANNEL, c);
+	
+	return 0;
+}
+
+/* Free space in the output buffer */
+int uart_tx_free(int chan)
+{
+	return uart_tx_ring_space(&uart_tx[chan].ring);
+}
+
+/* Characters discarded because the output buffer was full */
+uint32_t uart_tx_dropped(int chan)
+{
+	return uart_tx[chan].dropped;
+}
+
+/*
+ * Wait until the output buffer has been transmitted. If the transmit interrupt cannot run,
+ * the pending data is written synchronously (e.g. before a reset)
+ */
+void uart_flush(int chan)
 {
 	struct usart_module *mod = &uart_data[chan].usart_instance;
+	struct uart_tx_ring *ring = &uart_tx[chan].ring;
+	volatile uint8_t *ptr;
+	uint8_t c;
+	int remaining, written = 0;
 	
-	usart_write_wait(mod, data);
+	if (!uart_tx_irq_blocked()) {
+		while (uart_tx_ring_count(ring) || uart_tx[chan].busy)
+			;
+		return;
+	}
+	if (uart_tx[chan].busy) {
+		remaining = mod->remaining_tx_buffer_length;
+		ptr = mod->tx_buffer_ptr;
+		usart_abort_job(mod, USART_TRANSCEIVER_TX);
+		uart_tx[chan].busy = 0;
+		if (remaining) {
+			usart_write_buffer_wait(mod, (const uint8_t *)ptr, remaining);
+			written = 1;
+		}
+	}
+	while (uart_tx_ring_get(ring, &c)) {
+		usart_write_wait(mod, c);
+		written = 1;
+	}
+	if (written) {
+		while (!(mod->hw->USART.INTFLAG.reg & SERCOM_USART_INTFLAG_TXC))
+			;
+	}
+}
+
+int uart_gets(int chan, char *buf, int maxlen)
+{
+	return uart_rx_ring_get_buf(&uart_data[chan].ring, (uint8_t *)buf, maxlen);
+}
+
+#endif /* BOOTLOADER */
+
+void uart_putc(int chan, char data)
+{
+	uart_write(chan, (const uint8_t *)&data, 1);
 }
 
 void uart_puts(int chan, const char *str)
@@ -115,6 +201,8 @@ void uart_puts(int chan, const char *str)
 	uart_write(chan, (const uint8_t *)str, strlen(str));
 }
 
+#ifdef BOOTLOADER
+
 void uart_write(int chan, const uint8_t *buf, int len)
 {
 	struct usart_module *mod = &uart_data[chan].usart_instance;
@@ -122,6 +210,50 @@ void uart_write(int chan, const uint8_t *buf, int len)
 	usart_write_buffer_wait(mod, buf, len);
 }
 
+#else /* BOOTLOADER */
+
+/*
+ * Queue data in the output buffer. If it is full, CFG_UART_TX_FULL decides:
+ * drop the new data, wait for the transmit interrupt or overwrite the oldest data
+ */
+void uart_write(int chan, const uint8_t *buf, int len)
+{
+	struct uart_tx_ring *ring = &uart_tx[chan].ring;
+	uint32_t cnt;
+	
+	while (len) {
+		/* Interrupt handlers write too (log_flush(), printf()): the put must not be preempted */
+		system_interrupt_enter_critical_section();
+		cnt = uart_tx_ring_put_buf(ring, buf, len);
+		buf += cnt;
+		len -= cnt;
+#if CFG_UART_TX_FULL == UART_TX_DROP
+		uart_tx[chan].dropped += len;
+		len = 0;
+#endif
+#if CFG_UART_TX_FULL == UART_TX_OVERWRITE
+		/* Discarding the oldest data makes the producer a consumer as well */
+		while (len) {
+			uint8_t c;
+			uart_tx_ring_get(ring, &c);
+			uart_tx_ring_put(ring, *buf++);
+			uart_tx[chan].dropped++;
+			len--;
+		}
+#endif
+		uart_tx_kick(chan);
+		system_interrupt_leave_critical_section();
+#if CFG_UART_TX_FULL == UART_TX_BLOCK
+		if (len && uart_tx_irq_blocked()) {
+			/* Waiting would never end: make room synchronously */
+			uart_flush(chan);
+		}
+#endif
+	}
+}
+
+#endif /* BOOTLOADER */
+
 static void uart_init_channel(int chan, int baud)
 {
 	struct usart_config cfg;
@@ -141,8 +273,14 @@ static void uart_init_channel(int chan, int baud)
 	usart_enable(mod);
 	if (chan == CFG_CONSOLE_CHANNEL) {
 		stdio_serial_init(mod, uart_config[chan].sercom, &cfg);
+#ifndef BOOTLOADER
+		ptr_put = uart_stdio_putc;
+#endif
 	}
 #ifndef BOOTLOADER
+	uart_tx[chan].busy = 0;
+	usart_register_callback(mod, uart_tx_callback, USART_CALLBACK_BUFFER_TRANSMITTED);
+	usart_enable_callback(mod, USART_CALLBACK_BUFFER_TRANSMITTED);
 	usart_register_callback(mod, uart_callback, USART_CALLBACK_BUFFER_RECEIVED);
 	usart_enable_callback(mod, USART_CALLBACK_BUFFER_RECEIVED);
 	usart_read_job((struct usart_module *const)mod, &uart_data[chan].current_char);
@@ -8,10 +8,18 @@
 #ifndef __UART_H__
 #define __UART_H__
 
+/* Output buffer full behaviour (CFG_UART_TX_FULL) */
+#define UART_TX_DROP		0	/* discard the new data */
+#define UART_TX_BLOCK		1	/* wait until the data fits */
+#define UART_TX_OVERWRITE	2	/* discard the oldest data */
+
 int uart_init(void);
 void uart_putc(int chan, char data);
 void uart_puts(int chan, const char *str);
 void uart_write(int chan, const uint8_t *buf, int len);
+int uart_tx_free(int chan);
+uint32_t uart_tx_dropped(int chan);
+void uart_flush(int chan);
 int uart_gets(int chan, char *buf, int maxlen);
 void uart_reset(int chan);
 void uart_set_baud_rate(int chan, int baud);
@@ -13,6 +13,7 @@
 #include "heartbeat.h"
 #include "watchdog.h"
 #include "crc.h"
+#include "log.h"
 
 #define UPGRADE_MAGIC	0x12345678
 
@@ -34,7 +35,7 @@ int upgrade_start(void)
 	last_addr = 0;
 	flash_offset = spi_flash_get_block_size();
 	if (spi_flash_erase(0, -1) < 0) {
-		printf("ERROR: spi_flash_erase failed\r\n");
+		log_printf("ERROR: spi_flash_erase failed\r\n");
 		return -1;
 	}
 	ihex_upper = 0;
@@ -51,7 +52,7 @@ int upgrade_parse_ihex(uint8_t *buf)
 	
 	len = buf[0];
 	if (len > 252) {
-		printf("ERROR: bogus IHEX record length (%d)\r\n", len);
+		log_printf("ERROR: bogus IHEX record length (%d)\r\n", len);
 		return -1;
 	}
 	addr = (buf[1] << 8) | buf[2] | ihex_upper;
@@ -62,7 +63,7 @@ int upgrade_parse_ihex(uint8_t *buf)
 		tmp += buf[i];
 	}
 	if (tmp) {
-		printf("ERROR: bad IHEX record checksum\r\n");
+		log_printf("ERROR: bad IHEX record checksum\r\n");
 		return -1;
 	}
 	switch (type) {
@@ -73,7 +74,7 @@ int upgrade_parse_ihex(uint8_t *buf)
 				last_addr = addr + len;
 			}
 			if (spi_flash_program(addr + flash_offset, buf + 4, len) < 0) {
-				printf("ERROR: Flash programming failed\r\n");
+				log_printf("ERROR: Flash programming failed\r\n");
 				return -1;
 			}
 			break;
@@ -106,17 +107,17 @@ int upgrade_verify(void)
 			chunk = sizeof(buf);
 		}
 		if (spi_flash_read(addr, buf, chunk) < 0) {
-			printf("ERROR: spi_flash_read failed\r\n");
+			log_printf("ERROR: spi_flash_read failed\r\n");
 			return -1;
 		}
 		crc = crc16(crc, (const uint8_t *)buf, chunk, 0x1021, addr + chunk >= end);
 	}
 	if (spi_flash_read(flash_offset + last_addr - 2, (uint8_t *)&stored_crc, sizeof(stored_crc)) < 0) {
-		printf("ERROR: spi_flash_read failed\r\n");
+		log_printf("ERROR: spi_flash_read failed\r\n");
 		return -1;
 	}
 	if (crc != stored_crc) {
-		printf("ERROR: checksum verification failed (0x%04x != 0x%04x)\r\n", crc, stored_crc);
+		log_printf("ERROR: checksum verification failed (0x%04x != 0x%04x)\r\n", crc, stored_crc);
 		return -1;
 	}
 	
@@ -135,7 +136,7 @@ int upgrade_activate(void)
 	hdr.magic = UPGRADE_MAGIC;
 	hdr.size = last_addr;
 	if (spi_flash_program(0, (uint8_t *)&hdr, sizeof(hdr)) < 0) {
-		printf("ERROR: spi_flash_program failed\r\n");
+		log_printf("ERROR: spi_flash_program failed\r\n");
 		return -1;
 	}
 	/*
@@ -163,13 +164,13 @@ int upgrade_copy_to_nvm(void)
 	uint32_t offset;
 	
 	if (spi_flash_read(0, (uint8_t *)&hdr, sizeof(hdr)) < 0) {
-		printf("ERROR: spi_flash_read failed\r\n");
+		log_printf("ERROR: spi_flash_read failed\r\n");
 		return -1;
 	}
 	if (hdr.magic != UPGRADE_MAGIC) {
 		return 0;
 	}
-	printf("Valid upgrade image detected in Flash: copying to NVM...\r\n");
+	log_printf("Valid upgrade image detected in Flash: copying to NVM...\r\n");
 	nvm_get_config_defaults(&cfg);
 	cfg.manual_page_write = false;
 	nvm_set_config(&cfg);
@@ -182,7 +183,7 @@ int upgrade_copy_to_nvm(void)
 	}
 	for (offset = 0; offset < hdr.size; offset += NVMCTRL_PAGE_SIZE) {
 		if (spi_flash_read(spi_flash_get_block_size() + offset, page_buffer, sizeof(page_buffer)) < 0) {
-			printf("ERROR: spi_flash_read failed\r\n");
+			log_printf("ERROR: spi_flash_read failed\r\n");
 			return -1;
 		}
 		do {
@@ -15,6 +15,7 @@
 #include "watchdog.h"
 #include "sys_timer.h"
 #include "uart.h"
+#include "log.h"
 
 #if defined(CFG_WDT_TIMEOUT) && !defined(BOOTLOADER)
 
@@ -57,7 +58,9 @@ void wdt_init(uint32_t timeout_sec)
 
 ISR(WDT_Handler)
 {
-	uart_puts(CFG_CONSOLE_CHANNEL, "WDT: EARLY WARNING HANDLER CALLED!\r\n");
+	/* The main loop is stuck and the reset follows: write out the buffered messages now */
+	log_printf("WDT: EARLY WARNING HANDLER CALLED!\r\n");
+	log_flush();
 	WDT->INTFLAG.reg = WDT_INTFLAG_EW;
 }
 
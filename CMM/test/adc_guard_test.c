@@ -0,0 +1,162 @@
+/*
+ * adc_guard_test.c: host test of the rail limits of the ADC guard
+ *
+ * adc_measure.c is compiled into the test with stand-ins for the parts of the ASF ADC driver
+ * it uses, so the static rail_adc_value() and voltages_load_calibration() are tested as built.
+ * For every guarded rail, with and without calibration, the limits derived from
+ * CFG_REFERENCE_*_MIN/MAX are checked against an independent computation, and
+ * adc_guard_check() is checked to trip at and outside the limits (inclusive, like the
+ * window monitor) but not 1 mV inside.
+ *
+ * Created: 10/17/2026
+ *  Author: E1210640
+ */ 
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Stand-ins for the ASF ADC driver, only what adc_measure.c needs to compile */
+#define min(a, b)							((a) < (b) ? (a) : (b))
+#define max(a, b)							((a) > (b) ? (a) : (b))
+#define ADC_AVGCTRL_SAMPLENUM(x)			((x) << 0)
+#define ADC_AVGCTRL_ADJRES(x)				((x) << 4)
+#define ADC_CTRLB_RESSEL_Msk				(3 << 4)
+#define ADC_CTRLB_RESSEL_12BIT				(0 << 4)
+#define ADC_CTRLB_RESSEL_16BIT				(1 << 4)
+#define PIN_PB30							62
+
+typedef struct {
+	struct { uint8_t reg; } AVGCTRL;
+	struct { uint16_t reg; } CTRLB;
+} Adc;
+
+struct adc_module {
+	Adc *hw;
+};
+
+struct adc_config {
+	int clock_source, gain_factor, clock_prescaler, reference, positive_input, resolution;
+};
+
+enum adc_window_mode { ADC_WINDOW_MODE_DISABLE, ADC_WINDOW_MODE_BETWEEN_INVERTED };
+enum { GCLK_GENERATOR_1, ADC_GAIN_FACTOR_1X, ADC_CLOCK_PRESCALER_DIV8, ADC_REFERENCE_AREFA,
+	ADC_POSITIVE_INPUT_PIN2, ADC_RESOLUTION_12BIT, ADC_CALLBACK_READ_BUFFER, ADC_CALLBACK_WINDOW };
+
+static Adc test_adc_hw;
+#define ADC									(&test_adc_hw)
+#define adc_get_config_defaults(c)			((void)(c))
+#define adc_init(m, regs, c)				((void)(c), (m)->hw = (regs))
+#define adc_enable(m)						((void)(m))
+#define adc_register_callback(m, cb, type)	((void)(m), (void)(cb), (void)(type))
+#define adc_enable_callback(m, type)		((void)(m), (void)(type))
+#define adc_set_positive_input(m, input)	((void)(m), (void)(input))
+#define adc_is_syncing(m)					((void)(m), false)
+#define adc_read_buffer_job(m, buf, n)		((void)(m), (void)(buf), (void)(n))
+#define adc_set_window_mode(m, mode, lo, hi)	((void)(m), (void)(mode), (void)(lo), (void)(hi))
+#define ioport_set_pin_level(pin, level)	((void)(pin), (void)(level))
+#define system_interrupt_enter_critical_section()
+#define system_interrupt_leave_critical_section()
+
+#include "adc_measure.c"
+
+struct env_cache_s env_cache;
+uint64_t env_dirty;
+uint64_t env_changed;
+static int failed;
+
+/* Stand-ins for the rest of the firmware */
+uint32_t get_jiffies(void) { return 0; }
+uint32_t sys_timer_cycles(void) { return 0; }
+#if defined(CFG_PROFILE)
+void profile_scope_exit(struct profile_scope *scope) { (void)scope; }
+#endif
+#if defined(CFG_WDT_TIMEOUT)
+void wdt_reset(void) { }
+#endif
+int env_subscribe(uint64_t mask, env_notify_t notify) { (void)mask; (void)notify; return 0; }
+uint8_t smbus_get_input_reg(uint8_t nr) { (void)nr; return 0; }
+void smbus_set_input_reg(uint8_t nr, uint8_t val) { (void)nr; (void)val; }
+void smbus_frame_set_byte(uint8_t nr, uint8_t val) { (void)nr; (void)val; }
+void smbus_frame_set_word(uint8_t nr, uint16_t val) { (void)nr; (void)val; }
+void smbus_telemetry_commit(void) { }
+
+/*
+ * ADC value (16 bit full scale) of a rail voltage, computed independently of rail_adc_value():
+ * the inverse of the calibration, truncated like the integer math of the firmware
+ */
+static uint32_t test_adc_value(uint8_t rail, int32_t millivolt)
+{
+	int64_t full_scale = ADC_REFERENCE_MV * adc_rails[rail].divider;
+	int64_t adc_mv = (int64_t)(millivolt - rail_offset[rail]) * CFG_ADC_CAL_GAIN_UNITY / rail_gain[rail];
+	int64_t value;
+	
+	if (adc_mv < 0) {
+		adc_mv = 0;
+	}
+	value = adc_mv * ADC_FULL_SCALE / full_scale;
+	
+	return value >= ADC_FULL_SCALE ? ADC_FULL_SCALE - 1 : (uint32_t)value;
+}
+
+static void test_expect(const char *what, uint8_t guard, int32_t millivolt, uint32_t value, uint32_t expect)
+{
+	if (value != expect) {
+		printf("FAIL: guard %u at %ld mV: %s is %u, expected %u\n", guard, (long)millivolt, what, value, expect);
+		failed = 1;
+	}
+}
+
+/*
+ * Derived limits and trip/no-trip around them for all guards with the current calibration
+ */
+static void test_guards(void)
+{
+	uint8_t guard, rail;
+	int32_t lo, hi;
+	
+	voltages_load_calibration();
+	for (guard = 0; guard < ADC_GUARD_COUNT; guard++) {
+		rail = adc_guards[guard].rail;
+		lo = adc_guards[guard].min;
+		hi = adc_guards[guard].max;
+		test_expect("low limit", guard, lo, adc_guard_low[guard], test_adc_value(rail, lo));
+		test_expect("high limit", guard, hi, adc_guard_high[guard], test_adc_value(rail, hi));
+		test_expect("trip", guard, lo - 1, adc_guard_check(guard, rail_adc_value(rail, lo - 1)), true);
+		test_expect("trip", guard, lo, adc_guard_check(guard, rail_adc_value(rail, lo)), true);
+		test_expect("trip", guard, lo + 1, adc_guard_check(guard, rail_adc_value(rail, lo + 1)), false);
+		test_expect("trip", guard, (lo + hi) / 2, adc_guard_check(guard, rail_adc_value(rail, (lo + hi) / 2)), false);
+		test_expect("trip", guard, hi - 1, adc_guard_check(guard, rail_adc_value(rail, hi - 1)), false);
+		test_expect("trip", guard, hi, adc_guard_check(guard, rail_adc_value(rail, hi)), true);
+		test_expect("trip", guard, hi + 1, adc_guard_check(guard, rail_adc_value(rail, hi + 1)), true);
+		/* Out of the ADC range: clamped, never wrapped into the window */
+		test_expect("clamped value", guard, -100000, rail_adc_value(rail, -100000), 0);
+		test_expect("clamped value", guard, 1000000, rail_adc_value(rail, 1000000), ADC_FULL_SCALE - 1);
+		test_expect("trip", guard, -100000, adc_guard_check(guard, rail_adc_value(rail, -100000)), true);
+		test_expect("trip", guard, 1000000, adc_guard_check(guard, rail_adc_value(rail, 1000000)), true);
+		/* The limits read back as the configured voltages: both conversions truncate to 1 mV */
+		test_expect("low limit in mV", guard, lo, abs(rail_millivolt(rail, adc_guard_low[guard]) - lo) <= 2, true);
+		test_expect("high limit in mV", guard, hi, abs(rail_millivolt(rail, adc_guard_high[guard]) - hi) <= 2, true);
+	}
+}
+
+int main(void)
+{
+	uint8_t rail;
+	
+	/* Uncalibrated: a gain of 0 (erased environment) falls back to unity */
+	test_guards();
+	for (rail = 0; rail < ADC_RAIL_COUNT; rail++) {
+		test_expect("gain", rail, 0, rail_gain[rail], CFG_ADC_CAL_GAIN_UNITY);
+	}
+	/* Calibrated: the rails read 2 % high and 35 mV low */
+	for (rail = 0; rail < ADC_RAIL_COUNT; rail++) {
+		env_cache.data[adc_rails[rail].gain_env] = CFG_ADC_CAL_GAIN_UNITY * 102 / 100;
+		env_cache.data[adc_rails[rail].offset_env] = (uint32_t)-35;
+	}
+	test_guards();
+	printf("adc_guard_test: %s\n", failed ? "FAILED" : "passed");
+	
+	return failed;
+}
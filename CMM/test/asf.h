@@ -0,0 +1,14 @@
+/*
+ * asf.h: empty stand-in for the ASF on the host, so that config.h can be included by the tests
+ *
+ * Created: 10/17/2026
+ *  Author: E1210640
+ */ 
+
+#ifndef __TEST_ASF_H__
+#define __TEST_ASF_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#endif /* __TEST_ASF_H__ */
@@ -0,0 +1,210 @@
+/*
+ * ring_buffer_test.c: host stress test of the single-producer/single-consumer ring
+ *
+ * A sweep over all positions, fill levels and lengths checks the block copies, then a producer
+ * and a consumer thread move a counting sequence through a small ring with
+ * random block sizes (put/put_buf/write_slot against get/get_buf/read_slot), so that both
+ * sides wrap around constantly and run concurrently. The indices start just below 2^32
+ * to cover their overflow as well.
+ *
+ * Created: 10/17/2026
+ *  Author: E1210640
+ */ 
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* The host may reorder memory accesses, unlike the Cortex-M0+: use a full barrier */
+#define __DMB()		__sync_synchronize()
+
+#include "ring_buffer.h"
+
+#define TEST_RING_SIZE		16
+#define TEST_ITEMS			2000000U
+#define TEST_INDEX_START	0xFFFFFF00U
+
+RING_DECLARE(test_ring, uint32_t, TEST_RING_SIZE)
+
+static struct test_ring ring;
+static volatile int failed;
+
+/* Small per-thread PRNG, so both threads do not share state */
+static uint32_t test_rand(uint32_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static void *producer(void *arg)
+{
+	uint32_t seed = 0x12345678, next = 0, buf[TEST_RING_SIZE + 4], len, i, cnt;
+	uint32_t *slot;
+	
+	(void)arg;
+	while (next < TEST_ITEMS && !failed) {
+		if (!test_ring_space(&ring)) {
+			sched_yield();		/* Let the consumer run on a single core host */
+		}
+		switch (test_rand(&seed) % 3) {
+		case 0:
+			next += test_ring_put(&ring, next);
+			break;
+		case 1:
+			slot = test_ring_write_slot(&ring);
+			if (slot) {
+				*slot = next++;
+				test_ring_write_done(&ring);
+			}
+			break;
+		default:
+			/* Ask for more than fits now and then: put_buf() must clip to the free space */
+			len = test_rand(&seed) % (TEST_RING_SIZE + 4) + 1;
+			if (len > TEST_ITEMS - next) {
+				len = TEST_ITEMS - next;
+			}
+			for (i = 0; i < len; i++) {
+				buf[i] = next + i;
+			}
+			cnt = test_ring_put_buf(&ring, buf, len);
+			if (cnt > len) {
+				printf("FAIL: put_buf() copied %u of %u\n", cnt, len);
+				failed = 1;
+				return NULL;
+			}
+			next += cnt;
+			break;
+		}
+	}
+	
+	return NULL;
+}
+
+static void *consumer(void *arg)
+{
+	uint32_t seed = 0x9abcdef0, expect = 0, buf[TEST_RING_SIZE + 4], len, i, cnt, value;
+	uint32_t *slot;
+	
+	(void)arg;
+	while (expect < TEST_ITEMS && !failed) {
+		if (!test_ring_count(&ring)) {
+			sched_yield();		/* Let the producer run on a single core host */
+		}
+		switch (test_rand(&seed) % 3) {
+		case 0:
+			if (test_ring_get(&ring, &value)) {
+				if (value != expect) {
+					printf("FAIL: get() returned %u, expected %u\n", value, expect);
+					failed = 1;
+				}
+				expect++;
+			}
+			break;
+		case 1:
+			slot = test_ring_read_slot(&ring);
+			if (slot) {
+				if (*slot != expect) {
+					printf("FAIL: read_slot() returned %u, expected %u\n", *slot, expect);
+					failed = 1;
+				}
+				test_ring_read_done(&ring);
+				expect++;
+			}
+			break;
+		default:
+			len = test_rand(&seed) % (TEST_RING_SIZE + 4) + 1;
+			cnt = test_ring_get_buf(&ring, buf, len);
+			if (cnt > len) {
+				printf("FAIL: get_buf() copied %u of %u\n", cnt, len);
+				failed = 1;
+			}
+			for (i = 0; i < cnt && !failed; i++) {
+				if (buf[i] != expect) {
+					printf("FAIL: get_buf() returned %u, expected %u\n", buf[i], expect);
+					failed = 1;
+				}
+				expect++;
+			}
+			break;
+		}
+	}
+	
+	return NULL;
+}
+
+/*
+ * Single-threaded sweep: put_buf()/get_buf() of every length at every position and fill level,
+ * plus the counters and the single entry functions of a full and an empty ring
+ */
+static void test_wrap(void)
+{
+	uint32_t in[TEST_RING_SIZE + 2], out[2 * TEST_RING_SIZE], pos, fill, len, i, cnt, value;
+	
+	for (i = 0; i < TEST_RING_SIZE + 2; i++) {
+		in[i] = 1000 + i;
+	}
+	for (pos = 0; pos < TEST_RING_SIZE; pos++) {
+		for (fill = 0; fill <= TEST_RING_SIZE; fill++) {
+			for (len = 0; len <= TEST_RING_SIZE + 1; len++) {
+				ring.head = ring.tail = TEST_INDEX_START + TEST_RING_SIZE + pos;
+				for (i = 0; i < fill; i++) {
+					test_ring_put(&ring, i);
+				}
+				cnt = test_ring_put_buf(&ring, in, len);
+				if (cnt != (len < TEST_RING_SIZE - fill ? len : TEST_RING_SIZE - fill)
+						|| test_ring_count(&ring) != fill + cnt
+						|| test_ring_space(&ring) != TEST_RING_SIZE - fill - cnt) {
+					printf("FAIL: put_buf() of %u at %u/%u copied %u\n", len, pos, fill, cnt);
+					failed = 1;
+					return;
+				}
+				if (test_ring_get_buf(&ring, out, len + fill) != fill + cnt) {
+					printf("FAIL: get_buf() of %u at %u/%u\n", len + fill, pos, fill);
+					failed = 1;
+					return;
+				}
+				for (i = 0; i < fill + cnt; i++) {
+					if (out[i] != (i < fill ? i : in[i - fill])) {
+						printf("FAIL: entry %u at %u/%u is %u\n", i, pos, fill, out[i]);
+						failed = 1;
+						return;
+					}
+				}
+			}
+		}
+	}
+	ring.head = ring.tail = TEST_INDEX_START;
+	test_ring_put_buf(&ring, in, TEST_RING_SIZE);
+	if (test_ring_space(&ring) != 0 || test_ring_put(&ring, 0) || test_ring_write_slot(&ring)) {
+		printf("FAIL: full ring accepts data\n");
+		failed = 1;
+	}
+	test_ring_get_buf(&ring, out, TEST_RING_SIZE);
+	if (test_ring_count(&ring) != 0 || test_ring_get(&ring, &value) || test_ring_read_slot(&ring)) {
+		printf("FAIL: empty ring returns data\n");
+		failed = 1;
+	}
+}
+
+int main(void)
+{
+	pthread_t prod, cons;
+	
+	test_wrap();
+	ring.head = ring.tail = TEST_INDEX_START;
+	pthread_create(&cons, NULL, consumer, NULL);
+	pthread_create(&prod, NULL, producer, NULL);
+	pthread_join(prod, NULL);
+	pthread_join(cons, NULL);
+	if (!failed && test_ring_count(&ring) != 0) {
+		printf("FAIL: %u entries left\n", test_ring_count(&ring));
+		failed = 1;
+	}
+	printf("ring_buffer_test: %s\n", failed ? "FAILED" : "passed");
+	
+	return failed;
+}
@@ -0,0 +1,181 @@
+/*
+ * sched_test.c: host test of the main loop scheduler with a simulated tick
+ *
+ * The tasks append their letter to a trace and advance the simulated jiffies by their run time,
+ * so the test can check the start order (priority, round robin of the background tasks) and
+ * the deadline accounting. The tick starts just below 2^32 to cover its overflow.
+ *
+ * Created: 10/17/2026
+ *  Author: E1210640
+ */ 
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+#include "sys_timer.h"
+#include "sched.h"
+#include "profile.h"
+
+#define TEST_JIFFIES_START	0xFFFFFFF0U
+
+static uint32_t jiffies;
+static char trace[64];
+static uint8_t trace_len;
+static uint32_t run_time[26];		/* ms per run of task 'A' + n */
+static int failed;
+
+uint32_t get_jiffies(void)
+{
+	return jiffies;
+}
+
+uint32_t sys_timer_cycles(void)
+{
+	return 0;
+}
+
+#ifdef CFG_PROFILE
+void profile_task_done(uint8_t task, uint32_t start)
+{
+	(void)task;
+	(void)start;
+}
+#endif
+
+static void task_run(char name)
+{
+	if (trace_len < sizeof(trace) - 1) {
+		trace[trace_len++] = name;
+	}
+	jiffies += run_time[name - 'A'];
+}
+
+static void task_a(void) { task_run('A'); }
+static void task_b(void) { task_run('B'); }
+static void task_c(void) { task_run('C'); }
+static void task_d(void) { task_run('D'); }
+static void task_e(void) { task_run('E'); }
+
+/* Reset the tick, the trace and the run times, then start the scheduler on the given table */
+static void test_start(const struct sched_task *tasks, struct sched_stats *stats, uint8_t count)
+{
+	jiffies = TEST_JIFFIES_START;
+	memset(trace, 0, sizeof(trace));
+	trace_len = 0;
+	memset(run_time, 0, sizeof(run_time));
+	sched_init(tasks, stats, count);
+}
+
+/* Call sched_run() n times, advancing the tick by step ms before each call */
+static void test_run(int n, uint32_t step)
+{
+	while (n--) {
+		jiffies += step;
+		sched_run();
+	}
+}
+
+static void test_check(const char *test, const char *expect)
+{
+	if (strcmp(trace, expect)) {
+		printf("FAIL: %s: ran \"%s\", expected \"%s\"\n", test, trace, expect);
+		failed = 1;
+	}
+	memset(trace, 0, sizeof(trace));
+	trace_len = 0;
+}
+
+static void test_check_value(const char *test, uint32_t value, uint32_t expect)
+{
+	if (value != expect) {
+		printf("FAIL: %s is %u, expected %u\n", test, value, expect);
+		failed = 1;
+	}
+}
+
+/*
+ * Due periodic tasks start in table order, one per call, before any background task;
+ * the background tasks take turns, skipping the periodic entries of the table
+ */
+static void test_order(void)
+{
+	static const struct sched_task tasks[] = {
+		{ "a", task_a, 10, 0 },
+		{ "b", task_b, 0, 0 },
+		{ "c", task_c, 10, 0 },
+		{ "d", task_d, 0, 0 },
+		{ "e", task_e, 0, 0 },
+	};
+	struct sched_stats stats[5];
+	
+	test_start(tasks, stats, 5);
+	test_run(4, 0);
+	test_check("background round robin", "BDEB");
+	test_run(1, 10);
+	test_run(3, 0);
+	test_check("priority", "ACDE");
+	/* Both periodic tasks are due again, the later one in the table waits */
+	test_run(1, 10);
+	test_run(1, 0);
+	test_check("priority again", "AC");
+	test_check_value("runs of a", stats[0].runs, 2);
+	test_check_value("runs of b", stats[1].runs, 2);
+	test_check_value("runs of d", stats[3].runs, 2);
+}
+
+/*
+ * A periodic task delayed by a long run is late: beyond its deadline it counts a miss.
+ * When it fell behind by more than a period, it runs once and skips the missed runs
+ */
+static void test_deadline(void)
+{
+	static const struct sched_task tasks[] = {
+		{ "a", task_a, 10, 3 },
+		{ "b", task_b, 0, 0 },
+	};
+	struct sched_stats stats[2];
+	
+	test_start(tasks, stats, 2);
+	run_time['B' - 'A'] = 8;
+	/* b runs 0..8, 8..16: a is due at 10 and starts 6 ms late */
+	test_run(3, 0);
+	test_check("late start", "BBA");
+	test_check_value("misses", stats[0].misses, 1);
+	test_check_value("max_late", stats[0].max_late, 6);
+	test_check_value("max_run of b", stats[1].max_run, 8);
+	/* Its next due time stays on the period grid: 20, reached by b at 24 */
+	test_run(2, 0);
+	test_check("next period", "BA");
+	test_check_value("misses", stats[0].misses, 2);
+	test_check_value("max_late", stats[0].max_late, 6);
+	/* Within the deadline: due at 30, b runs 24..32 */
+	run_time['B' - 'A'] = 2;
+	test_run(4, 0);
+	test_check("in time", "BBBA");
+	test_check_value("misses", stats[0].misses, 2);
+	/* b runs 30..75: a (due at 40) runs once at 75, then at 85 instead of back to back */
+	run_time['B' - 'A'] = 45;
+	test_run(1, 0);
+	run_time['B' - 'A'] = 0;
+	test_run(2, 0);
+	test_run(1, 9);
+	test_run(1, 1);
+	test_check("fallen behind", "BABBA");
+	test_check_value("runs of a", stats[0].runs, 5);
+	test_check_value("max_late", stats[0].max_late, 35);
+	test_check_value("max_run of b", stats[1].max_run, 45);
+	sched_clear_stats();
+	test_check_value("cleared misses", stats[0].misses, 0);
+	test_check_value("cleared max_late", stats[0].max_late, 0);
+}
+
+int main(void)
+{
+	test_order();
+	test_deadline();
+	printf("sched_test: %s\n", failed ? "FAILED" : "passed");
+	
+	return failed;
+}